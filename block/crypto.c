@@ -22,6 +22,7 @@
 
 #include "block/block_int.h"
 #include "block/qdict.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -32,13 +33,30 @@
 #include "qemu/option.h"
 #include "qemu/cutils.h"
 #include "qemu/memalign.h"
+#include "qemu/units.h"
 #include "crypto.h"
 
 typedef struct BlockCrypto BlockCrypto;
 
+/*
+ * Number of requests that can encrypt or decrypt in the thread pool at
+ * the same time, each with a cipher of its own
+ */
+#define BLOCK_CRYPTO_MAX_THREADS 16
+
+/*
+ * Smaller requests are encrypted and decrypted in the thread that runs
+ * them, because handing them to a worker thread costs more than the
+ * cipher itself
+ */
+#define BLOCK_CRYPTO_THREAD_MIN_SIZE (64 * KiB)
+
 struct BlockCrypto {
     QCryptoBlock *block;
     bool updating_keys;
+
+    CoQueue thread_task_queue;
+    int nb_threads;
 };
 
 
@@ -295,7 +313,8 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
-                                       1,
+                                       /* and one for inline requests */
+                                       BLOCK_CRYPTO_MAX_THREADS + 1,
                                        errp);
 
     if (!crypto->block) {
@@ -304,6 +323,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     }
 
     bs->encrypted = true;
+    qemu_co_queue_init(&crypto->thread_task_queue);
 
     ret = 0;
  cleanup:
@@ -397,6 +417,51 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+int block_crypto_encdec_pool_func(void *opaque)
+{
+    BlockCryptoEncDecData *data = opaque;
+
+    return data->func(data->block, data->offset, data->buf, data->len, NULL);
+}
+
+/*
+ * Encrypt or decrypt @buf.  Large buffers go to a worker thread, so that
+ * the requests of one image do not all wait for the CPU time of the thread
+ * that runs them.
+ */
+static int coroutine_fn
+block_crypto_co_encdec(BlockDriverState *bs, uint64_t offset, uint8_t *buf,
+                       size_t len, BlockCryptoEncDecFunc func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    BlockCryptoEncDecData arg = {
+        .block = crypto->block,
+        .offset = offset,
+        .buf = buf,
+        .len = len,
+        .func = func,
+    };
+    int ret;
+
+    if (len < BLOCK_CRYPTO_THREAD_MIN_SIZE) {
+        return func(crypto->block, offset, buf, len, NULL);
+    }
+
+    /* All requests run in the AioContext of @bs, no lock is needed */
+    while (crypto->nb_threads >= BLOCK_CRYPTO_MAX_THREADS) {
+        qemu_co_queue_wait(&crypto->thread_task_queue, NULL);
+    }
+    crypto->nb_threads++;
+
+    ret = thread_pool_submit_co(pool, block_crypto_encdec_pool_func, &arg);
+
+    crypto->nb_threads--;
+    qemu_co_queue_next(&crypto->thread_task_queue);
+
+    return ret;
+}
+
 static coroutine_fn int
 block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
                        QEMUIOVector *qiov, BdrvRequestFlags flags)
@@ -440,8 +505,8 @@ block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
+        if (block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                   cur_bytes, qcrypto_block_decrypt) < 0) {
             ret = -EIO;
             goto cleanup;
         }
@@ -496,8 +561,8 @@ block_crypto_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
+        if (block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                   cur_bytes, qcrypto_block_encrypt) < 0) {
             ret = -EIO;
             goto cleanup;
         }
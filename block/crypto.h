@@ -21,6 +21,8 @@
 #ifndef BLOCK_CRYPTO_H
 #define BLOCK_CRYPTO_H
 
+#include "crypto/block.h"
+
 #define BLOCK_CRYPTO_OPT_DEF_KEY_SECRET(prefix, helpstr)                \
     {                                                                   \
         .name = prefix BLOCK_CRYPTO_OPT_QCOW_KEY_SECRET,                \
@@ -131,4 +133,23 @@ block_crypto_amend_opts_init(QDict *opts, Error **errp);
 QCryptoBlockOpenOptions *
 block_crypto_open_opts_init(QDict *opts, Error **errp);
 
+/*
+ * BlockCryptoEncDecFunc: common prototype of qcrypto_block_encrypt() and
+ * qcrypto_block_decrypt() functions.
+ */
+typedef int (*BlockCryptoEncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                                     uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoEncDecData {
+    QCryptoBlock *block;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+
+    BlockCryptoEncDecFunc func;
+} BlockCryptoEncDecData;
+
+/* ThreadPoolFunc that runs a BlockCryptoEncDecData request */
+int block_crypto_encdec_pool_func(void *opaque);
+
 #endif /* BLOCK_CRYPTO_H */
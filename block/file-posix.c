@@ -147,6 +147,7 @@ typedef struct BDRVRawState {
     uint64_t locked_shared_perm;
 
     uint64_t aio_max_batch;
+    uint32_t aio_queue_depth;
 
     int perm_change_fd;
     int perm_change_flags;
@@ -157,6 +158,11 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool use_io_uring_fixed_buffers:1;
+    /* LURING_* flags of the io_uring used for reads and writes */
+    unsigned int luring_flags;
+    /* index of fd in the registered files of the io_uring, or -1 */
+    int luring_fd_index;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -550,6 +556,30 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "aio-queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "AIO queue depth (0 = default of the AIO backend, "
+                    "default: 0)",
+        },
+        {
+            .name = "io-uring-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM as io_uring fixed buffers "
+                    "(default: off)",
+        },
+        {
+            .name = "io-uring-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "busy-poll for io_uring completions, requires O_DIRECT "
+                    "(default: off)",
+        },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "use a kernel thread to poll for io_uring submissions "
+                    "(default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -578,6 +608,83 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_AIO
+static LinuxAioState *raw_laio_setup(BDRVRawState *s, AioContext *ctx,
+                                     Error **errp)
+{
+    LinuxAioState *aio = aio_setup_linux_aio(ctx, errp);
+
+    if (aio && s->aio_queue_depth) {
+        laio_set_queue_depth(aio, s->aio_queue_depth);
+    }
+    return aio;
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Set up the io_uring used for reads and writes in @ctx.  Polled rings
+ * only support reads and writes, so in that case also set up the ring
+ * used for the other requests.
+ */
+static LuringState *raw_luring_setup(BDRVRawState *s, AioContext *ctx,
+                                     Error **errp)
+{
+    LuringState *aio;
+
+    if ((s->luring_flags & LURING_IOPOLL) &&
+        !aio_setup_linux_io_uring(ctx, s->luring_flags & ~LURING_IOPOLL,
+                                  errp)) {
+        return NULL;
+    }
+    aio = aio_setup_linux_io_uring(ctx, s->luring_flags, errp);
+    if (aio && s->aio_queue_depth) {
+        luring_set_queue_depth(aio, s->aio_queue_depth);
+    }
+    return aio;
+}
+
+/*
+ * Return the io_uring for requests other than reads and writes, and the
+ * index of s->fd in its registered files
+ */
+static LuringState *raw_luring_other(BlockDriverState *bs, int *fd_index)
+{
+    BDRVRawState *s = bs->opaque;
+    unsigned int flags = s->luring_flags & ~LURING_IOPOLL;
+
+    *fd_index = flags == s->luring_flags ? s->luring_fd_index : -1;
+    return aio_get_linux_io_uring(bdrv_get_aio_context(bs), flags);
+}
+
+/* Register s->fd with the io_uring of the current AioContext */
+static void raw_luring_register_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    if (!s->use_linux_io_uring || s->fd < 0 || s->luring_fd_index >= 0) {
+        return;
+    }
+    aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs), s->luring_flags);
+    s->luring_fd_index = luring_register_fd(aio, s->fd);
+}
+
+/* Must be called before s->fd is closed or the AioContext changes */
+static void raw_luring_unregister_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    if (s->luring_fd_index < 0) {
+        return;
+    }
+    aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs), s->luring_flags);
+    luring_unregister_fd(aio, s->luring_fd_index);
+    s->luring_fd_index = -1;
+}
+#endif
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -628,8 +735,26 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
 #endif
+    s->use_io_uring_fixed_buffers =
+        qemu_opt_get_bool(opts, "io-uring-fixed-buffers", false);
+    s->luring_flags = 0;
+    if (qemu_opt_get_bool(opts, "io-uring-iopoll", false)) {
+        s->luring_flags |= LURING_IOPOLL;
+    }
+    if (qemu_opt_get_bool(opts, "io-uring-sqpoll", false)) {
+        s->luring_flags |= LURING_SQPOLL;
+    }
+    s->luring_fd_index = -1;
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
+    if (qemu_opt_get_number(opts, "aio-queue-depth", 0) >
+        QEMU_AIO_MAX_QUEUE_DEPTH) {
+        error_setg(errp, "aio-queue-depth must be at most %d",
+                   QEMU_AIO_MAX_QUEUE_DEPTH);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->aio_queue_depth = qemu_opt_get_number(opts, "aio-queue-depth", 0);
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -709,7 +834,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
             ret = -EINVAL;
             goto fail;
         }
-        if (!aio_setup_linux_aio(bdrv_get_aio_context(bs), errp)) {
+        if (!raw_laio_setup(s, bdrv_get_aio_context(bs), errp)) {
             error_prepend(errp, "Unable to use native AIO: ");
             goto fail;
         }
@@ -725,10 +850,25 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+        LuringState *aio;
+
+        if ((s->luring_flags & LURING_IOPOLL) &&
+            !(s->open_flags & O_DIRECT)) {
+            error_setg(errp, "io-uring-iopoll requires cache.direct=on");
+            ret = -EINVAL;
+            goto fail;
+        }
+        aio = raw_luring_setup(s, bdrv_get_aio_context(bs), errp);
+        if (!aio) {
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
         }
+        if (s->use_io_uring_fixed_buffers) {
+            ret = luring_enable_fixed_buffers(aio, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
     }
 #else
     if (s->use_linux_io_uring) {
@@ -738,6 +878,13 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 #endif /* !defined(CONFIG_LINUX_IO_URING) */
+    if ((s->use_io_uring_fixed_buffers || s->luring_flags) &&
+        !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-fixed-buffers, io-uring-iopoll and "
+                   "io-uring-sqpoll require aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 
     s->has_discard = true;
     s->has_write_zeroes = true;
@@ -804,6 +951,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_register_fd(bs);
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -1644,14 +1794,50 @@ static int translate_err(int err)
 #endif
 
 #ifdef CONFIG_FALLOCATE
-static int do_fallocate(int fd, int mode, off_t offset, off_t len)
+/*
+ * Call fallocate() on the same range with each of @modes in turn, stopping
+ * at the first failure.  The index of the mode that failed is returned in
+ * @failed.
+ */
+static int do_fallocate_linked(BlockDriverState *bs, const int *modes,
+                               int nr_modes, off_t offset, off_t len,
+                               int *failed)
 {
-    do {
-        if (fallocate(fd, mode, offset, len) == 0) {
-            return 0;
+    BDRVRawState *s = bs->opaque;
+    int i;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * With aio=io_uring, the handlers are called directly from the request
+     * coroutine rather than from a thread pool worker.
+     */
+    if (qemu_in_coroutine()) {
+        int fd_index;
+        LuringState *aio = raw_luring_other(bs, &fd_index);
+
+        return translate_err(luring_co_fallocate(bs, aio, s->fd, fd_index,
+                                                 modes, nr_modes, offset, len,
+                                                 failed));
+    }
+#endif
+
+    for (i = 0; i < nr_modes; i++) {
+        while (fallocate(s->fd, modes[i], offset, len) < 0) {
+            if (errno != EINTR) {
+                *failed = i;
+                return translate_err(-errno);
+            }
         }
-    } while (errno == EINTR);
-    return translate_err(-errno);
+    }
+    return 0;
+}
+
+static int do_fallocate(BlockDriverState *bs, int mode, off_t offset,
+                        off_t len)
+{
+    int failed;
+
+    return do_fallocate_linked(bs, &mode, 1, offset, len, &failed);
 }
 #endif
 
@@ -1700,7 +1886,7 @@ static int handle_aiocb_write_zeroes(void *opaque)
 
 #ifdef CONFIG_FALLOCATE_ZERO_RANGE
     if (s->has_write_zeroes) {
-        int ret = do_fallocate(s->fd, FALLOC_FL_ZERO_RANGE,
+        int ret = do_fallocate(aiocb->bs, FALLOC_FL_ZERO_RANGE,
                                aiocb->aio_offset, aiocb->aio_nbytes);
         if (ret == -ENOTSUP) {
             s->has_write_zeroes = false;
@@ -1718,12 +1904,16 @@ static int handle_aiocb_write_zeroes(void *opaque)
 
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
     if (s->has_discard && s->has_fallocate) {
-        int ret = do_fallocate(s->fd,
-                               FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-                               aiocb->aio_offset, aiocb->aio_nbytes);
+        /* Punch a hole, then allocate it again */
+        const int modes[] = { FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0 };
+        int failed;
+        int ret = do_fallocate_linked(aiocb->bs, modes, ARRAY_SIZE(modes),
+                                      aiocb->aio_offset, aiocb->aio_nbytes,
+                                      &failed);
         if (ret == 0) {
-            ret = do_fallocate(s->fd, 0, aiocb->aio_offset, aiocb->aio_nbytes);
-            if (ret == 0 || ret != -ENOTSUP) {
+            return 0;
+        } else if (failed == 1) {
+            if (ret != -ENOTSUP) {
                 return ret;
             }
             s->has_fallocate = false;
@@ -1751,7 +1941,8 @@ static int handle_aiocb_write_zeroes(void *opaque)
      * can be done via fallocate(fd, 0) */
     len = bdrv_getlength(aiocb->bs);
     if (s->has_fallocate && len >= 0 && aiocb->aio_offset >= len) {
-        int ret = do_fallocate(s->fd, 0, aiocb->aio_offset, aiocb->aio_nbytes);
+        int ret = do_fallocate(aiocb->bs, 0, aiocb->aio_offset,
+                               aiocb->aio_nbytes);
         if (ret == 0 || ret != -ENOTSUP) {
             return ret;
         }
@@ -1770,7 +1961,8 @@ static int handle_aiocb_write_zeroes_unmap(void *opaque)
     /* First try to write zeros and unmap at the same time */
 
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
-    int ret = do_fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+    int ret = do_fallocate(aiocb->bs,
+                           FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
                            aiocb->aio_offset, aiocb->aio_nbytes);
     switch (ret) {
     case -ENOTSUP:
@@ -1858,7 +2050,8 @@ static int handle_aiocb_discard(void *opaque)
 #endif
     } else {
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
-        ret = do_fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        ret = do_fallocate(aiocb->bs,
+                           FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
                            aiocb->aio_offset, aiocb->aio_nbytes);
         ret = translate_err(ret);
 #elif defined(__APPLE__) && (__MACH__)
@@ -2080,9 +2273,11 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         assert(qiov->size == bytes);
-        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        return luring_co_submit(bs, aio, s->fd, s->luring_fd_index, offset,
+                                qiov, type);
 #endif
 #ifdef CONFIG_LINUX_AIO
     } else if (s->use_linux_aio) {
@@ -2135,7 +2330,8 @@ static void raw_aio_plug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         luring_io_plug(bs, aio);
     }
 #endif
@@ -2152,7 +2348,8 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         luring_io_unplug(bs, aio);
     }
 #endif
@@ -2177,8 +2374,11 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        int fd_index;
+        LuringState *aio = raw_luring_other(bs, &fd_index);
+
+        return luring_co_submit(bs, aio, s->fd, fd_index, 0, NULL,
+                                QEMU_AIO_FLUSH);
     }
 #endif
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
@@ -2191,7 +2391,7 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
 #ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
         Error *local_err = NULL;
-        if (!aio_setup_linux_aio(new_context, &local_err)) {
+        if (!raw_laio_setup(s, new_context, &local_err)) {
             error_reportf_err(local_err, "Unable to use native AIO, "
                                          "falling back to thread pool: ");
             s->use_linux_aio = false;
@@ -2201,19 +2401,37 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
         Error *local_err = NULL;
-        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+        LuringState *aio = raw_luring_setup(s, new_context, &local_err);
+
+        if (!aio) {
             error_reportf_err(local_err, "Unable to use linux io_uring, "
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
+        } else if (s->use_io_uring_fixed_buffers &&
+                   luring_enable_fixed_buffers(aio, &local_err) < 0) {
+            error_reportf_err(local_err, "Unable to use io_uring fixed "
+                                         "buffers: ");
+            s->use_io_uring_fixed_buffers = false;
         }
+        raw_luring_register_fd(bs);
     }
 #endif
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_unregister_fd(bs);
+#endif
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_unregister_fd(bs);
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -2993,6 +3211,14 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes,
         acb.aio_type |= QEMU_AIO_BLKDEV;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* fallocate() can be submitted to io_uring, but not BLKDISCARD */
+    if (s->use_linux_io_uring && !blkdev) {
+        ret = handle_aiocb_discard(&acb);
+        raw_account_discard(s, bytes, ret);
+        return ret;
+    }
+#endif
     ret = raw_thread_pool_submit(bs, handle_aiocb_discard, &acb);
     raw_account_discard(s, bytes, ret);
     return ret;
@@ -3068,6 +3294,12 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
         handler = handle_aiocb_write_zeroes;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* fallocate() can be submitted to io_uring, but not BLKZEROOUT */
+    if (s->use_linux_io_uring && !blkdev) {
+        return handler(&acb);
+    }
+#endif
     return raw_thread_pool_submit(bs, handler, &acb);
 }
 
@@ -3086,11 +3318,30 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 static BlockStatsSpecificFile get_blockstats_specific_file(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
-    return (BlockStatsSpecificFile) {
+    BlockStatsSpecificFile stats = {
         .discard_nb_ok = s->stats.discard_nb_ok,
         .discard_nb_failed = s->stats.discard_nb_failed,
         .discard_bytes_ok = s->stats.discard_bytes_ok,
     };
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_linux_aio) {
+        stats.has_aio = true;
+        stats.aio = g_new(BlockStatsSpecificFileAio, 1);
+        laio_get_stats(aio_get_linux_aio(bdrv_get_aio_context(bs)),
+                       stats.aio);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        stats.has_aio = true;
+        stats.aio = g_new(BlockStatsSpecificFileAio, 1);
+        luring_get_stats(aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                s->luring_flags),
+                         stats.aio);
+    }
+#endif
+    return stats;
 }
 
 static BlockStatsSpecific *raw_get_specific_stats(BlockDriverState *bs)
@@ -3210,8 +3461,14 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        raw_luring_unregister_fd(bs);
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
+#ifdef CONFIG_LINUX_IO_URING
+        raw_luring_register_fd(bs);
+#endif
         s->open_flags = s->perm_change_flags;
     }
     s->perm_change_fd = 0;
@@ -3312,6 +3569,7 @@ BlockDriver bdrv_file = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3684,6 +3942,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3808,6 +4067,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3938,6 +4198,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -15,18 +15,50 @@
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
+#include "exec/memory.h"
+#include "exec/ramlist.h"
 #include "trace.h"
 
-/* io_uring ring size */
-#define MAX_ENTRIES 128
+/* io_uring ring size, unless configured otherwise */
+#define DEFAULT_ENTRIES 128
+
+/* The ring grows automatically up to this size when it is too small */
+#define AUTO_MAX_ENTRIES 1024
+
+/* Number of slots in the table of registered files */
+#define MAX_FILES 64
+
+/* The kernel refuses to register fixed buffers larger than this */
+#define MAX_FIXED_BUFFER_SIZE (1 * GiB)
+
+/* Maximum length of a chain of linked fallocate requests */
+#define MAX_LINKED 4
+
+/*
+ * Guest RAM, split into chunks that can be registered as fixed buffers.
+ * The RAM block notifier runs in the main loop, while each ring picks
+ * the new list up in its own thread when it has no requests in flight;
+ * @gen tells when that is needed.
+ */
+static struct {
+    QemuMutex lock;
+    GArray *chunks;
+    unsigned int gen;
+    int users;
+    RAMBlockNotifier notifier;
+} luring_ram;
 
 typedef struct LuringAIOCB {
+    /* coroutine to wake up, NULL for all but the last linked request */
     Coroutine *co;
     struct io_uring_sqe sqeq;
     ssize_t ret;
     QEMUIOVector *qiov;
     bool is_read;
+    /* index in the registered files, or -1 */
+    int fd_index;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
     /*
@@ -42,6 +74,8 @@ typedef struct LuringQueue {
     unsigned int in_queue;
     unsigned int in_flight;
     bool blocked;
+    /* the ring was found full, and no request has completed since */
+    bool full;
     QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
 } LuringQueue;
 
@@ -49,12 +83,29 @@ typedef struct LuringState {
     AioContext *aio_context;
 
     struct io_uring ring;
+    /* LURING_* flags */
+    unsigned int flags;
+    /* size of the ring, and the size to grow it to when it is idle */
+    unsigned int entries;
+    unsigned int wanted_entries;
 
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
+    BlockStatsSpecificFileAio stats;
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /* fds in the registered file table, -1 for free slots */
+    int files[MAX_FILES];
+    bool files_registered;
+
+    /* guest RAM registered as fixed buffers, sorted by address */
+    bool use_fixed_buffers;
+    bool fixed_buffers_ok;
+    unsigned int fixed_buffers_gen;
+    struct iovec *fixed_buffers;
+    unsigned int nr_fixed_buffers;
 } LuringState;
 
 /**
@@ -87,6 +138,16 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 
     trace_luring_resubmit_short_read(s, luringcb, nread);
 
+    /* Fixed buffers only ever cover a single contiguous buffer */
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        luringcb->total_read += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len -= nread;
+        luringcb->sqeq.off += nread;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Update read position */
     luringcb->total_read = nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
@@ -109,6 +170,20 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luring_resubmit(s, luringcb);
 }
 
+/*
+ * With IORING_SETUP_IOPOLL, nothing tells us that requests have completed:
+ * completions have to be reaped by entering the kernel, unless the SQ
+ * thread does it for us.
+ */
+static void luring_reap_polled(LuringState *s)
+{
+    if ((s->flags & LURING_IOPOLL) && !(s->flags & LURING_SQPOLL) &&
+        s->io_q.in_flight && !io_uring_cq_ready(&s->ring)) {
+        /* liburing sets IORING_ENTER_GETEVENTS for polled rings */
+        io_uring_submit(&s->ring);
+    }
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -143,6 +218,7 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
+    luring_reap_polled(s);
     while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
@@ -158,6 +234,9 @@ static void luring_process_completions(LuringState *s)
 
         /* Change counters one-by-one because we can be nested. */
         s->io_q.in_flight--;
+        if (s->io_q.in_flight + s->io_q.in_queue < s->entries) {
+            s->io_q.full = false;
+        }
         trace_luring_process_completion(s, luringcb, ret);
 
         /* total_read is non-zero only for resubmitted read requests */
@@ -165,10 +244,10 @@ static void luring_process_completions(LuringState *s)
 
         if (ret < 0) {
             /*
-             * Only writev/readv/fsync requests on regular files or host block
-             * devices are submitted. Therefore -EAGAIN is not expected but it's
-             * known to happen sometimes with Linux SCSI. Submit again and hope
-             * the request completes successfully.
+             * Only writev/readv/fsync/fallocate requests on regular files or
+             * host block devices are submitted. Therefore -EAGAIN is not
+             * expected but it's known to happen sometimes with Linux SCSI.
+             * Submit again and hope the request completes successfully.
              *
              * For more information, see:
              * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
@@ -177,8 +256,12 @@ static void luring_process_completions(LuringState *s)
              * future, then this workaround may need to be extended to deal with
              * genuine -EAGAIN results that should not be resubmitted
              * immediately.
+             *
+             * Resubmitting a single fallocate request would break the chain
+             * it belongs to, so luring_co_fallocate() retries those itself.
              */
-            if (ret == -EINTR || ret == -EAGAIN) {
+            if ((ret == -EINTR || ret == -EAGAIN) &&
+                luringcb->sqeq.opcode != IORING_OP_FALLOCATE) {
                 luring_resubmit(s, luringcb);
                 continue;
             }
@@ -213,11 +296,105 @@ end:
          * eventually runs later. Coroutines cannot be entered recursively
          * so avoid doing that!
          */
-        if (!qemu_coroutine_entered(luringcb->co)) {
+        if (luringcb->co && !qemu_coroutine_entered(luringcb->co)) {
             aio_co_wake(luringcb->co);
         }
     }
-    qemu_bh_cancel(s->completion_bh);
+
+    /*
+     * Polled completions do not wake up the event loop, so keep coming
+     * back here for as long as requests are in flight.
+     */
+    if (!(s->flags & LURING_IOPOLL) || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
+}
+
+static void qemu_luring_completion_cb(void *opaque);
+static bool qemu_luring_poll_cb(void *opaque);
+static void qemu_luring_poll_ready(void *opaque);
+
+static int luring_ring_init(LuringState *s, struct io_uring *ring,
+                            unsigned int entries)
+{
+    unsigned int setup_flags = 0;
+
+    if (s->flags & LURING_IOPOLL) {
+        setup_flags |= IORING_SETUP_IOPOLL;
+    }
+    if (s->flags & LURING_SQPOLL) {
+        setup_flags |= IORING_SETUP_SQPOLL;
+    }
+    return io_uring_queue_init(entries, ring, setup_flags);
+}
+
+/*
+ * Replace the ring with one of s->wanted_entries entries.  This can only be
+ * done while no request is in flight.  Queued requests can stay queued,
+ * because the registered files and buffers keep their indices in the new
+ * ring.
+ */
+static void luring_resize(LuringState *s)
+{
+    struct io_uring ring;
+    int ret;
+
+    if (s->wanted_entries <= s->entries || s->io_q.in_flight) {
+        return;
+    }
+
+    ret = luring_ring_init(s, &ring, s->wanted_entries);
+    if (ret == 0) {
+        if (s->files_registered) {
+            ret = io_uring_register_files(&ring, s->files, MAX_FILES);
+        }
+        if (ret == 0 && s->nr_fixed_buffers) {
+            ret = io_uring_register_buffers(&ring, s->fixed_buffers,
+                                            s->nr_fixed_buffers);
+        }
+        if (ret < 0) {
+            io_uring_queue_exit(&ring);
+        }
+    }
+    trace_luring_resize(s, s->entries, s->wanted_entries, ret);
+    if (ret < 0) {
+        /* Keep the current ring and do not try again */
+        s->wanted_entries = s->entries;
+        return;
+    }
+
+    if (s->aio_context) {
+        aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                           NULL, NULL, NULL, NULL, s);
+    }
+    io_uring_queue_exit(&s->ring);
+    s->ring = ring;
+    if (s->aio_context) {
+        aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                           qemu_luring_completion_cb, NULL,
+                           qemu_luring_poll_cb, qemu_luring_poll_ready, s);
+    }
+    s->entries = s->wanted_entries;
+    s->stats.queue_depth = s->entries;
+    s->stats.resizes++;
+    s->io_q.full = false;
+}
+
+/*
+ * Called when the ring was too small for the queued requests; grow it the
+ * next time no request is in flight.  Further submissions while the ring
+ * stays full are not counted again.
+ */
+static void luring_queue_full(LuringState *s)
+{
+    if (s->io_q.full) {
+        return;
+    }
+    s->io_q.full = true;
+    s->stats.queue_full++;
+    if (s->wanted_entries < AUTO_MAX_ENTRIES) {
+        s->wanted_entries = MAX(s->wanted_entries, s->entries * 2);
+    }
 }
 
 static int ioq_submit(LuringState *s)
@@ -225,6 +402,11 @@ static int ioq_submit(LuringState *s)
     int ret = 0;
     LuringAIOCB *luringcb, *luringcb_next;
 
+    luring_resize(s);
+    if (s->io_q.in_queue > s->entries) {
+        luring_queue_full(s);
+    }
+
     while (s->io_q.in_queue > 0) {
         /*
          * Try to fetch sqes from the ring for requests waiting in
@@ -232,7 +414,20 @@ static int ioq_submit(LuringState *s)
          */
         QSIMPLEQ_FOREACH_SAFE(luringcb, &s->io_q.submit_queue, next,
                               luringcb_next) {
-            struct io_uring_sqe *sqes = io_uring_get_sqe(&s->ring);
+            struct io_uring_sqe *sqes;
+            LuringAIOCB *link = luringcb;
+            unsigned int nr = 1;
+
+            /* Do not split a chain of linked requests across submissions */
+            while (link->sqeq.flags & IOSQE_IO_LINK) {
+                link = QSIMPLEQ_NEXT(link, next);
+                nr++;
+            }
+            if (io_uring_sq_space_left(&s->ring) < nr) {
+                break;
+            }
+
+            sqes = io_uring_get_sqe(&s->ring);
             if (!sqes) {
                 break;
             }
@@ -247,8 +442,14 @@ static int ioq_submit(LuringState *s)
             if (ret == -EAGAIN || ret == -EINTR) {
                 continue;
             }
+            if (ret == -EBUSY) {
+                /* The completion queue is full */
+                luring_queue_full(s);
+            }
             break;
         }
+        s->stats.submissions++;
+        s->stats.submitted_requests += ret;
         s->io_q.in_flight += ret;
         s->io_q.in_queue  -= ret;
     }
@@ -291,6 +492,7 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    luring_reap_polled(s);
     return io_uring_cq_ready(&s->ring);
 }
 
@@ -308,6 +510,7 @@ static void ioq_init(LuringQueue *io_q)
     io_q->in_queue = 0;
     io_q->in_flight = 0;
     io_q->blocked = false;
+    io_q->full = false;
 }
 
 void luring_io_plug(BlockDriverState *bs, LuringState *s)
@@ -323,10 +526,315 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
                            s->io_q.in_queue, s->io_q.in_flight);
     if (--s->io_q.plugged == 0 &&
         !s->io_q.blocked && s->io_q.in_queue > 0) {
+        s->stats.unplugs++;
         ioq_submit(s);
     }
 }
 
+/**
+ * luring_set_queue_depth:
+ * @s: AIO state
+ * @entries: number of requests that should fit in the ring
+ *
+ * The ring is shared by all users of @s, so it is only ever grown.  It
+ * still grows automatically beyond @entries when it is too small.
+ */
+void luring_set_queue_depth(LuringState *s, unsigned int entries)
+{
+    entries = MIN(pow2ceil(entries), QEMU_AIO_MAX_QUEUE_DEPTH);
+    s->wanted_entries = MAX(s->wanted_entries, entries);
+    luring_resize(s);
+}
+
+void luring_get_stats(LuringState *s, BlockStatsSpecificFileAio *stats)
+{
+    *stats = s->stats;
+}
+
+/**
+ * luring_register_fd:
+ * @s: AIO state
+ * @fd: file descriptor to register
+ *
+ * Adds @fd to the registered files of the ring, which saves the kernel
+ * looking it up for every request.  The caller must pass the returned
+ * index to luring_co_submit() and release it with luring_unregister_fd()
+ * before closing @fd.
+ *
+ * Returns: the index of @fd in the registered files, or -1 if the file
+ * cannot be registered.
+ */
+int luring_register_fd(LuringState *s, int fd)
+{
+    int i, ret;
+
+    if (!s->files_registered) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FILES; i++) {
+        if (s->files[i] == -1) {
+            break;
+        }
+    }
+    if (i == MAX_FILES) {
+        return -1;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, i, &fd, 1);
+    trace_luring_register_fd(s, fd, i, ret);
+    if (ret != 1) {
+        return -1;
+    }
+    s->files[i] = fd;
+    return i;
+}
+
+/**
+ * luring_unregister_fd:
+ * @s: AIO state
+ * @index: index returned by luring_register_fd()
+ */
+void luring_unregister_fd(LuringState *s, int index)
+{
+    int fd = -1;
+
+    assert(index >= 0 && index < MAX_FILES && s->files[index] != -1);
+    trace_luring_unregister_fd(s, s->files[index], index);
+    io_uring_register_files_update(&s->ring, index, &fd, 1);
+    s->files[index] = -1;
+}
+
+static void luring_ram_add(void *host, size_t size)
+{
+    size_t offset;
+
+    for (offset = 0; offset < size; offset += MAX_FIXED_BUFFER_SIZE) {
+        struct iovec iov = {
+            .iov_base = host + offset,
+            .iov_len = MIN(size - offset, MAX_FIXED_BUFFER_SIZE),
+        };
+        unsigned int i;
+
+        for (i = 0; i < luring_ram.chunks->len; i++) {
+            if (g_array_index(luring_ram.chunks, struct iovec, i).iov_base >
+                iov.iov_base) {
+                break;
+            }
+        }
+        g_array_insert_val(luring_ram.chunks, i, iov);
+    }
+}
+
+static void luring_ram_remove(void *host, size_t size)
+{
+    unsigned int i = 0;
+
+    while (i < luring_ram.chunks->len) {
+        struct iovec *iov = &g_array_index(luring_ram.chunks, struct iovec, i);
+
+        if (iov->iov_base >= host && iov->iov_base < host + size) {
+            g_array_remove_index(luring_ram.chunks, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size, size_t max_size)
+{
+    qemu_mutex_lock(&luring_ram.lock);
+    luring_ram_add(host, size);
+    qatomic_inc(&luring_ram.gen);
+    qemu_mutex_unlock(&luring_ram.lock);
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size, size_t max_size)
+{
+    qemu_mutex_lock(&luring_ram.lock);
+    luring_ram_remove(host, max_size);
+    qatomic_inc(&luring_ram.gen);
+    qemu_mutex_unlock(&luring_ram.lock);
+}
+
+static void luring_ram_block_resized(RAMBlockNotifier *n, void *host,
+                                     size_t old_size, size_t new_size)
+{
+    qemu_mutex_lock(&luring_ram.lock);
+    luring_ram_remove(host, old_size);
+    luring_ram_add(host, new_size);
+    qatomic_inc(&luring_ram.gen);
+    qemu_mutex_unlock(&luring_ram.lock);
+}
+
+/**
+ * luring_enable_fixed_buffers:
+ * @s: AIO state
+ * @errp: pointer to an error
+ *
+ * Registers guest RAM as fixed buffers of the ring, so that the kernel
+ * does not have to pin the pages of every request.  This pins all of guest
+ * RAM and therefore disables discarding it, e.g. by virtio-balloon, for
+ * as long as the ring exists.
+ *
+ * Returns: 0 on success, -errno on failure.
+ */
+int luring_enable_fixed_buffers(LuringState *s, Error **errp)
+{
+    int ret;
+
+    if (s->use_fixed_buffers) {
+        return 0;
+    }
+
+    if (luring_ram.users++ == 0) {
+        ret = ram_block_discard_disable(true);
+        if (ret) {
+            luring_ram.users--;
+            error_setg_errno(errp, -ret,
+                             "Cannot disable RAM discard for fixed buffers");
+            return ret;
+        }
+        if (!luring_ram.chunks) {
+            qemu_mutex_init(&luring_ram.lock);
+            luring_ram.chunks = g_array_new(false, false, sizeof(struct iovec));
+        }
+        luring_ram.notifier.ram_block_added = luring_ram_block_added;
+        luring_ram.notifier.ram_block_removed = luring_ram_block_removed;
+        luring_ram.notifier.ram_block_resized = luring_ram_block_resized;
+        ram_block_notifier_add(&luring_ram.notifier);
+    }
+
+    s->use_fixed_buffers = true;
+    /* Make the ring pick up the current RAM list */
+    s->fixed_buffers_gen = qatomic_read(&luring_ram.gen) - 1;
+    return 0;
+}
+
+static void luring_disable_fixed_buffers(LuringState *s)
+{
+    if (!s->use_fixed_buffers) {
+        return;
+    }
+    s->use_fixed_buffers = false;
+    g_free(s->fixed_buffers);
+    s->fixed_buffers = NULL;
+    s->nr_fixed_buffers = 0;
+
+    if (--luring_ram.users == 0) {
+        ram_block_notifier_remove(&luring_ram.notifier);
+        g_array_set_size(luring_ram.chunks, 0);
+        ram_block_discard_disable(false);
+    }
+}
+
+/*
+ * Register the current guest RAM list if it changed.  Requests that are
+ * queued or in flight may refer to the old fixed buffers, so this has to
+ * wait until there are none; in the meantime, no fixed buffer is used.
+ */
+static void luring_update_fixed_buffers(LuringState *s)
+{
+    unsigned int gen = qatomic_read(&luring_ram.gen);
+    int ret;
+
+    if (s->fixed_buffers_gen == gen) {
+        return;
+    }
+    s->fixed_buffers_ok = false;
+    if (s->io_q.in_flight || s->io_q.in_queue) {
+        return;
+    }
+
+    if (s->nr_fixed_buffers) {
+        io_uring_unregister_buffers(&s->ring);
+        g_free(s->fixed_buffers);
+        s->fixed_buffers = NULL;
+        s->nr_fixed_buffers = 0;
+    }
+
+    qemu_mutex_lock(&luring_ram.lock);
+    gen = qatomic_read(&luring_ram.gen);
+    s->nr_fixed_buffers = luring_ram.chunks->len;
+    s->fixed_buffers = g_memdup2(luring_ram.chunks->data,
+                                 s->nr_fixed_buffers * sizeof(struct iovec));
+    qemu_mutex_unlock(&luring_ram.lock);
+
+    ret = 0;
+    if (s->nr_fixed_buffers) {
+        ret = io_uring_register_buffers(&s->ring, s->fixed_buffers,
+                                        s->nr_fixed_buffers);
+    }
+    trace_luring_register_buffers(s, s->nr_fixed_buffers, ret);
+    if (ret < 0) {
+        g_free(s->fixed_buffers);
+        s->fixed_buffers = NULL;
+        s->nr_fixed_buffers = 0;
+    }
+    s->fixed_buffers_gen = gen;
+    s->fixed_buffers_ok = s->nr_fixed_buffers > 0;
+}
+
+/*
+ * Returns the index of the fixed buffer containing the whole of @qiov, or
+ * -1 if there is none.
+ */
+static int luring_find_fixed_buffer(LuringState *s, QEMUIOVector *qiov)
+{
+    uint8_t *base;
+    size_t len;
+    int lo = 0, hi;
+
+    if (!s->use_fixed_buffers) {
+        return -1;
+    }
+    luring_update_fixed_buffers(s);
+    if (!s->fixed_buffers_ok || qiov->niov != 1) {
+        return -1;
+    }
+
+    base = qiov->iov[0].iov_base;
+    len = qiov->iov[0].iov_len;
+    hi = s->nr_fixed_buffers - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        struct iovec *buf = &s->fixed_buffers[mid];
+
+        if (base < (uint8_t *)buf->iov_base) {
+            hi = mid - 1;
+        } else if (base >= (uint8_t *)buf->iov_base + buf->iov_len) {
+            lo = mid + 1;
+        } else {
+            return base + len <= (uint8_t *)buf->iov_base + buf->iov_len ?
+                   mid : -1;
+        }
+    }
+    return -1;
+}
+
+/* Submit the queued requests unless the queue is plugged */
+static int luring_queue_submit(LuringState *s)
+{
+    int ret;
+
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked && s->io_q.plugged &&
+        s->io_q.in_flight + s->io_q.in_queue >= s->entries) {
+        /* The batch has to be split */
+        luring_queue_full(s);
+    }
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= s->entries)) {
+        ret = ioq_submit(s);
+        trace_luring_do_submit_done(s, ret);
+        return ret;
+    }
+    return 0;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -341,17 +849,31 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
 static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
-    int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int buf_index = -1;
+
+    if (type == QEMU_AIO_WRITE || type == QEMU_AIO_READ) {
+        buf_index = luring_find_fixed_buffer(s, luringcb->qiov);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                      luringcb->qiov->size, offset, buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                                 luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                     luringcb->qiov->size, offset, buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -361,24 +883,20 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (luringcb->fd_index >= 0) {
+        sqes->fd = luringcb->fd_index;
+        io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
-    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
-                           s->io_q.in_queue, s->io_q.in_flight);
-    if (!s->io_q.blocked &&
-        (!s->io_q.plugged ||
-         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
-        ret = ioq_submit(s);
-        trace_luring_do_submit_done(s, ret);
-        return ret;
-    }
-    return 0;
+    return luring_queue_submit(s);
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
-                                  uint64_t offset, QEMUIOVector *qiov, int type)
+                                  int fd_index, uint64_t offset,
+                                  QEMUIOVector *qiov, int type)
 {
     int ret;
     LuringAIOCB luringcb = {
@@ -386,6 +904,7 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
         .ret        = -EINPROGRESS,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
+        .fd_index   = fd_index,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
@@ -401,6 +920,80 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     return luringcb.ret;
 }
 
+/**
+ * luring_co_fallocate:
+ * @modes: fallocate() modes, applied in this order to the same range
+ * @nr_modes: number of elements in @modes
+ * @failed: index of the mode that failed, set on error
+ *
+ * Submits one fallocate request for each mode.  The requests are linked, so
+ * that each one only starts once the previous one has succeeded.
+ *
+ * Returns 0 on success, or the error of the first request that failed.
+ */
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, LuringState *s,
+                                     int fd, int fd_index, const int *modes,
+                                     int nr_modes, uint64_t offset,
+                                     uint64_t len, int *failed)
+{
+    LuringAIOCB luringcb[MAX_LINKED];
+    int first = 0;
+    int i, ret;
+
+    assert(nr_modes > 0 && nr_modes <= MAX_LINKED);
+    trace_luring_co_fallocate(bs, s, fd, offset, len, nr_modes);
+
+    for (;;) {
+        for (i = first; i < nr_modes; i++) {
+            struct io_uring_sqe *sqes = &luringcb[i].sqeq;
+
+            luringcb[i] = (LuringAIOCB) {
+                .co         = i == nr_modes - 1 ? qemu_coroutine_self() : NULL,
+                .ret        = -EINPROGRESS,
+                .fd_index   = fd_index,
+            };
+            io_uring_prep_fallocate(sqes, fd, modes[i], offset, len);
+            if (fd_index >= 0) {
+                sqes->fd = fd_index;
+                io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+            }
+            if (i < nr_modes - 1) {
+                sqes->flags |= IOSQE_IO_LINK;
+            }
+            io_uring_sqe_set_data(sqes, &luringcb[i]);
+            QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, &luringcb[i], next);
+            s->io_q.in_queue++;
+        }
+
+        ret = luring_queue_submit(s);
+        if (ret < 0) {
+            *failed = first;
+            return ret;
+        }
+
+        /* Linked requests complete in order, so the last one comes last */
+        if (luringcb[nr_modes - 1].ret == -EINPROGRESS) {
+            qemu_coroutine_yield();
+        }
+
+        for (i = first; i < nr_modes; i++) {
+            assert(luringcb[i].ret != -EINPROGRESS);
+            if (luringcb[i].ret < 0) {
+                break;
+            }
+        }
+        if (i == nr_modes) {
+            return 0;
+        }
+        if (luringcb[i].ret != -EINTR && luringcb[i].ret != -EAGAIN) {
+            *failed = i;
+            return luringcb[i].ret;
+        }
+        /* Retry from the interrupted request, the previous ones are done */
+        first = i;
+    }
+}
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd, false,
@@ -418,28 +1011,44 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(unsigned int flags, Error **errp)
 {
-    int rc;
+    int rc, i;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    s->flags = flags;
+    rc = luring_ring_init(s, ring, DEFAULT_ENTRIES);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
+    s->entries = DEFAULT_ENTRIES;
+    s->wanted_entries = DEFAULT_ENTRIES;
+    s->stats.queue_depth = DEFAULT_ENTRIES;
 
     ioq_init(&s->io_q);
+
+    /*
+     * Start with an empty table of registered files, filled in by
+     * luring_register_fd().  Kernels that do not support sparse tables
+     * just don't get registered files.
+     */
+    for (i = 0; i < MAX_FILES; i++) {
+        s->files[i] = -1;
+    }
+    s->files_registered = io_uring_register_files(ring, s->files,
+                                                  MAX_FILES) == 0;
     return s;
 
 }
 
 void luring_cleanup(LuringState *s)
 {
+    luring_disable_fixed_buffers(s);
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
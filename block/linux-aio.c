@@ -19,14 +19,16 @@
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
+ * Queue size (per-AioContext), unless configured otherwise.
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
  *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ *      than this they wait in the pending queue until some complete.
  */
-#define MAX_EVENTS 1024
+#define DEFAULT_EVENTS 1024
+
+/* The queue grows automatically up to this size when it is too small */
+#define AUTO_MAX_EVENTS 4096
 
 /* Maximum number of requests in a batch. (default value) */
 #define DEFAULT_MAX_BATCH 32
@@ -47,6 +49,8 @@ typedef struct {
     unsigned int in_queue;
     unsigned int in_flight;
     bool blocked;
+    /* the queue was found full, and no request has completed since */
+    bool full;
     QSIMPLEQ_HEAD(, qemu_laiocb) pending;
 } LaioQueue;
 
@@ -56,8 +60,14 @@ struct LinuxAioState {
     io_context_t ctx;
     EventNotifier e;
 
+    /* size of ctx, and the size to grow it to when it is idle */
+    unsigned int max_events;
+    unsigned int wanted_events;
+    struct iocb **iocbs;
+
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LaioQueue io_q;
+    BlockStatsSpecificFileAio stats;
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
@@ -216,6 +226,9 @@ static void qemu_laio_process_completions(LinuxAioState *s)
 
             /* Change counters one-by-one because we can be nested. */
             s->io_q.in_flight--;
+            if (s->io_q.in_flight + s->io_q.in_queue < s->max_events) {
+                s->io_q.full = false;
+            }
             s->event_idx++;
             qemu_laio_process_completion(laiocb);
         }
@@ -281,29 +294,83 @@ static void ioq_init(LaioQueue *io_q)
     io_q->in_queue = 0;
     io_q->in_flight = 0;
     io_q->blocked = false;
+    io_q->full = false;
+}
+
+/*
+ * Replace the AIO context with one of s->wanted_events events.  This can
+ * only be done while no request is in flight and no completion is being
+ * processed.
+ */
+static void laio_resize(LinuxAioState *s)
+{
+    io_context_t ctx = 0;
+    int rc;
+
+    if (s->wanted_events <= s->max_events || s->io_q.in_flight ||
+        s->event_max) {
+        return;
+    }
+
+    rc = io_setup(s->wanted_events, &ctx);
+    if (rc < 0) {
+        /* Keep the current context and do not try again */
+        s->wanted_events = s->max_events;
+        return;
+    }
+    io_destroy(s->ctx);
+    s->ctx = ctx;
+    s->max_events = s->wanted_events;
+    s->iocbs = g_renew(struct iocb *, s->iocbs, s->max_events);
+    s->stats.queue_depth = s->max_events;
+    s->stats.resizes++;
+    s->io_q.full = false;
+}
+
+/*
+ * Called when requests had to wait because the queue was full; grow it the
+ * next time no request is in flight.  Further submissions while the queue
+ * stays full are not counted again.
+ */
+static void laio_queue_full(LinuxAioState *s)
+{
+    if (s->io_q.full) {
+        return;
+    }
+    s->io_q.full = true;
+    s->stats.queue_full++;
+    if (s->wanted_events < AUTO_MAX_EVENTS) {
+        s->wanted_events = MAX(s->wanted_events, s->max_events * 2);
+    }
 }
 
 static void ioq_submit(LinuxAioState *s)
 {
     int ret, len;
     struct qemu_laiocb *aiocb;
-    struct iocb *iocbs[MAX_EVENTS];
+    struct iocb **iocbs;
     QSIMPLEQ_HEAD(, qemu_laiocb) completed;
 
+    laio_resize(s);
+
     do {
-        if (s->io_q.in_flight >= MAX_EVENTS) {
+        /* A nested call may have resized the array */
+        iocbs = s->iocbs;
+        if (s->io_q.in_flight >= s->max_events) {
+            laio_queue_full(s);
             break;
         }
         len = 0;
         QSIMPLEQ_FOREACH(aiocb, &s->io_q.pending, next) {
             iocbs[len++] = &aiocb->iocb;
-            if (s->io_q.in_flight + len >= MAX_EVENTS) {
+            if (s->io_q.in_flight + len >= s->max_events) {
                 break;
             }
         }
 
         ret = io_submit(s->ctx, len, iocbs);
         if (ret == -EAGAIN) {
+            laio_queue_full(s);
             break;
         }
         if (ret < 0) {
@@ -316,6 +383,8 @@ static void ioq_submit(LinuxAioState *s)
             continue;
         }
 
+        s->stats.submissions++;
+        s->stats.submitted_requests += ret;
         s->io_q.in_flight += ret;
         s->io_q.in_queue  -= ret;
         aiocb = container_of(iocbs[ret - 1], struct qemu_laiocb, iocb);
@@ -349,7 +418,7 @@ static uint64_t laio_max_batch(LinuxAioState *s, uint64_t dev_max_batch)
     max_batch = MIN_NON_ZERO(dev_max_batch, max_batch);
 
     /* limit the batch with the number of available events */
-    max_batch = MIN_NON_ZERO(MAX_EVENTS - s->io_q.in_flight, max_batch);
+    max_batch = MIN_NON_ZERO(s->max_events - s->io_q.in_flight, max_batch);
 
     return max_batch;
 }
@@ -366,10 +435,27 @@ void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s,
     if (s->io_q.in_queue >= laio_max_batch(s, dev_max_batch) ||
         (--s->io_q.plugged == 0 &&
          !s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.pending))) {
+        s->stats.unplugs++;
         ioq_submit(s);
     }
 }
 
+/*
+ * The AIO context is shared by all users of @s, so it is only ever grown.
+ * It still grows automatically beyond @max_events when it is too small.
+ */
+void laio_set_queue_depth(LinuxAioState *s, unsigned int max_events)
+{
+    max_events = MIN(max_events, QEMU_AIO_MAX_QUEUE_DEPTH);
+    s->wanted_events = MAX(s->wanted_events, max_events);
+    laio_resize(s);
+}
+
+void laio_get_stats(LinuxAioState *s, BlockStatsSpecificFileAio *stats)
+{
+    *stats = s->stats;
+}
+
 static int laio_do_submit(int fd, struct qemu_laiocb *laiocb, off_t offset,
                           int type, uint64_t dev_max_batch)
 {
@@ -457,11 +543,15 @@ LinuxAioState *laio_init(Error **errp)
         goto out_free_state;
     }
 
-    rc = io_setup(MAX_EVENTS, &s->ctx);
+    rc = io_setup(DEFAULT_EVENTS, &s->ctx);
     if (rc < 0) {
         error_setg_errno(errp, -rc, "failed to create linux AIO context");
         goto out_close_efd;
     }
+    s->max_events = DEFAULT_EVENTS;
+    s->wanted_events = DEFAULT_EVENTS;
+    s->iocbs = g_new(struct iocb *, s->max_events);
+    s->stats.queue_depth = s->max_events;
 
     ioq_init(&s->io_q);
 
@@ -482,5 +572,6 @@ void laio_cleanup(LinuxAioState *s)
         fprintf(stderr, "%s: destroy AIO context %p failed\n",
                         __func__, &s->ctx);
     }
+    g_free(s->iocbs);
     g_free(s);
 }
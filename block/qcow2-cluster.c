@@ -216,6 +216,44 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                            (void **)l2_slice);
 }
 
+/*
+ * Loads the L2 slice that maps guest @offset into the L2 cache, unless it is
+ * cached already or the L2 table is not allocated.  This is only a hint, so
+ * invalid L1 entries are skipped and left for the actual request to report.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_prefetch_l2_slice(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index = offset_to_l1_index(s, offset);
+    uint64_t l2_offset, slice_offset;
+    int ret;
+
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return 0;
+    }
+
+    slice_offset = l2_offset + l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    if (qcow2_cache_is_table_offset(s->l2_table_cache, slice_offset)) {
+        return 0;
+    }
+
+    ret = qcow2_cache_prefetch(bs, s->l2_table_cache, slice_offset);
+    if (ret < 0) {
+        return ret;
+    }
+    s->l2_prefetch_reads++;
+
+    return 0;
+}
+
 /*
  * Writes an L1 entry to disk (note that depending on the alignment
  * requirements this function may write more that just one entry in
@@ -1576,6 +1614,77 @@ out:
     return ret;
 }
 
+/*
+ * Takes up to *nb_clusters clusters from the range reserved for guest data,
+ * reserving a new range of at least s->alloc_batch_clusters when the old one
+ * is used up.  This way, refcounts are updated once per batch rather than for
+ * every allocating write.
+ *
+ * *host_offset and *nb_clusters have the same meaning as for
+ * do_alloc_cluster_offset().  If *host_offset is not INV_OFFSET and does not
+ * continue the reserved range, *nb_clusters is set to 0.
+ *
+ * Clusters that are reserved but never used are given back by
+ * qcow2_alloc_pool_release(); if QEMU crashes first, they are leaked.
+ */
+static int alloc_clusters_from_pool(BlockDriverState *bs,
+                                    uint64_t *host_offset,
+                                    uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t n;
+
+    if (s->alloc_pool_clusters == 0) {
+        uint64_t batch = MAX(*nb_clusters, s->alloc_batch_clusters);
+        int64_t ret;
+
+        if (*host_offset == INV_OFFSET) {
+            ret = qcow2_alloc_clusters(bs, batch * s->cluster_size);
+            if (ret < 0) {
+                return ret;
+            }
+            s->alloc_pool_offset = ret;
+            s->alloc_pool_clusters = batch;
+        } else {
+            ret = qcow2_alloc_clusters_at(bs, *host_offset, batch);
+            if (ret < 0) {
+                return ret;
+            }
+            s->alloc_pool_offset = *host_offset;
+            s->alloc_pool_clusters = ret;
+        }
+    } else if (*host_offset != INV_OFFSET &&
+               *host_offset != s->alloc_pool_offset) {
+        *nb_clusters = 0;
+        return 0;
+    }
+
+    n = MIN(*nb_clusters, s->alloc_pool_clusters);
+    *host_offset = s->alloc_pool_offset;
+    *nb_clusters = n;
+    s->alloc_pool_offset += n * s->cluster_size;
+    s->alloc_pool_clusters -= n;
+
+    return 0;
+}
+
+/*
+ * Frees the clusters that alloc_clusters_from_pool() has reserved but not
+ * handed out yet.  Must be called before anything that relies on every
+ * allocated cluster being referenced, e.g. shrinking or closing the image.
+ */
+void qcow2_alloc_pool_release(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->alloc_pool_clusters) {
+        qcow2_free_clusters(bs, s->alloc_pool_offset,
+                            s->alloc_pool_clusters * s->cluster_size,
+                            QCOW2_DISCARD_NEVER);
+        s->alloc_pool_clusters = 0;
+    }
+}
+
 /*
  * Allocates new clusters for the given guest_offset.
  *
@@ -1612,7 +1721,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == INV_OFFSET) {
+    if (s->alloc_batch_clusters) {
+        return alloc_clusters_from_pool(bs, host_offset, nb_clusters);
+    } else if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
         if (cluster_offset < 0) {
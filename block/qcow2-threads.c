@@ -45,7 +45,7 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
     ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+    while (s->nb_threads >= s->max_threads) {
         qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
     }
     s->nb_threads++;
@@ -430,36 +430,13 @@ qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
  * Cryptography
  */
 
-/*
- * Qcow2EncDecFunc: common prototype of qcrypto_block_encrypt() and
- * qcrypto_block_decrypt() functions.
- */
-typedef int (*Qcow2EncDecFunc)(QCryptoBlock *block, uint64_t offset,
-                               uint8_t *buf, size_t len, Error **errp);
-
-typedef struct Qcow2EncDecData {
-    QCryptoBlock *block;
-    uint64_t offset;
-    uint8_t *buf;
-    size_t len;
-
-    Qcow2EncDecFunc func;
-} Qcow2EncDecData;
-
-static int qcow2_encdec_pool_func(void *opaque)
-{
-    Qcow2EncDecData *data = opaque;
-
-    return data->func(data->block, data->offset, data->buf, data->len, NULL);
-}
-
 static int coroutine_fn
 qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
                 uint64_t guest_offset, void *buf, size_t len,
-                Qcow2EncDecFunc func)
+                BlockCryptoEncDecFunc func)
 {
     BDRVQcow2State *s = bs->opaque;
-    Qcow2EncDecData arg = {
+    BlockCryptoEncDecData arg = {
         .block = s->crypto,
         .offset = s->crypt_physical_offset ? host_offset : guest_offset,
         .buf = buf,
@@ -475,7 +452,8 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
     assert(QEMU_IS_ALIGNED(host_offset, sector_size));
     assert(QEMU_IS_ALIGNED(len, sector_size));
 
-    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    return len == 0 ? 0 :
+           qcow2_co_process(bs, block_crypto_encdec_pool_func, &arg);
 }
 
 /*
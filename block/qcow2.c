@@ -317,10 +317,11 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            qcow2_crypto_hdr_read_func,
-                                           bs, cflags, QCOW2_MAX_THREADS, errp);
+                                           bs, cflags, s->max_threads, errp);
             if (!s->crypto) {
                 return -EINVAL;
             }
+            s->crypto_threads = s->max_threads;
         }   break;
 
         case QCOW2_EXT_MAGIC_BITMAPS:
@@ -698,6 +699,10 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_ALLOC_BATCH_SIZE,
+    QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+    QCOW2_OPT_COMPRESSED_READAHEAD_SIZE,
+    QCOW2_OPT_MAX_THREADS,
     NULL
 };
 
@@ -809,6 +814,27 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_BATCH_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Reserve clusters for guest data in batches of this size",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the decompressed cluster cache",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_READAHEAD_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Amount of compressed data to read at once",
+        },
+        {
+            .name = QCOW2_OPT_MAX_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of threads for compression, "
+                    "decompression and encryption",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -962,6 +988,34 @@ static bool read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     return true;
 }
 
+static void qcow2_compressed_cache_invalidate(BDRVQcow2State *s)
+{
+    int i;
+
+    for (i = 0; s->compressed_cache && i < s->compressed_cache_entries; i++) {
+        s->compressed_cache[i].coffset = 0;
+        s->compressed_cache[i].lru_counter = 0;
+    }
+    s->compressed_ra_bytes = 0;
+    s->compressed_cache_gen++;
+}
+
+static void qcow2_compressed_cache_free(BDRVQcow2State *s)
+{
+    int i;
+
+    for (i = 0; s->compressed_cache && i < s->compressed_cache_entries; i++) {
+        qemu_vfree(s->compressed_cache[i].data);
+    }
+    g_free(s->compressed_cache);
+    s->compressed_cache = NULL;
+
+    g_free(s->compressed_ra_buf);
+    s->compressed_ra_buf = NULL;
+    s->compressed_ra_bytes = 0;
+    s->compressed_cache_gen++;
+}
+
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
@@ -970,7 +1024,12 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t alloc_batch_clusters;
+    int compressed_cache_entries;
+    uint64_t compressed_readahead_size;
+    int max_threads;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
+    QCryptoBlock *crypto; /* With more cipher objects for raised max_threads */
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -1071,6 +1130,41 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->alloc_batch_clusters =
+        DIV_ROUND_UP(qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_BATCH_SIZE, 0),
+                     s->cluster_size);
+    if (r->alloc_batch_clusters > QCOW_MAX_ALLOC_BATCH) {
+        error_setg(errp, QCOW2_OPT_ALLOC_BATCH_SIZE " must not exceed %d "
+                   "clusters", QCOW_MAX_ALLOC_BATCH);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Compressed cluster reads */
+    r->compressed_cache_entries =
+        MIN(qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                              DEFAULT_COMPRESSED_CACHE_SIZE) / s->cluster_size,
+            INT_MAX);
+    r->compressed_readahead_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_READAHEAD_SIZE,
+                          DEFAULT_COMPRESSED_READAHEAD_SIZE);
+    if (r->compressed_readahead_size > QCOW_MAX_COMPRESSED_READAHEAD_SIZE) {
+        error_setg(errp, QCOW2_OPT_COMPRESSED_READAHEAD_SIZE
+                   " must not exceed %" PRId64,
+                   QCOW_MAX_COMPRESSED_READAHEAD_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->max_threads = qemu_opt_get_number(opts, QCOW2_OPT_MAX_THREADS,
+                                         QCOW2_MAX_THREADS);
+    if (r->max_threads < 1 || r->max_threads > QCOW2_MAX_THREADS_LIMIT) {
+        error_setg(errp, QCOW2_OPT_MAX_THREADS " must be between 1 and %d",
+                   QCOW2_MAX_THREADS_LIMIT);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1189,6 +1283,27 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /*
+     * Each thread that encrypts or decrypts needs a cipher object of its own,
+     * so open the encryption layer again if max-threads is raised
+     */
+    if (s->crypto && !(flags & BDRV_O_NO_IO) &&
+        r->max_threads > s->crypto_threads) {
+        if (s->crypt_method_header == QCOW_CRYPT_LUKS) {
+            r->crypto = qcrypto_block_open(r->crypto_opts, "encrypt.",
+                                           qcow2_crypto_hdr_read_func, bs, 0,
+                                           r->max_threads, errp);
+        } else {
+            r->crypto = qcrypto_block_open(r->crypto_opts, "encrypt.",
+                                           NULL, NULL, 0, r->max_threads,
+                                           errp);
+        }
+        if (!r->crypto) {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
     ret = 0;
 fail:
     qobject_unref(encryptopts);
@@ -1226,6 +1341,27 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    s->alloc_batch_clusters = r->alloc_batch_clusters;
+
+    if (s->compressed_cache_entries != r->compressed_cache_entries) {
+        qcow2_compressed_cache_free(s);
+        s->compressed_cache_entries = r->compressed_cache_entries;
+    }
+    s->compressed_readahead_size = r->compressed_readahead_size;
+
+    if (r->crypto) {
+        qcrypto_block_free(s->crypto);
+        s->crypto = r->crypto;
+        s->crypto_threads = r->max_threads;
+    }
+    if (r->max_threads > s->max_threads) {
+        s->max_threads = r->max_threads;
+        /* Requests waiting for a thread may be able to start now */
+        qemu_co_enter_all(&s->thread_task_queue, NULL);
+    } else {
+        s->max_threads = r->max_threads;
+    }
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1240,6 +1376,7 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
         qcow2_cache_destroy(r->refcount_block_cache);
     }
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
+    qcrypto_block_free(r->crypto);
 }
 
 static int qcow2_update_options(BlockDriverState *bs, QDict *options,
@@ -1676,11 +1813,12 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            NULL, NULL, cflags,
-                                           QCOW2_MAX_THREADS, errp);
+                                           s->max_threads, errp);
             if (!s->crypto) {
                 ret = -EINVAL;
                 goto fail;
             }
+            s->crypto_threads = s->max_threads;
         } else if (!(flags & BDRV_O_NO_IO)) {
             error_setg(errp, "Missing CRYPTO header for crypt method %d",
                        s->crypt_method_header);
@@ -1837,6 +1975,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    qemu_co_queue_init(&s->compressed_ra_queue);
 
     return ret;
 
@@ -1928,6 +2067,38 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
     bs->bl.pdiscard_alignment = s->cluster_size;
 }
 
+typedef struct Qcow2AllocPoolReleaseCo {
+    BlockDriverState *bs;
+    bool done;
+} Qcow2AllocPoolReleaseCo;
+
+static void coroutine_fn qcow2_alloc_pool_release_entry(void *opaque)
+{
+    Qcow2AllocPoolReleaseCo *prc = opaque;
+    BDRVQcow2State *s = prc->bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    qcow2_alloc_pool_release(prc->bs);
+    qemu_co_mutex_unlock(&s->lock);
+    prc->done = true;
+}
+
+/* Frees the clusters reserved for guest data and not handed out yet */
+static void qcow2_alloc_pool_release_locked(BlockDriverState *bs)
+{
+    Qcow2AllocPoolReleaseCo prc = {
+        .bs = bs,
+    };
+
+    if (qemu_in_coroutine()) {
+        qcow2_alloc_pool_release_entry(&prc);
+    } else {
+        bdrv_coroutine_enter(bs,
+            qemu_coroutine_create(qcow2_alloc_pool_release_entry, &prc));
+        BDRV_POLL_WHILE(bs, !prc.done);
+    }
+}
+
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
@@ -1944,6 +2115,15 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
         goto fail;
     }
 
+    /*
+     * Reserved clusters must be freed while the image is still writable, and
+     * before the refcounts are written out below.  If the reopen is aborted,
+     * the next allocation simply reserves a new batch.
+     */
+    if (!(state->flags & BDRV_O_RDWR) || !r->alloc_batch_clusters) {
+        qcow2_alloc_pool_release_locked(state->bs);
+    }
+
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
@@ -2314,6 +2494,88 @@ static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task)
                                 t->qiov, t->qiov_offset);
 }
 
+typedef struct Qcow2L2Prefetch {
+    BlockDriverState *bs;
+    uint64_t start;
+    uint64_t end;
+} Qcow2L2Prefetch;
+
+static void coroutine_fn qcow2_l2_prefetch_entry(void *opaque)
+{
+    Qcow2L2Prefetch *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t) s->l2_slice_size << s->cluster_bits;
+    uint64_t offset;
+    int ret = 0;
+
+    /* Take the lock per slice so that the reader is not held up */
+    for (offset = p->start; offset < p->end && ret == 0;
+         offset += slice_bytes) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_prefetch_l2_slice(bs, offset);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+    s->l2_prefetch_busy = false;
+    bdrv_dec_in_flight(bs);
+    g_free(p);
+}
+
+/*
+ * Detects sequential reads and loads the L2 slices that the reader is about
+ * to need in the background, so that the data path does not stall on
+ * metadata reads.  The prefetch window grows with the length of the
+ * sequential stream, up to QCOW2_L2_PREFETCH_MAX slices.
+ *
+ * Reads that fall through to a qcow2 backing file are detected there in the
+ * same way, so the backing file's L2 tables are prefetched as well.
+ */
+static void qcow2_l2_readahead(BlockDriverState *bs, uint64_t offset,
+                               uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t) s->l2_slice_size << s->cluster_bits;
+    uint64_t next_slice, start, end, window;
+    Qcow2L2Prefetch *p;
+    Coroutine *co;
+
+    if (offset != s->seq_read_end) {
+        s->seq_read_count = 0;
+        s->l2_prefetch_end = 0;
+    } else if (s->seq_read_count < UINT_MAX) {
+        s->seq_read_count++;
+    }
+    s->seq_read_end = offset + bytes;
+
+    if (s->seq_read_count < QCOW2_SEQ_READ_THRESHOLD || s->l2_prefetch_busy) {
+        return;
+    }
+
+    window = MIN(s->seq_read_count / QCOW2_SEQ_READ_THRESHOLD,
+                 QCOW2_L2_PREFETCH_MAX);
+    next_slice = QEMU_ALIGN_UP(s->seq_read_end, slice_bytes);
+    start = MAX(next_slice, s->l2_prefetch_end);
+    end = MIN(next_slice + window * slice_bytes,
+              bs->total_sectors * BDRV_SECTOR_SIZE);
+    if (start >= end) {
+        return;
+    }
+
+    p = g_new(Qcow2L2Prefetch, 1);
+    *p = (Qcow2L2Prefetch) {
+        .bs     = bs,
+        .start  = start,
+        .end    = end,
+    };
+    s->l2_prefetch_busy = true;
+    s->l2_prefetch_end = end;
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_l2_prefetch_entry, p);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
 static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                                              int64_t offset, int64_t bytes,
                                              QEMUIOVector *qiov,
@@ -2327,6 +2589,8 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
     QCow2SubclusterType type;
     AioTaskPool *aio = NULL;
 
+    qcow2_l2_readahead(bs, offset, bytes);
+
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
         /* prepare next request */
         cur_bytes = MIN(bytes, INT_MAX);
@@ -2697,6 +2961,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_alloc_pool_release(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2732,6 +2998,7 @@ static void qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_free(s);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -2766,6 +3033,7 @@ static void coroutine_fn qcow2_co_invalidate_cache(BlockDriverState *bs,
     BdrvChild *data_file;
     int flags = s->flags;
     QCryptoBlock *crypto = NULL;
+    int crypto_threads;
     QDict *options;
     int ret;
 
@@ -2775,6 +3043,7 @@ static void coroutine_fn qcow2_co_invalidate_cache(BlockDriverState *bs,
      */
 
     crypto = s->crypto;
+    crypto_threads = s->crypto_threads;
     s->crypto = NULL;
 
     /*
@@ -2804,6 +3073,7 @@ static void coroutine_fn qcow2_co_invalidate_cache(BlockDriverState *bs,
     }
 
     s->crypto = crypto;
+    s->crypto_threads = crypto_threads;
 }
 
 static size_t header_ext_add(char *buf, uint32_t magic, const void *s,
@@ -4221,6 +4491,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
     }
 
     qemu_co_mutex_lock(&s->lock);
+    qcow2_alloc_pool_release(bs);
 
     /*
      * Even though we store snapshot size for all images, it was not
@@ -4625,6 +4896,7 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
     ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
+    qcow2_compressed_cache_invalidate(s);
     if (ret < 0) {
         goto fail;
     }
@@ -4713,6 +4985,135 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+static Qcow2DecompressedCluster *
+qcow2_compressed_cache_lookup(BDRVQcow2State *s, uint64_t coffset)
+{
+    int i;
+
+    if (!coffset) {
+        return NULL;
+    }
+
+    for (i = 0; s->compressed_cache && i < s->compressed_cache_entries; i++) {
+        Qcow2DecompressedCluster *c = &s->compressed_cache[i];
+        if (c->coffset == coffset) {
+            c->lru_counter = ++s->compressed_cache_lru_counter;
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Stores the decompressed cluster *@data in the cache, replacing the least
+ * recently used entry.  The buffers are swapped rather than copied, so *@data
+ * is set to the evicted entry's buffer (or NULL) and must still be freed by
+ * the caller.
+ */
+static void qcow2_compressed_cache_insert(BlockDriverState *bs,
+                                          uint64_t coffset, uint8_t **data)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressedCluster *c;
+    uint8_t *old;
+    int i;
+
+    if (!s->compressed_cache_entries) {
+        return;
+    }
+    if (!s->compressed_cache) {
+        s->compressed_cache = g_new0(Qcow2DecompressedCluster,
+                                     s->compressed_cache_entries);
+    }
+
+    c = &s->compressed_cache[0];
+    for (i = 1; i < s->compressed_cache_entries; i++) {
+        if (s->compressed_cache[i].lru_counter < c->lru_counter) {
+            c = &s->compressed_cache[i];
+        }
+    }
+
+    old = c->data;
+    c->data = *data;
+    c->coffset = coffset;
+    c->lru_counter = ++s->compressed_cache_lru_counter;
+    *data = old;
+}
+
+/*
+ * Reads @csize bytes of compressed data at @coffset into @buf.
+ *
+ * Compressed clusters are usually stored back to back, so the data is read
+ * in chunks of s->compressed_readahead_size bytes, which then serve the
+ * following compressed clusters without further I/O.  Requests that need a
+ * chunk that is still being read wait for it instead of reading the same
+ * data again.
+ */
+static int coroutine_fn
+qcow2_co_read_compressed_data(BlockDriverState *bs, uint64_t coffset,
+                              int csize, uint8_t *buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t ra_bytes = s->compressed_readahead_size;
+    uint64_t gen;
+    uint8_t *ra_buf;
+    int ret;
+
+    for (;;) {
+        uint64_t ra_offset = s->compressed_ra_offset;
+
+        if (coffset >= ra_offset &&
+            coffset + csize <= ra_offset + s->compressed_ra_bytes) {
+            memcpy(buf, s->compressed_ra_buf + (coffset - ra_offset), csize);
+            return 0;
+        }
+        if (!s->compressed_ra_busy ||
+            coffset < s->compressed_ra_busy_offset ||
+            coffset + csize > s->compressed_ra_busy_offset + ra_bytes) {
+            break;
+        }
+        qemu_co_queue_wait(&s->compressed_ra_queue, NULL);
+    }
+
+    ra_buf = NULL;
+    if (!s->compressed_ra_busy && ra_bytes > csize) {
+        ra_buf = g_try_malloc(ra_bytes);
+    }
+    if (!ra_buf) {
+        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+        return bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    }
+
+    s->compressed_ra_busy = true;
+    s->compressed_ra_busy_offset = coffset;
+    gen = s->compressed_cache_gen;
+
+    /* Reading past the end of the file returns zeroes */
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, coffset, ra_bytes, ra_buf, 0);
+
+    s->compressed_ra_busy = false;
+    qemu_co_queue_restart_all(&s->compressed_ra_queue);
+
+    if (ret < 0) {
+        g_free(ra_buf);
+        return ret;
+    }
+
+    memcpy(buf, ra_buf, csize);
+    if (gen == s->compressed_cache_gen &&
+        ra_bytes == s->compressed_readahead_size) {
+        g_free(s->compressed_ra_buf);
+        s->compressed_ra_buf = ra_buf;
+        s->compressed_ra_offset = coffset;
+        s->compressed_ra_bytes = ra_bytes;
+    } else {
+        g_free(ra_buf);
+    }
+
+    return 0;
+}
+
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t l2_entry,
@@ -4723,12 +5124,23 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     int ret = 0, csize;
-    uint64_t coffset;
+    uint64_t coffset, gen;
     uint8_t *buf, *out_buf;
     int offset_in_cluster = offset_into_cluster(s, offset);
+    Qcow2DecompressedCluster *c;
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
+    c = qcow2_compressed_cache_lookup(s, coffset);
+    if (c) {
+        s->compressed_cache_hits++;
+        qemu_iovec_from_buf(qiov, qiov_offset, c->data + offset_in_cluster,
+                            bytes);
+        return 0;
+    }
+    s->compressed_cache_misses++;
+    gen = s->compressed_cache_gen;
+
     buf = g_try_malloc(csize);
     if (!buf) {
         return -ENOMEM;
@@ -4736,8 +5148,7 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
 
     out_buf = qemu_blockalign(bs, s->cluster_size);
 
-    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    ret = qcow2_co_read_compressed_data(bs, coffset, csize, buf);
     if (ret < 0) {
         goto fail;
     }
@@ -4749,6 +5160,10 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
 
     qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
 
+    if (gen == s->compressed_cache_gen) {
+        qcow2_compressed_cache_insert(bs, coffset, &out_buf);
+    }
+
 fail:
     qemu_vfree(out_buf);
     g_free(buf);
@@ -4914,6 +5329,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int step = QEMU_ALIGN_DOWN(INT_MAX, s->cluster_size);
     int l1_clusters, ret = 0;
 
+    qcow2_alloc_pool_release(bs);
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
@@ -5140,6 +5557,23 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVQcow2State *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2 = (BlockStatsSpecificQcow2) {
+        .l2_prefetch_reads = s->l2_prefetch_reads,
+        .compressed_cache_hits = s->compressed_cache_hits,
+        .compressed_cache_misses = s->compressed_cache_misses,
+    };
+    qcow2_cache_get_stats(s->l2_table_cache, &stats->u.qcow2.l2_cache_hits,
+                          &stats->u.qcow2.l2_cache_misses);
+
+    return stats;
+}
+
 static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
                                                   Error **errp)
 {
@@ -6069,6 +6503,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
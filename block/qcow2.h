@@ -57,6 +57,15 @@
  * (128 GB for 512 byte clusters, 2 EB for 2 MB clusters) */
 #define QCOW_MAX_L1_SIZE (32 * MiB)
 
+/* Up to 1 GB of guest data clusters reserved at once at 64k cluster size */
+#define QCOW_MAX_ALLOC_BATCH 16384
+
+/* Sequential reads in a row before L2 slices are prefetched */
+#define QCOW2_SEQ_READ_THRESHOLD 4
+
+/* Maximum number of L2 slices prefetched ahead of a sequential reader */
+#define QCOW2_L2_PREFETCH_MAX 8
+
 /* Allow for an average of 1k per snapshot table entry, should be plenty of
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
@@ -128,6 +137,10 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+#define DEFAULT_COMPRESSED_CACHE_SIZE (1 * MiB)
+#define DEFAULT_COMPRESSED_READAHEAD_SIZE (256 * KiB)
+#define QCOW_MAX_COMPRESSED_READAHEAD_SIZE (64 * MiB)
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -149,6 +162,10 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_ALLOC_BATCH_SIZE "alloc-batch-size"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
+#define QCOW2_OPT_COMPRESSED_READAHEAD_SIZE "compressed-readahead-size"
+#define QCOW2_OPT_MAX_THREADS "max-threads"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -321,7 +338,15 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+/* Default and maximum for the max-threads option */
 #define QCOW2_MAX_THREADS 4
+#define QCOW2_MAX_THREADS_LIMIT 64
+
+typedef struct Qcow2DecompressedCluster {
+    uint64_t coffset;   /* Offset of the compressed data, 0 if unused */
+    uint64_t lru_counter;
+    uint8_t *data;
+} Qcow2DecompressedCluster;
 
 typedef struct BDRVQcow2State {
     int cluster_bits;
@@ -347,6 +372,13 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Sequential read detection for L2 prefetch, see qcow2_l2_readahead() */
+    uint64_t seq_read_end;
+    unsigned seq_read_count;
+    uint64_t l2_prefetch_end;
+    bool l2_prefetch_busy;
+    uint64_t l2_prefetch_reads;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -356,6 +388,14 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Guest data clusters are reserved alloc_batch_clusters at a time; the
+     * ones not handed out yet start at alloc_pool_offset
+     */
+    uint64_t alloc_batch_clusters;
+    uint64_t alloc_pool_offset;
+    uint64_t alloc_pool_clusters;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -407,6 +447,30 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;
+    /* Number of cipher objects in crypto, never less than max_threads */
+    int crypto_threads;
+
+    /*
+     * Recently decompressed clusters and compressed data read ahead, see
+     * qcow2_co_preadv_compressed().  compressed_cache_gen changes whenever
+     * compressed data is written, so that results of reads that were in
+     * flight at that point are not cached.
+     */
+    Qcow2DecompressedCluster *compressed_cache;
+    int compressed_cache_entries;
+    uint64_t compressed_cache_lru_counter;
+    uint64_t compressed_cache_gen;
+    uint64_t compressed_cache_hits;
+    uint64_t compressed_cache_misses;
+
+    uint64_t compressed_readahead_size;
+    uint8_t *compressed_ra_buf;
+    uint64_t compressed_ra_offset;
+    uint64_t compressed_ra_bytes;
+    bool compressed_ra_busy;
+    uint64_t compressed_ra_busy_offset;
+    CoQueue compressed_ra_queue;
 
     BdrvChild *data_file;
 
@@ -911,6 +975,8 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
 int qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                             unsigned int *bytes, uint64_t *host_offset,
                             QCowL2Meta **m);
+void qcow2_alloc_pool_release(BlockDriverState *bs);
+int qcow2_prefetch_l2_slice(BlockDriverState *bs, uint64_t offset);
 int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                           uint64_t offset,
                                           int compressed_size,
@@ -974,8 +1040,10 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(Qcow2Cache *c, void **table);
+int qcow2_cache_prefetch(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -20,6 +20,7 @@
 #include "block/nbd.h"
 #include "io/channel-socket.h"
 #include "io/net-listener.h"
+#include "sysemu/iothread.h"
 
 typedef struct NBDServerData {
     QIONetListener *listener;
@@ -27,6 +28,14 @@ typedef struct NBDServerData {
     char *tlsauthz;
     uint32_t max_connections;
     uint32_t connections;
+
+    /*
+     * IOThreads that new connections are spread over, if any.  They are
+     * referenced so that they can't go away while the server runs.
+     */
+    IOThread **iothreads;
+    unsigned int nb_iothreads;
+    unsigned int next_iothread;
 } NBDServerData;
 
 static NBDServerData *nbd_server;
@@ -60,11 +69,19 @@ static void nbd_blockdev_client_closed(NBDClient *client, bool ignored)
 static void nbd_accept(QIONetListener *listener, QIOChannelSocket *cioc,
                        gpointer opaque)
 {
+    AioContext *ctx = NULL;
+
     nbd_server->connections++;
     nbd_update_server_watch(nbd_server);
 
+    if (nbd_server->nb_iothreads) {
+        unsigned int i = nbd_server->next_iothread++ % nbd_server->nb_iothreads;
+
+        ctx = iothread_get_aio_context(nbd_server->iothreads[i]);
+    }
+
     qio_channel_set_name(QIO_CHANNEL(cioc), "nbd-server");
-    nbd_client_new(cioc, nbd_server->tlscreds, nbd_server->tlsauthz,
+    nbd_client_new(cioc, ctx, nbd_server->tlscreds, nbd_server->tlsauthz,
                    nbd_blockdev_client_closed);
 }
 
@@ -79,6 +96,8 @@ static void nbd_update_server_watch(NBDServerData *s)
 
 static void nbd_server_free(NBDServerData *server)
 {
+    unsigned int i;
+
     if (!server) {
         return;
     }
@@ -89,6 +108,10 @@ static void nbd_server_free(NBDServerData *server)
         object_unref(OBJECT(server->tlscreds));
     }
     g_free(server->tlsauthz);
+    for (i = 0; i < server->nb_iothreads; i++) {
+        object_unref(OBJECT(server->iothreads[i]));
+    }
+    g_free(server->iothreads);
 
     g_free(server);
 }
@@ -125,7 +148,7 @@ static QCryptoTLSCreds *nbd_get_tls_creds(const char *id, Error **errp)
 
 void nbd_server_start(SocketAddress *addr, const char *tls_creds,
                       const char *tls_authz, uint32_t max_connections,
-                      Error **errp)
+                      strList *iothreads, Error **errp)
 {
     if (nbd_server) {
         error_setg(errp, "NBD server already running");
@@ -157,6 +180,19 @@ void nbd_server_start(SocketAddress *addr, const char *tls_creds,
 
     nbd_server->tlsauthz = g_strdup(tls_authz);
 
+    for (; iothreads; iothreads = iothreads->next) {
+        IOThread *iothread = iothread_by_id(iothreads->value);
+
+        if (!iothread) {
+            error_setg(errp, "iothread \"%s\" not found", iothreads->value);
+            goto error;
+        }
+        object_ref(OBJECT(iothread));
+        nbd_server->iothreads = g_renew(IOThread *, nbd_server->iothreads,
+                                        nbd_server->nb_iothreads + 1);
+        nbd_server->iothreads[nbd_server->nb_iothreads++] = iothread;
+    }
+
     nbd_update_server_watch(nbd_server);
 
     return;
@@ -169,18 +205,20 @@ void nbd_server_start(SocketAddress *addr, const char *tls_creds,
 void nbd_server_start_options(NbdServerOptions *arg, Error **errp)
 {
     nbd_server_start(arg->addr, arg->tls_creds, arg->tls_authz,
-                     arg->max_connections, errp);
+                     arg->max_connections, arg->iothreads, errp);
 }
 
 void qmp_nbd_server_start(SocketAddressLegacy *addr,
                           bool has_tls_creds, const char *tls_creds,
                           bool has_tls_authz, const char *tls_authz,
                           bool has_max_connections, uint32_t max_connections,
+                          bool has_iothreads, strList *iothreads,
                           Error **errp)
 {
     SocketAddress *addr_flat = socket_address_flatten(addr);
 
-    nbd_server_start(addr_flat, tls_creds, tls_authz, max_connections, errp);
+    nbd_server_start(addr_flat, tls_creds, tls_authz, max_connections,
+                     iothreads, errp);
     qapi_free_SocketAddress(addr_flat);
 }
 
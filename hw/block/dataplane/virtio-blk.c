@@ -43,6 +43,17 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /*
+     * With the x-iothreads property, the IOThreads that process the
+     * virtqueues.  Requests are still submitted in the BlockBackend's
+     * AioContext, which is the one of the first IOThread.
+     */
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    AioContext **vq_aio_context;
+    /* The other IOThreads have their external handlers disabled */
+    bool drained;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -80,6 +91,16 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+static void virtio_blk_data_plane_free_iothreads(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -88,10 +109,16 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->num_iothreads) {
+        error_setg(errp, "iothread and x-iothreads are mutually exclusive");
+        return false;
+    }
+
+    if (conf->iothread || conf->num_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -119,20 +146,48 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
-
-    if (conf->iothread) {
+    s->vq_aio_context = g_new(AioContext *, conf->num_queues);
+
+    if (conf->num_iothreads) {
+        s->iothreads = g_new0(IOThread *, conf->num_iothreads);
+        for (i = 0; i < conf->num_iothreads; i++) {
+            s->iothreads[i] = conf->iothreads[i] ?
+                              iothread_by_id(conf->iothreads[i]) : NULL;
+            if (!s->iothreads[i]) {
+                error_setg(errp, "IOThread '%s' not found",
+                           conf->iothreads[i] ?: "");
+                goto fail;
+            }
+            object_ref(OBJECT(s->iothreads[i]));
+            s->num_iothreads++;
+        }
+        s->iothread = s->iothreads[0];
+        object_ref(OBJECT(s->iothread));
+        s->ctx = iothread_get_aio_context(s->iothread);
+    } else if (conf->iothread) {
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
     } else {
         s->ctx = qemu_get_aio_context();
     }
+    for (i = 0; i < conf->num_queues; i++) {
+        s->vq_aio_context[i] = s->num_iothreads ?
+            iothread_get_aio_context(s->iothreads[i % s->num_iothreads]) :
+            s->ctx;
+    }
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
     *dataplane = s;
 
     return true;
+
+fail:
+    virtio_blk_data_plane_free_iothreads(s);
+    g_free(s->vq_aio_context);
+    g_free(s);
+    return false;
 }
 
 /* Context: QEMU global mutex held */
@@ -146,11 +201,15 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
+    /* The device may go away in the middle of a drained section */
+    virtio_blk_data_plane_drained_end(s);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
+    virtio_blk_data_plane_free_iothreads(s);
+    g_free(s->vq_aio_context);
     g_free(s);
 }
 
@@ -243,13 +302,14 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
 
-        virtio_queue_aio_attach_host_notifier(vq, s->ctx);
+        aio_context_acquire(ctx);
+        virtio_queue_aio_attach_host_notifier(vq, ctx);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_aio_context:
@@ -285,12 +345,48 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_detach_host_notifier(vq, s->ctx);
+        if (s->vq_aio_context[i] == ctx) {
+            virtio_queue_aio_detach_host_notifier(vq, ctx);
+        }
+    }
+}
+
+/*
+ * With the x-iothreads property, the virtqueues processed outside the
+ * BlockBackend's AioContext do not stop while the BlockBackend is drained.
+ * Disable their ioeventfds for the duration of the drained section.  This
+ * doesn't depend on the dataplane running, so that the counts stay
+ * balanced when it is started or stopped in the middle of the section.
+ */
+void virtio_blk_data_plane_drained_begin(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (s->drained) {
+        return;
+    }
+    s->drained = true;
+    for (i = 1; i < s->num_iothreads; i++) {
+        aio_disable_external(iothread_get_aio_context(s->iothreads[i]));
+    }
+}
+
+void virtio_blk_data_plane_drained_end(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->drained) {
+        return;
+    }
+    s->drained = false;
+    for (i = 1; i < s->num_iothreads; i++) {
+        aio_enable_external(iothread_get_aio_context(s->iothreads[i]));
     }
 }
 
@@ -317,6 +413,14 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 1; i < s->num_iothreads; i++) {
+        AioContext *ctx = iothread_get_aio_context(s->iothreads[i]);
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(ctx);
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
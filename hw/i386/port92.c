@@ -54,6 +54,8 @@ static const VMStateDescription vmstate_port92_isa = {
     .name = "port92",
     .version_id = 1,
     .minimum_version_id = 1,
+    /* Plain register state, the A20 line is only driven by guest writes */
+    .independent = true,
     .fields = (VMStateField[]) {
         VMSTATE_UINT8(outport, Port92State),
         VMSTATE_END_OF_LIST()
@@ -44,6 +44,14 @@ static Property virtio_blk_pci_properties[] = {
                     VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
                        DEV_NVECTORS_UNSPECIFIED),
+    /*
+     * Experimental: the virtqueues are spread over the IOThreads, but all
+     * requests are still submitted in the AioContext of the first one, so
+     * this does not make the block layer itself any more parallel.
+     */
+    DEFINE_PROP_ARRAY("x-iothreads", VirtIOBlkPCI,
+                      vdev.conf.num_iothreads, vdev.conf.iothreads,
+                      qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
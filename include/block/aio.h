@@ -121,6 +121,11 @@ struct BHListSlice {
 
 typedef QSLIST_HEAD(, AioHandler) AioHandlerSList;
 
+/* Flags of a Linux io_uring ring */
+#define LURING_IOPOLL   (1 << 0)    /* busy-poll for completions */
+#define LURING_SQPOLL   (1 << 1)    /* kernel thread polls for submissions */
+#define LURING_FLAGS_NR 4
+
 struct AioContext {
     GSource source;
 
@@ -208,10 +213,10 @@ struct AioContext {
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     /*
-     * State for Linux io_uring.  Uses aio_context_acquire/release for
-     * locking.
+     * State for Linux io_uring, one ring for each combination of
+     * LURING_* flags.  Uses aio_context_acquire/release for locking.
      */
-    struct LuringState *linux_io_uring;
+    struct LuringState *linux_io_uring[LURING_FLAGS_NR];
 
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
@@ -519,11 +524,14 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
-/* Setup the LuringState bound to this AioContext */
-struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+/* Setup the LuringState with the given LURING_* flags in this AioContext */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx,
+                                             unsigned int flags,
+                                             Error **errp);
 
-/* Return the LuringState bound to this AioContext */
-struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+/* Return the LuringState with the given LURING_* flags in this AioContext */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx,
+                                           unsigned int flags);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -19,6 +19,7 @@
 #include "block/aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/iov.h"
+#include "qapi/qapi-types-block-core.h"
 
 /* AIO request types */
 #define QEMU_AIO_READ         0x0001
@@ -44,6 +45,9 @@
 #define QEMU_AIO_BLKDEV       0x2000
 #define QEMU_AIO_NO_FALLBACK  0x4000
 
+/* Largest queue depth of the Linux AIO and io_uring engines */
+#define QEMU_AIO_MAX_QUEUE_DEPTH 32768
+
 
 /* linux-aio.c - Linux native implementation */
 #ifdef CONFIG_LINUX_AIO
@@ -58,18 +62,30 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 void laio_io_plug(BlockDriverState *bs, LinuxAioState *s);
 void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s,
                     uint64_t dev_max_batch);
+void laio_set_queue_depth(LinuxAioState *s, unsigned int max_events);
+void laio_get_stats(LinuxAioState *s, BlockStatsSpecificFileAio *stats);
 #endif
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
 typedef struct LuringState LuringState;
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(unsigned int flags, Error **errp);
 void luring_cleanup(LuringState *s);
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
-                                uint64_t offset, QEMUIOVector *qiov, int type);
+                                  int fd_index, uint64_t offset,
+                                  QEMUIOVector *qiov, int type);
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, LuringState *s,
+                                     int fd, int fd_index, const int *modes,
+                                     int nr_modes, uint64_t offset,
+                                     uint64_t len, int *failed);
+int luring_register_fd(LuringState *s, int fd);
+void luring_unregister_fd(LuringState *s, int index);
+int luring_enable_fixed_buffers(LuringState *s, Error **errp);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 void luring_io_plug(BlockDriverState *bs, LuringState *s);
 void luring_io_unplug(BlockDriverState *bs, LuringState *s);
+void luring_set_queue_depth(LuringState *s, unsigned int entries);
+void luring_get_stats(LuringState *s, BlockStatsSpecificFileAio *stats);
 #endif
 
 #ifdef _WIN32
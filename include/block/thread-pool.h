@@ -22,9 +22,17 @@
 
 #define THREAD_POOL_MAX_THREADS_DEFAULT         64
 
+/*
+ * Number of buckets in the latency histograms.  Bucket 0 counts requests
+ * that took less than 1 microsecond, bucket i those that took between
+ * 2^(i-1) and 2^i microseconds; the last bucket also counts anything slower.
+ */
+#define THREAD_POOL_LATENCY_BUCKETS             24
+
 typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
+typedef struct ThreadPoolStats ThreadPoolStats;
 
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
@@ -36,5 +44,6 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 void thread_pool_update_params(ThreadPool *pool, struct AioContext *ctx);
+ThreadPoolStats *thread_pool_query_stats(ThreadPool *pool);
 
 #endif
@@ -45,6 +45,12 @@ struct RAMBlock {
     unsigned long *bmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /* bitmap of pages present in the migration file (mapped-ram) */
+    unsigned long *file_bmap;
+    /* offset of file_bmap in the migration file (mapped-ram) */
+    off_t bitmap_offset;
+    /* offset of the first page in the migration file (mapped-ram) */
+    uint64_t pages_offset;
 
     /*
      * bitmap to track already cleared dirty bitmap.  When the bit is
@@ -311,6 +311,8 @@ struct qemu_work_item;
  *    ring is enabled.
  * @kvm_fetch_index: Keeps the index that we last fetched from the per-vCPU
  *    dirty ring structure.
+ * @throttle_us_per_full: Time in microseconds the vCPU sleeps each time its
+ *    dirty ring is full, when a dirty page rate limit is set for it.
  *
  * State of one CPU core or thread.
  */
@@ -389,6 +391,7 @@ struct CPUState {
     struct kvm_dirty_gfn *kvm_dirty_gfns;
     uint32_t kvm_fetch_index;
     uint64_t dirty_pages;
+    int64_t throttle_us_per_full;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -36,6 +36,9 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    /* x-iothreads: virtqueue i is processed by iothreads[i % num_iothreads] */
+    uint32_t num_iothreads;
+    char **iothreads;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
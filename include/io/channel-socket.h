@@ -262,4 +262,36 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Try to enable zero copy writes on a connected socket, for
+ * example one returned by qio_channel_socket_accept().  If
+ * this succeeds, the channel gets the
+ * QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY feature.
+ *
+ * Returns: true if zero copy writes are available
+ */
+bool
+qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc);
+
+
+/**
+ * qio_channel_socket_zero_copy_poll:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Collect the completions of zero copy writes that are
+ * already available, without waiting for the others.  The
+ * buffers of the first zero_copy_sent writes queued on
+ * @ioc can then be reused.
+ *
+ * Returns: the number of completed zero copy writes, or -1 on error
+ */
+ssize_t
+qio_channel_socket_zero_copy_poll(QIOChannelSocket *ioc,
+                                  Error **errp);
+
+
 #endif /* QIO_CHANNEL_SOCKET_H */
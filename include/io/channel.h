@@ -41,6 +41,7 @@ enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_SHUTDOWN,
     QIO_CHANNEL_FEATURE_LISTEN,
     QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY,
+    QIO_CHANNEL_FEATURE_SEEKABLE,
 };
 
 
@@ -142,6 +143,16 @@ struct QIOChannelClass {
                                   void *opaque);
     int (*io_flush)(QIOChannel *ioc,
                     Error **errp);
+    ssize_t (*io_pwritev)(QIOChannel *ioc,
+                          const struct iovec *iov,
+                          size_t niov,
+                          off_t offset,
+                          Error **errp);
+    ssize_t (*io_preadv)(QIOChannel *ioc,
+                         const struct iovec *iov,
+                         size_t niov,
+                         off_t offset,
+                         Error **errp);
 };
 
 /* General I/O handling functions */
@@ -606,6 +617,91 @@ off_t qio_channel_io_seek(QIOChannel *ioc,
                           int whence,
                           Error **errp);
 
+/**
+ * qio_channel_pwritev_all:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @offset: the position in the channel to start writing at
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Write data from all the regions in @iov to the channel,
+ * starting at position @offset, without changing the
+ * current I/O position of the channel.  The channel must
+ * report support for QIO_CHANNEL_FEATURE_SEEKABLE.
+ *
+ * Unlike qio_channel_writev_all(), this function never
+ * blocks waiting for the channel to become writable; it
+ * is meant for regular files opened in blocking mode.
+ *
+ * Returns: 0 if all bytes were written, or -1 on error
+ */
+int qio_channel_pwritev_all(QIOChannel *ioc,
+                            const struct iovec *iov,
+                            size_t niov,
+                            off_t offset,
+                            Error **errp);
+
+/**
+ * qio_channel_pwrite_all:
+ * @ioc: the channel object
+ * @buf: the memory region to write data from
+ * @buflen: the number of bytes to write
+ * @offset: the position in the channel to start writing at
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves as qio_channel_pwritev_all(), but with
+ * a single memory region.
+ *
+ * Returns: 0 if all bytes were written, or -1 on error
+ */
+int qio_channel_pwrite_all(QIOChannel *ioc,
+                           const char *buf,
+                           size_t buflen,
+                           off_t offset,
+                           Error **errp);
+
+/**
+ * qio_channel_preadv_all:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to read data into
+ * @niov: the length of the @iov array
+ * @offset: the position in the channel to start reading at
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Read data from the channel at position @offset into all
+ * the regions in @iov, without changing the current I/O
+ * position of the channel.  The channel must report support
+ * for QIO_CHANNEL_FEATURE_SEEKABLE.
+ *
+ * Returns: 0 if all bytes were read, or -1 on error
+ * (including reaching end of file before @iov is full)
+ */
+int qio_channel_preadv_all(QIOChannel *ioc,
+                           const struct iovec *iov,
+                           size_t niov,
+                           off_t offset,
+                           Error **errp);
+
+/**
+ * qio_channel_pread_all:
+ * @ioc: the channel object
+ * @buf: the memory region to read data into
+ * @buflen: the number of bytes to read
+ * @offset: the position in the channel to start reading at
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves as qio_channel_preadv_all(), but with
+ * a single memory region.
+ *
+ * Returns: 0 if all bytes were read, or -1 on error
+ */
+int qio_channel_pread_all(QIOChannel *ioc,
+                          char *buf,
+                          size_t buflen,
+                          off_t offset,
+                          Error **errp);
+
 
 /**
  * qio_channel_create_watch:
@@ -189,6 +189,15 @@ struct VMStateDescription {
     bool (*needed)(void *opaque);
     bool (*dev_unplug_pending)(void *opaque);
 
+    /*
+     * The state can be saved and loaded outside of the BQL, at the same
+     * time as other devices, and loading it does not depend on the state
+     * of any other device.  Such devices are saved by helper threads at
+     * the end of migration and, with the parallel-device-state
+     * capability, loaded by helper threads too.
+     */
+    bool independent;
+
     const VMStateField *fields;
     const VMStateDescription **subsections;
 };
@@ -54,6 +54,19 @@ static inline void set_bit_atomic(long nr, unsigned long *addr)
     qatomic_or(p, mask);
 }
 
+/**
+ * clear_bit_atomic - Clears a bit in memory atomically
+ * @nr: Bit to clear
+ * @addr: Address to start counting from
+ */
+static inline void clear_bit_atomic(long nr, unsigned long *addr)
+{
+    unsigned long mask = BIT_MASK(nr);
+    unsigned long *p = addr + BIT_WORD(nr);
+
+    qatomic_and(p, ~mask);
+}
+
 /**
  * clear_bit - Clears a bit in memory
  * @nr: Bit to clear
@@ -0,0 +1,28 @@
+/*
+ * Dirty page rate limit common functions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_DIRTYLIMIT_H
+#define QEMU_DIRTYLIMIT_H
+
+#define DIRTYLIMIT_CALC_TIME_MS         1000    /* 1000ms */
+
+/**
+ * dirtylimit_in_service:
+ *
+ * Returns: %true if a dirty page rate limit is set for any vcpu.
+ */
+bool dirtylimit_in_service(void);
+
+/**
+ * dirtylimit_vcpu_execute:
+ * @cpu: the vcpu whose dirty ring is full
+ *
+ * Called by the vcpu thread after its dirty ring has been reaped; sleeps
+ * for the throttle time of @cpu if a dirty page rate limit is set for it.
+ */
+void dirtylimit_vcpu_execute(CPUState *cpu);
+#endif
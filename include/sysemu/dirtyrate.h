@@ -0,0 +1,47 @@
+/*
+ * dirty page rate helper functions
+ *
+ * Copyright (c) 2020 HUAWEI TECHNOLOGIES CO., LTD.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_DIRTYRATE_H
+#define QEMU_DIRTYRATE_H
+
+#include "qapi/qapi-types-migration.h"
+
+typedef struct VcpuStat {
+    int nvcpu; /* number of vcpu */
+    DirtyRateVcpu *rates; /* array of dirty rate for each vcpu */
+} VcpuStat;
+
+/**
+ * vcpu_calculate_dirtyrate:
+ * @calc_time_ms: duration of the measurement in milliseconds
+ * @stat: filled with the dirty page rate of each vcpu, in MB/s.  The
+ *        caller frees @stat->rates.
+ * @flag: the GLOBAL_DIRTY_* reason for which dirty tracking is enabled
+ * @one_shot: stop dirty tracking for @flag once the measurement is done
+ *
+ * Measures the dirty page rate of every vcpu from the pages harvested
+ * from the per-vcpu KVM dirty rings.  Dirty tracking for @flag must
+ * already be started.
+ *
+ * Returns: the actual duration of the measurement in milliseconds.
+ */
+int64_t vcpu_calculate_dirtyrate(int64_t calc_time_ms,
+                                 VcpuStat *stat,
+                                 unsigned int flag,
+                                 bool one_shot);
+
+/**
+ * global_dirty_log_change:
+ * @flag: the GLOBAL_DIRTY_* reason for dirty tracking
+ * @start: start dirty tracking if true, stop it otherwise
+ *
+ * Takes the BQL to start or stop dirty tracking for @flag.
+ */
+void global_dirty_log_change(unsigned int flag, bool start);
+#endif
@@ -163,15 +163,7 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
-#ifdef QEMU_MSG_ZEROCOPY
-    int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
-    if (ret == 0) {
-        /* Zero copy available on host */
-        qio_channel_set_feature(QIO_CHANNEL(ioc),
-                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
-    }
-#endif
+    qio_channel_socket_enable_zero_copy(ioc);
 
     return 0;
 }
@@ -414,6 +406,22 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
     return NULL;
 }
 
+bool
+qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int v = 1;
+
+    if (setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) == 0) {
+        /* Zero copy available on host */
+        qio_channel_set_feature(QIO_CHANNEL(ioc),
+                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        return true;
+    }
+#endif
+    return false;
+}
+
 static void qio_channel_socket_init(Object *obj)
 {
     QIOChannelSocket *ioc = QIO_CHANNEL_SOCKET(obj);
@@ -607,6 +615,11 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
                          "Unable to write to socket");
         return -1;
     }
+#ifdef QEMU_MSG_ZEROCOPY
+    if (sflags & MSG_ZEROCOPY) {
+        sioc->zero_copy_queued++;
+    }
+#endif
     return ret;
 }
 #else /* WIN32 */
@@ -698,10 +711,15 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 
 
 #ifdef QEMU_MSG_ZEROCOPY
-static int qio_channel_socket_flush(QIOChannel *ioc,
-                                    Error **errp)
+/*
+ * Read zero copy completions from the socket error queue.  If @wait is
+ * false, stop as soon as the error queue is empty.
+ */
+static int qio_channel_socket_reap_zero_copy(QIOChannelSocket *sioc,
+                                             bool wait,
+                                             Error **errp)
 {
-    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
     struct msghdr msg = {};
     struct sock_extended_err *serr;
     struct cmsghdr *cm;
@@ -718,6 +736,9 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
         if (received < 0) {
             switch (errno) {
             case EAGAIN:
+                if (!wait) {
+                    return ret;
+                }
                 /* Nothing on errqueue, wait until something is available */
                 qio_channel_wait(ioc, G_IO_ERR);
                 continue;
@@ -762,8 +783,27 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
     return ret;
 }
 
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    return qio_channel_socket_reap_zero_copy(QIO_CHANNEL_SOCKET(ioc), true,
+                                             errp);
+}
+
 #endif /* QEMU_MSG_ZEROCOPY */
 
+ssize_t
+qio_channel_socket_zero_copy_poll(QIOChannelSocket *ioc,
+                                  Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    if (qio_channel_socket_reap_zero_copy(ioc, false, errp) < 0) {
+        return -1;
+    }
+#endif
+    return ioc->zero_copy_sent;
+}
+
 static int
 qio_channel_socket_set_blocking(QIOChannel *ioc,
                                 bool enabled,
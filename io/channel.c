@@ -489,6 +489,98 @@ off_t qio_channel_io_seek(QIOChannel *ioc,
     return klass->io_seek(ioc, offset, whence, errp);
 }
 
+static int qio_channel_prwv_all(QIOChannel *ioc,
+                                const struct iovec *iov,
+                                size_t niov,
+                                off_t offset,
+                                bool is_write,
+                                Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+    struct iovec *local_iov = g_new(struct iovec, niov);
+    struct iovec *local_iov_head = local_iov;
+    unsigned int nlocal_iov = niov;
+    int ret = 0;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE) ||
+        !(is_write ? klass->io_pwritev : klass->io_preadv)) {
+        error_setg(errp, "Channel does not support positioned I/O");
+        ret = -1;
+        goto cleanup;
+    }
+
+    nlocal_iov = iov_copy(local_iov, nlocal_iov,
+                          iov, niov,
+                          0, iov_size(iov, niov));
+
+    while (nlocal_iov > 0) {
+        ssize_t len;
+
+        if (is_write) {
+            len = klass->io_pwritev(ioc, local_iov, nlocal_iov, offset, errp);
+        } else {
+            len = klass->io_preadv(ioc, local_iov, nlocal_iov, offset, errp);
+        }
+        if (len < 0) {
+            ret = -1;
+            goto cleanup;
+        }
+        if (len == 0) {
+            error_setg(errp, "Unexpected end-of-file at offset %lld",
+                       (long long int)offset);
+            ret = -1;
+            goto cleanup;
+        }
+
+        iov_discard_front(&local_iov, &nlocal_iov, len);
+        offset += len;
+    }
+
+ cleanup:
+    g_free(local_iov_head);
+    return ret;
+}
+
+int qio_channel_pwritev_all(QIOChannel *ioc,
+                            const struct iovec *iov,
+                            size_t niov,
+                            off_t offset,
+                            Error **errp)
+{
+    return qio_channel_prwv_all(ioc, iov, niov, offset, true, errp);
+}
+
+int qio_channel_pwrite_all(QIOChannel *ioc,
+                           const char *buf,
+                           size_t buflen,
+                           off_t offset,
+                           Error **errp)
+{
+    struct iovec iov = { .iov_base = (char *)buf, .iov_len = buflen };
+
+    return qio_channel_prwv_all(ioc, &iov, 1, offset, true, errp);
+}
+
+int qio_channel_preadv_all(QIOChannel *ioc,
+                           const struct iovec *iov,
+                           size_t niov,
+                           off_t offset,
+                           Error **errp)
+{
+    return qio_channel_prwv_all(ioc, iov, niov, offset, false, errp);
+}
+
+int qio_channel_pread_all(QIOChannel *ioc,
+                          char *buf,
+                          size_t buflen,
+                          off_t offset,
+                          Error **errp)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = buflen };
+
+    return qio_channel_prwv_all(ioc, &iov, 1, offset, false, errp);
+}
+
 int qio_channel_flush(QIOChannel *ioc,
                                 Error **errp)
 {
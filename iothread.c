@@ -17,6 +17,7 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "block/block.h"
+#include "block/thread-pool.h"
 #include "sysemu/event-loop-base.h"
 #include "sysemu/iothread.h"
 #include "qapi/error.h"
@@ -347,6 +348,7 @@ static int query_one_iothread(Object *object, void *opaque)
     IOThreadInfoList ***tail = opaque;
     IOThreadInfo *info;
     IOThread *iothread;
+    ThreadPool *pool;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -360,6 +362,12 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
     info->aio_max_batch = iothread->parent_obj.aio_max_batch;
+    /* The pool is created lazily by the iothread */
+    pool = qatomic_load_acquire(&iothread->ctx->thread_pool);
+    if (pool) {
+        info->has_thread_pool = true;
+        info->thread_pool = thread_pool_query_stats(pool);
+    }
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
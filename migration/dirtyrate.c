@@ -27,7 +27,9 @@
 #include "qapi/qmp/qdict.h"
 #include "sysemu/kvm.h"
 #include "sysemu/runstate.h"
+#include "sysemu/dirtyrate.h"
 #include "exec/memory.h"
+#include "hw/boards.h"
 
 /*
  * total_dirty_pages is procted by BQL and is used
@@ -157,7 +159,7 @@ static void cleanup_dirtyrate_stat(struct DirtyRateConfig config)
 {
     /* last calc-dirty-rate qmp use dirty ring mode */
     if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
-        free(DirtyStat.dirty_ring.rates);
+        g_free(DirtyStat.dirty_ring.rates);
         DirtyStat.dirty_ring.rates = NULL;
     }
 }
@@ -406,32 +408,102 @@ static inline void record_dirtypages(DirtyPageRecord *dirty_pages,
     }
 }
 
-static void dirtyrate_global_dirty_log_start(void)
+void global_dirty_log_change(unsigned int flag, bool start)
 {
     qemu_mutex_lock_iothread();
-    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+    if (start) {
+        memory_global_dirty_log_start(flag);
+    } else {
+        memory_global_dirty_log_stop(flag);
+    }
     qemu_mutex_unlock_iothread();
 }
 
-static void dirtyrate_global_dirty_log_stop(void)
+/*
+ * global_dirty_log_sync
+ * 1. sync dirty log from kvm
+ * 2. stop dirty tracking if needed.
+ */
+static void global_dirty_log_sync(unsigned int flag, bool one_shot)
 {
     qemu_mutex_lock_iothread();
     memory_global_dirty_log_sync();
-    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+    if (one_shot) {
+        memory_global_dirty_log_stop(flag);
+    }
     qemu_mutex_unlock_iothread();
 }
 
-static int64_t do_calculate_dirtyrate_vcpu(DirtyPageRecord dirty_pages)
+static int64_t do_calculate_dirtyrate(DirtyPageRecord dirty_pages,
+                                      int64_t calc_time_ms)
 {
     uint64_t memory_size_MB;
-    int64_t time_s;
     uint64_t increased_dirty_pages =
         dirty_pages.end_pages - dirty_pages.start_pages;
 
     memory_size_MB = (increased_dirty_pages * TARGET_PAGE_SIZE) >> 20;
-    time_s = DirtyStat.calc_time;
 
-    return memory_size_MB / time_s;
+    return memory_size_MB * 1000 / calc_time_ms;
+}
+
+int64_t vcpu_calculate_dirtyrate(int64_t calc_time_ms,
+                                 VcpuStat *stat,
+                                 unsigned int flag,
+                                 bool one_shot)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    DirtyPageRecord *records;
+    unsigned long *present;
+    int64_t init_time_ms;
+    int64_t duration;
+    int64_t dirtyrate;
+    CPUState *cpu;
+    int i = 0;
+
+    /* Records are indexed by cpu_index, which is below max_cpus */
+    records = g_new0(DirtyPageRecord, ms->smp.max_cpus);
+    present = bitmap_new(ms->smp.max_cpus);
+
+    init_time_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    cpu_list_lock();
+    CPU_FOREACH(cpu) {
+        record_dirtypages(records, cpu, true);
+        set_bit(cpu->cpu_index, present);
+    }
+    cpu_list_unlock();
+
+    duration = set_sample_page_period(calc_time_ms, init_time_ms);
+
+    global_dirty_log_sync(flag, one_shot);
+
+    cpu_list_lock();
+    stat->nvcpu = 0;
+    CPU_FOREACH(cpu) {
+        stat->nvcpu++;
+    }
+    stat->rates = g_new0(DirtyRateVcpu, stat->nvcpu);
+
+    CPU_FOREACH(cpu) {
+        /* A vcpu plugged during the measurement has no start point */
+        if (test_bit(cpu->cpu_index, present)) {
+            record_dirtypages(records, cpu, false);
+            dirtyrate = do_calculate_dirtyrate(records[cpu->cpu_index],
+                                               duration);
+        } else {
+            dirtyrate = 0;
+        }
+        stat->rates[i].id = cpu->cpu_index;
+        stat->rates[i].dirty_rate = dirtyrate;
+        trace_dirtyrate_do_calculate_vcpu(cpu->cpu_index, dirtyrate);
+        i++;
+    }
+    cpu_list_unlock();
+
+    g_free(present);
+    g_free(records);
+
+    return duration;
 }
 
 static inline void record_dirtypages_bitmap(DirtyPageRecord *dirty_pages,
@@ -446,7 +518,8 @@ static inline void record_dirtypages_bitmap(DirtyPageRecord *dirty_pages,
 
 static void do_calculate_dirtyrate_bitmap(DirtyPageRecord dirty_pages)
 {
-    DirtyStat.dirty_rate = do_calculate_dirtyrate_vcpu(dirty_pages);
+    DirtyStat.dirty_rate = do_calculate_dirtyrate(dirty_pages,
+                                                  DirtyStat.calc_time * 1000);
 }
 
 static inline void dirtyrate_manual_reset_protect(void)
@@ -496,11 +569,11 @@ static void calculate_dirtyrate_dirty_bitmap(struct DirtyRateConfig config)
     DirtyStat.calc_time = msec / 1000;
 
     /*
-     * dirtyrate_global_dirty_log_stop do two things.
+     * do two things.
      * 1. fetch dirty bitmap from kvm
      * 2. stop dirty tracking
      */
-    dirtyrate_global_dirty_log_stop();
+    global_dirty_log_sync(GLOBAL_DIRTY_DIRTY_RATE, true);
 
     record_dirtypages_bitmap(&dirty_pages, false);
 
@@ -509,54 +582,29 @@ static void calculate_dirtyrate_dirty_bitmap(struct DirtyRateConfig config)
 
 static void calculate_dirtyrate_dirty_ring(struct DirtyRateConfig config)
 {
-    CPUState *cpu;
-    int64_t msec = 0;
-    int64_t start_time;
-    uint64_t dirtyrate = 0;
+    int64_t duration;
     uint64_t dirtyrate_sum = 0;
-    DirtyPageRecord *dirty_pages;
-    int nvcpu = 0;
     int i = 0;
 
-    CPU_FOREACH(cpu) {
-        nvcpu++;
-    }
-
-    dirty_pages = malloc(sizeof(*dirty_pages) * nvcpu);
-
-    DirtyStat.dirty_ring.nvcpu = nvcpu;
-    DirtyStat.dirty_ring.rates = malloc(sizeof(DirtyRateVcpu) * nvcpu);
-
-    dirtyrate_global_dirty_log_start();
+    /* start log sync */
+    global_dirty_log_change(GLOBAL_DIRTY_DIRTY_RATE, true);
 
-    CPU_FOREACH(cpu) {
-        record_dirtypages(dirty_pages, cpu, true);
-    }
-
-    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    DirtyStat.start_time = start_time / 1000;
-
-    msec = config.sample_period_seconds * 1000;
-    msec = set_sample_page_period(msec, start_time);
-    DirtyStat.calc_time = msec / 1000;
+    DirtyStat.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
 
-    dirtyrate_global_dirty_log_stop();
+    /* calculate vcpu dirtyrate */
+    duration = vcpu_calculate_dirtyrate(config.sample_period_seconds * 1000,
+                                        &DirtyStat.dirty_ring,
+                                        GLOBAL_DIRTY_DIRTY_RATE,
+                                        true);
 
-    CPU_FOREACH(cpu) {
-        record_dirtypages(dirty_pages, cpu, false);
-    }
+    DirtyStat.calc_time = duration / 1000;
 
+    /* calculate vm dirtyrate */
     for (i = 0; i < DirtyStat.dirty_ring.nvcpu; i++) {
-        dirtyrate = do_calculate_dirtyrate_vcpu(dirty_pages[i]);
-        trace_dirtyrate_do_calculate_vcpu(i, dirtyrate);
-
-        DirtyStat.dirty_ring.rates[i].id = i;
-        DirtyStat.dirty_ring.rates[i].dirty_rate = dirtyrate;
-        dirtyrate_sum += dirtyrate;
+        dirtyrate_sum += DirtyStat.dirty_ring.rates[i].dirty_rate;
     }
 
     DirtyStat.dirty_rate = dirtyrate_sum;
-    free(dirty_pages);
 }
 
 static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
@@ -0,0 +1,163 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * The main channel carries the usual migration stream.  When the
+ * mapped-ram capability is enabled, RAM pages are written at fixed
+ * offsets of the same file instead, which lets multifd channels open
+ * the file on their own and read or write pages in parallel.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+static struct FileOutgoingArgs {
+    char *fname;
+} outgoing_args;
+
+QIOChannel *file_send_channel_create(Error **errp)
+{
+    QIOChannelFile *ioc;
+
+    ioc = qio_channel_file_new_path(outgoing_args.fname, O_WRONLY, 0, errp);
+    if (!ioc) {
+        return NULL;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(ioc), "migration-file-multifd");
+    return QIO_CHANNEL(ioc);
+}
+
+void file_send_channel_destroy(QIOChannel *ioc)
+{
+    object_unref(OBJECT(ioc));
+    g_free(outgoing_args.fname);
+    outgoing_args.fname = NULL;
+}
+
+static bool file_check_mapped_ram(QIOChannel *ioc, Error **errp)
+{
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        error_setg(errp, "mapped-ram requires a seekable file");
+        return false;
+    }
+
+    if (migrate_use_multifd() &&
+        migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "mapped-ram does not support multifd compression");
+        return false;
+    }
+
+    if (migrate_use_zero_copy_send()) {
+        error_setg(errp, "mapped-ram does not support zero-copy-send");
+        return false;
+    }
+
+    return true;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+    QIOChannel *ioc;
+
+    trace_migration_file_outgoing(filename);
+
+    if (migrate_use_tls()) {
+        error_setg(errp, "file migration does not support TLS");
+        return;
+    }
+
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    ioc = QIO_CHANNEL(fioc);
+    if (migrate_mapped_ram() && !file_check_mapped_ram(ioc, errp)) {
+        object_unref(OBJECT(ioc));
+        return;
+    }
+
+    /* in case previous migration leaked it */
+    g_free(outgoing_args.fname);
+    outgoing_args.fname = g_strdup(filename);
+
+    qio_channel_set_name(ioc, "migration-file-outgoing");
+    migration_channel_connect(s, ioc, NULL, NULL);
+    object_unref(OBJECT(ioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    const char *filename = opaque;
+    int i, channels = 0;
+
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+
+    if (migrate_mapped_ram() && migrate_use_multifd()) {
+        channels = migrate_multifd_channels();
+    }
+
+    /*
+     * With mapped-ram, each multifd channel reads pages straight from
+     * its own file descriptor, so there is nothing to accept: open
+     * them all right away.
+     */
+    for (i = 0; i < channels; i++) {
+        Error *local_err = NULL;
+        QIOChannelFile *fioc;
+
+        fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, &local_err);
+        if (!fioc) {
+            error_report_err(local_err);
+            break;
+        }
+
+        qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-multifd");
+        migration_channel_process_incoming(QIO_CHANNEL(fioc));
+        object_unref(OBJECT(fioc));
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *fioc;
+    QIOChannel *ioc;
+
+    trace_migration_file_incoming(filename);
+
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    ioc = QIO_CHANNEL(fioc);
+    if (migrate_mapped_ram() &&
+        !qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        error_setg(errp, "mapped-ram requires a seekable file");
+        object_unref(OBJECT(ioc));
+        return;
+    }
+
+    qio_channel_set_name(ioc, "migration-file-incoming");
+    qio_channel_add_watch_full(ioc, G_IO_IN,
+                               file_accept_incoming_migration,
+                               g_strdup(filename), g_free,
+                               g_main_context_get_thread_default());
+}
@@ -20,6 +20,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
@@ -101,12 +102,22 @@
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+/* 0: no dictionary, otherwise the size of the trained zstd dictionary */
+#define DEFAULT_MIGRATE_MULTIFD_ZSTD_DICT_SIZE 0
+#define MULTIFD_ZSTD_DICT_SIZE_MIN 256
+#define MULTIFD_ZSTD_DICT_SIZE_MAX (1024 * 1024)
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
  */
 #define DEFAULT_MIGRATE_MAX_POSTCOPY_BANDWIDTH 0
 
+/* Threads syncing the dirty bitmap, including the migration thread */
+#define DEFAULT_MIGRATE_DIRTY_SYNC_THREADS 4
+
+/* Threads saving and loading independent devices */
+#define DEFAULT_MIGRATE_DEVICE_STATE_THREADS 4
+
 /*
  * Parameters for self_announce_delay giving a stream of RARP/ARP
  * packets after migration.
@@ -163,7 +174,19 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_COMPRESS,
     MIGRATION_CAPABILITY_XBZRLE,
     MIGRATION_CAPABILITY_X_COLO,
-    MIGRATION_CAPABILITY_VALIDATE_UUID);
+    MIGRATION_CAPABILITY_VALIDATE_UUID,
+    MIGRATION_CAPABILITY_MAPPED_RAM);
+
+/* Mapped-ram compatibility check list */
+static const
+INITIALIZE_MIGRATE_CAPS_SET(check_caps_mapped_ram,
+    MIGRATION_CAPABILITY_POSTCOPY_RAM,
+    MIGRATION_CAPABILITY_XBZRLE,
+    MIGRATION_CAPABILITY_COMPRESS,
+    MIGRATION_CAPABILITY_X_COLO,
+    MIGRATION_CAPABILITY_X_IGNORE_SHARED,
+    MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+    MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT);
 
 /* When we add fault tolerance, we could have several
    migrations at once.  For now we don't need to add
@@ -192,6 +215,19 @@ bool migrate_multi_channels_is_allowed(void)
     return migrate_allow_multi_channels;
 }
 
+/* Mapped-ram writes pages at fixed offsets, only file: can seek */
+static bool migrate_allow_mapped_ram = true;
+
+static bool migrate_mapped_ram_uri_check(const char *uri, Error **errp)
+{
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram is only supported by the file: "
+                   "migration protocol");
+        return false;
+    }
+    return true;
+}
+
 static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
 {
     uintptr_t a = (uintptr_t) ap, b = (uintptr_t) bp;
@@ -218,6 +254,8 @@ void migration_object_init(void)
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    qemu_sem_init(&current_incoming->postcopy_pause_sem_fast_load, 0);
+    qemu_mutex_init(&current_incoming->postcopy_prio_thread_mutex);
     qemu_mutex_init(&current_incoming->page_request_mutex);
     current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
 
@@ -308,6 +346,11 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        migration_ioc_unregister_yank_from_file(mis->postcopy_qemufile_dst);
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -481,7 +524,12 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p = NULL;
 
+    if (!migrate_mapped_ram_uri_check(uri, errp)) {
+        return;
+    }
+
     migrate_protocol_allow_multi_channels(false); /* reset it anyway */
+    migrate_allow_mapped_ram = strstart(uri, "file:", NULL);
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (strstart(uri, "tcp:", &p) ||
         strstart(uri, "unix:", NULL) ||
@@ -496,6 +544,9 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        migrate_protocol_allow_multi_channels(migrate_mapped_ram());
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -505,6 +556,7 @@ static void process_incoming_migration_bh(void *opaque)
 {
     Error *local_err = NULL;
     MigrationIncomingState *mis = opaque;
+    int64_t start;
 
     /* If capability late_block_activate is set:
      * Only fire up the block code now if we're going to restart the
@@ -541,6 +593,7 @@ static void process_incoming_migration_bh(void *opaque)
 
     dirty_bitmap_mig_before_vm_start();
 
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     if (!global_state_received() ||
         global_state_get_runstate() == RUN_STATE_RUNNING) {
         if (autostart) {
@@ -554,6 +607,8 @@ static void process_incoming_migration_bh(void *opaque)
     } else {
         runstate_set(global_state_get_runstate());
     }
+    mis->downtime_vm_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+    trace_migration_downtime_phase("vm-start", mis->downtime_vm_start);
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -578,7 +633,13 @@ static void process_incoming_migration_co(void *opaque)
     postcopy_state_set(POSTCOPY_INCOMING_NONE);
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
+    mis->downtime_load_start = 0;
     ret = qemu_loadvm_state(mis->from_src_file);
+    if (mis->downtime_load_start) {
+        mis->downtime_load = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                             mis->downtime_load_start;
+        trace_migration_downtime_phase("load", mis->downtime_load);
+    }
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -714,15 +775,25 @@ void migration_fd_process_incoming(QEMUFile *f, Error **errp)
     migration_incoming_process();
 }
 
+/*
+ * Returns true when the migration needs more than the main channel, in
+ * which case the incoming side must wait for all of them to connect.
+ */
+static bool migration_needs_multiple_sockets(void)
+{
+    return migrate_use_multifd() || migrate_postcopy_preempt();
+}
+
 void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
     Error *local_err = NULL;
     bool start_migration;
+    QEMUFile *f;
 
     if (!mis->from_src_file) {
         /* The first connection (multifd may have multiple) */
-        QEMUFile *f = qemu_fopen_channel_input(ioc);
+        f = qemu_fopen_channel_input(ioc);
 
         if (!migration_incoming_setup(f, errp)) {
             return;
@@ -730,13 +801,19 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Some features need more than one channel, we wait.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migration_needs_multiple_sockets();
     } else {
         /* Multiple connections */
-        assert(migrate_use_multifd());
-        start_migration = multifd_recv_new_channel(ioc, &local_err);
+        assert(migration_needs_multiple_sockets());
+        if (migrate_use_multifd()) {
+            start_migration = multifd_recv_new_channel(ioc, &local_err);
+        } else {
+            assert(migrate_postcopy_preempt());
+            f = qemu_fopen_channel_input(ioc);
+            start_migration = postcopy_preempt_new_channel(mis, f);
+        }
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -765,6 +842,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -910,6 +991,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->multifd_zlib_level = s->parameters.multifd_zlib_level;
     params->has_multifd_zstd_level = true;
     params->multifd_zstd_level = s->parameters.multifd_zstd_level;
+    params->has_multifd_zstd_dict_size = true;
+    params->multifd_zstd_dict_size = s->parameters.multifd_zstd_dict_size;
 #ifdef CONFIG_LINUX
     params->has_zero_copy_send = true;
     params->zero_copy_send = s->parameters.zero_copy_send;
@@ -1038,6 +1121,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->precopy_bytes = ram_counters.precopy_bytes;
     info->ram->downtime_bytes = ram_counters.downtime_bytes;
     info->ram->postcopy_bytes = ram_counters.postcopy_bytes;
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
+    info->ram->dirty_sync_time_total = ram_counters.dirty_sync_time_total;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -1138,6 +1223,11 @@ static void fill_source_migration_info(MigrationInfo *info)
         populate_time_info(info, s);
         populate_ram_info(info, s);
         populate_vfio_info(info);
+        if (s->downtime_stats) {
+            info->has_downtime_stats = true;
+            info->downtime_stats = QAPI_CLONE(MigrationDowntimeStats,
+                                              s->downtime_stats);
+        }
         break;
     case MIGRATION_STATUS_FAILED:
         info->has_status = true;
@@ -1242,6 +1332,32 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        /*
+         * Preempt mode requires urgent pages to be sent in a separate
+         * channel, while compression would spread pages over the
+         * compression threads, which breaks the channel assignment.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt not compatible with compress");
+            return false;
+        }
+
+        /*
+         * The destination can't tell the preempt channel apart from the
+         * multifd channels yet.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt not compatible with multifd");
+            return false;
+        }
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1275,6 +1391,20 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        int idx;
+
+        for (idx = 0; idx < check_caps_mapped_ram.size; idx++) {
+            int incomp_cap = check_caps_mapped_ram.caps[idx];
+            if (cap_list[incomp_cap]) {
+                error_setg(errp,
+                        "Mapped-ram is not compatible with %s",
+                        MigrationCapability_str(incomp_cap));
+                return false;
+            }
+        }
+    }
+
     /* incoming side only */
     if (runstate_check(RUN_STATE_INMIGRATE) &&
         !migrate_multi_channels_is_allowed() &&
@@ -1283,6 +1413,21 @@ static bool migrate_caps_check(bool *cap_list,
         return false;
     }
 
+    if (runstate_check(RUN_STATE_INMIGRATE) &&
+        !migrate_multi_channels_is_allowed() &&
+        cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        error_setg(errp, "postcopy-preempt is not supported by current "
+                   "protocol");
+        return false;
+    }
+
+    if (runstate_check(RUN_STATE_INMIGRATE) &&
+        !migrate_allow_mapped_ram &&
+        cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        error_setg(errp, "mapped-ram is not supported by current protocol");
+        return false;
+    }
+
     return true;
 }
 
@@ -1313,6 +1458,14 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        if (mis->downtime_load_start) {
+            info->has_downtime_stats = true;
+            info->downtime_stats = g_new0(MigrationDowntimeStats, 1);
+            info->downtime_stats->has_load = true;
+            info->downtime_stats->load = mis->downtime_load;
+            info->downtime_stats->has_vm_start = true;
+            info->downtime_stats->vm_start = mis->downtime_vm_start;
+        }
         break;
     }
     info->status = mis->state;
@@ -1444,6 +1597,16 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_multifd_zstd_dict_size &&
+        params->multifd_zstd_dict_size &&
+        (params->multifd_zstd_dict_size < MULTIFD_ZSTD_DICT_SIZE_MIN ||
+         params->multifd_zstd_dict_size > MULTIFD_ZSTD_DICT_SIZE_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_zstd_dict_size",
+                   "0 or a value between 256 and 1048576");
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1580,6 +1743,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_compression) {
         dest->multifd_compression = params->multifd_compression;
     }
+    if (params->has_multifd_zstd_dict_size) {
+        dest->multifd_zstd_dict_size = params->multifd_zstd_dict_size;
+    }
 #ifdef CONFIG_LINUX
     if (params->has_zero_copy_send) {
         dest->zero_copy_send = params->zero_copy_send;
@@ -1697,6 +1863,9 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_compression) {
         s->parameters.multifd_compression = params->multifd_compression;
     }
+    if (params->has_multifd_zstd_dict_size) {
+        s->parameters.multifd_zstd_dict_size = params->multifd_zstd_dict_size;
+    }
 #ifdef CONFIG_LINUX
     if (params->has_zero_copy_send) {
         s->parameters.zero_copy_send = params->zero_copy_send;
@@ -1803,6 +1972,83 @@ void migrate_set_state(int *state, int old_state, int new_state)
     }
 }
 
+/*
+ * Start a new breakdown of the downtime, called each time the guest is
+ * about to be stopped.
+ */
+void migration_downtime_reset(MigrationState *s)
+{
+    qapi_free_MigrationDowntimeStats(s->downtime_stats);
+    s->downtime_stats = g_new0(MigrationDowntimeStats, 1);
+    s->downtime_sections_tail = &s->downtime_stats->sections;
+}
+
+/*
+ * Drop the breakdown: savevm stops the guest but isn't a migration, and
+ * must not add its sections to the breakdown of the last migration.
+ */
+void migration_downtime_clear(MigrationState *s)
+{
+    qapi_free_MigrationDowntimeStats(s->downtime_stats);
+    s->downtime_stats = NULL;
+    s->downtime_sections_tail = NULL;
+}
+
+/* Account @time (us) to one phase of the current downtime */
+void migration_downtime_add(MigrationDowntimePhase phase, int64_t time)
+{
+    static const char *const phase_names[] = {
+        [MIGRATION_DOWNTIME_VM_STOP] = "vm-stop",
+        [MIGRATION_DOWNTIME_ITERABLE] = "iterable",
+        [MIGRATION_DOWNTIME_NON_ITERABLE] = "non-iterable",
+        [MIGRATION_DOWNTIME_FLUSH] = "flush",
+    };
+    MigrationDowntimeStats *stats = current_migration->downtime_stats;
+
+    trace_migration_downtime_phase(phase_names[phase], time);
+    if (!stats) {
+        return;
+    }
+
+    switch (phase) {
+    case MIGRATION_DOWNTIME_VM_STOP:
+        stats->has_vm_stop = true;
+        stats->vm_stop += time;
+        break;
+    case MIGRATION_DOWNTIME_ITERABLE:
+        stats->has_iterable = true;
+        stats->iterable += time;
+        break;
+    case MIGRATION_DOWNTIME_NON_ITERABLE:
+        stats->has_non_iterable = true;
+        stats->non_iterable += time;
+        break;
+    case MIGRATION_DOWNTIME_FLUSH:
+        stats->has_flush = true;
+        stats->flush += time;
+        break;
+    }
+}
+
+/* Account @time (us) to one section saved during the current downtime */
+void migration_downtime_add_section(const char *name, uint32_t instance_id,
+                                    int64_t time)
+{
+    MigrationDowntimeSection *section;
+
+    trace_migration_downtime_section(name, instance_id, time);
+    if (!current_migration->downtime_stats) {
+        return;
+    }
+
+    section = g_new0(MigrationDowntimeSection, 1);
+    section->name = g_strdup(name);
+    section->instance_id = instance_id;
+    section->time = time;
+    current_migration->downtime_stats->has_sections = true;
+    QAPI_LIST_APPEND(current_migration->downtime_sections_tail, section);
+}
+
 static MigrationCapabilityStatus *migrate_cap_add(MigrationCapability index,
                                                   bool state)
 {
@@ -1873,6 +2119,12 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_fclose(tmp);
     }
 
+    if (s->postcopy_qemufile_src) {
+        migration_ioc_unregister_yank_from_file(s->postcopy_qemufile_src);
+        qemu_fclose(s->postcopy_qemufile_src);
+        s->postcopy_qemufile_src = NULL;
+    }
+
     assert(!migration_is_active(s));
 
     if (s->state == MIGRATION_STATUS_CANCELLING) {
@@ -1967,6 +2219,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING && s->postcopy_qemufile_src) {
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -2092,6 +2347,7 @@ void migrate_init(MigrationState *s)
     s->pages_per_second = 0.0;
     s->downtime = 0;
     s->expected_downtime = 0;
+    migration_downtime_reset(s);
     s->setup_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
@@ -2271,6 +2527,16 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
             return false;
         }
 
+        /*
+         * Recovery only reconnects the main channel, pages that were
+         * queued on the multifd channels can't be sent anymore.
+         */
+        if (migrate_use_multifd() && migrate_use_multifd_postcopy()) {
+            error_setg(errp, "Postcopy recovery cannot work "
+                       "when multifd-postcopy is set");
+            return false;
+        }
+
         /* This is a resume, skip init status */
         return true;
     }
@@ -2336,6 +2602,10 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     const char *p = NULL;
 
+    if (!migrate_mapped_ram_uri_check(uri, errp)) {
+        return;
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -2362,6 +2632,9 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         exec_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        migrate_protocol_allow_multi_channels(migrate_mapped_ram());
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         if (!(has_resume && resume)) {
             yank_unregister_instance(MIGRATION_YANK_INSTANCE);
@@ -2418,6 +2691,15 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
@@ -2540,6 +2822,15 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2586,6 +2877,60 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+uint32_t migrate_multifd_zstd_dict_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_zstd_dict_size;
+}
+
+bool migrate_use_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->multifd_zero_page;
+}
+
+bool migrate_use_multifd_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->multifd_postcopy;
+}
+
+int migrate_dirty_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->dirty_sync_threads;
+}
+
+int migrate_device_state_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->device_state_threads;
+}
+
+bool migrate_parallel_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PARALLEL_DEVICE_STATE];
+}
+
 #ifdef CONFIG_LINUX
 bool migrate_use_zero_copy_send(void)
 {
@@ -3005,9 +3350,20 @@ static int postcopy_start(MigrationState *ms)
     QIOChannelBuffer *bioc;
     QEMUFile *fb;
     int64_t time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t stop_start;
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    /*
+     * Urgent pages will be sent on the preempt channel as soon as the
+     * destination starts running, so it must be there by now.
+     */
+    if (postcopy_preempt_wait_channel(ms)) {
+        migrate_set_state(&ms->state, ms->state, MIGRATION_STATUS_FAILED);
+        return -1;
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3019,10 +3375,14 @@ static int postcopy_start(MigrationState *ms)
 
     qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
     global_state_store();
+    migration_downtime_reset(ms);
+    stop_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
     if (ret < 0) {
         goto fail;
     }
+    migration_downtime_add(MIGRATION_DOWNTIME_VM_STOP,
+                           qemu_clock_get_us(QEMU_CLOCK_REALTIME) - stop_start);
 
     ret = migration_maybe_pause(ms, &cur_state,
                                 MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3226,14 +3586,20 @@ static void migration_completion(MigrationState *s)
     if (s->state == MIGRATION_STATUS_ACTIVE) {
         qemu_mutex_lock_iothread();
         s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        migration_downtime_reset(s);
         qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
         s->vm_was_running = runstate_is_running();
         ret = global_state_store();
 
         if (!ret) {
             bool inactivate = !migrate_colo_enabled();
+            int64_t stop_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
             ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
             trace_migration_completion_vm_stop(ret);
+            migration_downtime_add(MIGRATION_DOWNTIME_VM_STOP,
+                                   qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   stop_start);
             if (ret >= 0) {
                 ret = migration_maybe_pause(s, &current_active_state,
                                             MIGRATION_STATUS_DEVICE);
@@ -3259,6 +3625,11 @@ static void migration_completion(MigrationState *s)
         qemu_savevm_state_complete_postcopy(s->to_dst_file);
         qemu_mutex_unlock_iothread();
 
+        /* Let the preempt thread on the destination quit */
+        if (migrate_postcopy_preempt()) {
+            ram_postcopy_preempt_shutdown(s);
+        }
+
         trace_migration_completion_postcopy_end_after_complete();
     } else {
         goto fail;
@@ -3398,6 +3769,13 @@ static int postcopy_do_resume(MigrationState *s)
 {
     int ret;
 
+    /* The preempt channel is reconnected by migrate_fd_connect() */
+    ret = postcopy_preempt_wait_channel(s);
+    if (ret) {
+        error_report("%s: preempt channel not established", __func__);
+        return ret;
+    }
+
     /*
      * Call all the resume_prepare() hooks, so that modules can be
      * ready for the migration resume.
@@ -3453,6 +3831,17 @@ static MigThrError postcopy_pause(MigrationState *s)
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        /*
+         * Do the same to the postcopy preempt channel if there is one.  No
+         * locking needed, only the migration thread uses it.
+         */
+        if (s->postcopy_qemufile_src) {
+            migration_ioc_unregister_yank_from_file(s->postcopy_qemufile_src);
+            qemu_file_shutdown(s->postcopy_qemufile_src);
+            qemu_fclose(s->postcopy_qemufile_src);
+            s->postcopy_qemufile_src = NULL;
+        }
+
         migrate_set_state(&s->state, s->state,
                           MIGRATION_STATUS_POSTCOPY_PAUSED);
 
@@ -4146,6 +4535,14 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         }
     }
 
+    /* This needs to be done before resuming a postcopy */
+    if (postcopy_preempt_setup(s, &local_err)) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, s->state, MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     if (resume) {
         /* Wakeup the main migration thread to do the recovery */
         migrate_set_state(&s->state, MIGRATION_STATUS_POSTCOPY_PAUSED,
@@ -4189,6 +4586,10 @@ void migration_global_dump(Monitor *mon)
                    ms->decompress_error_check ? "on" : "off");
     monitor_printf(mon, "clear-bitmap-shift: %u\n",
                    ms->clear_bitmap_shift);
+    monitor_printf(mon, "dirty-sync-threads: %u\n",
+                   ms->dirty_sync_threads);
+    monitor_printf(mon, "device-state-threads: %u\n",
+                   ms->device_state_threads);
 }
 
 #define DEFINE_PROP_MIG_CAP(name, x)             \
@@ -4205,6 +4606,15 @@ static Property migration_properties[] = {
                       decompress_error_check, true),
     DEFINE_PROP_UINT8("x-clear-bitmap-shift", MigrationState,
                       clear_bitmap_shift, CLEAR_BITMAP_SHIFT_DEFAULT),
+    DEFINE_PROP_BOOL("multifd-zero-page", MigrationState,
+                     multifd_zero_page, true),
+    DEFINE_PROP_BOOL("multifd-postcopy", MigrationState,
+                     multifd_postcopy, false),
+    DEFINE_PROP_UINT8("x-dirty-sync-threads", MigrationState,
+                      dirty_sync_threads, DEFAULT_MIGRATE_DIRTY_SYNC_THREADS),
+    DEFINE_PROP_UINT8("x-device-state-threads", MigrationState,
+                      device_state_threads,
+                      DEFAULT_MIGRATE_DEVICE_STATE_THREADS),
 
     /* Migration parameters */
     DEFINE_PROP_UINT8("x-compress-level", MigrationState,
@@ -4249,6 +4659,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
                       parameters.multifd_zstd_level,
                       DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_UINT32("multifd-zstd-dict-size", MigrationState,
+                      parameters.multifd_zstd_dict_size,
+                      DEFAULT_MIGRATE_MULTIFD_ZSTD_DICT_SIZE),
 #ifdef CONFIG_LINUX
     DEFINE_PROP_BOOL("zero_copy_send", MigrationState,
                       parameters.zero_copy_send, false),
@@ -4317,7 +4730,9 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     error_free(ms->error);
+    qapi_free_MigrationDowntimeStats(ms->downtime_stats);
 }
 
 static void migration_instance_init(Object *obj)
@@ -4350,6 +4765,7 @@ static void migration_instance_init(Object *obj)
     params->has_multifd_compression = true;
     params->has_multifd_zlib_level = true;
     params->has_multifd_zstd_level = true;
+    params->has_multifd_zstd_dict_size = true;
 #ifdef CONFIG_LINUX
     params->has_zero_copy_send = true;
 #endif
@@ -4366,6 +4782,7 @@ static void migration_instance_init(Object *obj)
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
 }
 
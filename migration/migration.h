@@ -45,6 +45,15 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/* Migration channel types */
+enum {
+    /* The default channel, carrying the precopy stream and device state */
+    RAM_CHANNEL_PRECOPY = 0,
+    /* The postcopy preempt channel, carrying urgent page requests only */
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
 /* This is an abstraction of a "temp huge page" for postcopy's purpose */
 typedef struct {
     /*
@@ -66,8 +75,8 @@ typedef struct {
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
-    /* Previously received RAM's RAMBlock pointer */
-    RAMBlock *last_recv_block;
+    /* Previously received RAM's RAMBlock pointer, one per channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
     /* A hook to allow cleanup at the end of incoming migration */
     void *transport_data;
     void (*transport_cleanup)(void *data);
@@ -119,6 +128,19 @@ struct MigrationIncomingState {
     PostcopyTmpPage *postcopy_tmp_pages;
     /* This is shared for all postcopy channels */
     void     *postcopy_tmp_zero_page;
+    /*
+     * QEMUFile for the postcopy preempt channel, where the source sends
+     * the pages that the destination requested during postcopy.
+     */
+    QEMUFile *postcopy_qemufile_dst;
+    /* Thread loading pages from postcopy_qemufile_dst */
+    QemuThread postcopy_prio_thread;
+    bool postcopy_prio_thread_created;
+    /*
+     * Held by the preempt thread while it is loading pages, so that the
+     * main thread can safely release postcopy_qemufile_dst when pausing.
+     */
+    QemuMutex postcopy_prio_thread_mutex;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -141,6 +163,8 @@ struct MigrationIncomingState {
     /* notify PAUSED postcopy incoming migrations to try to continue */
     QemuSemaphore postcopy_pause_sem_dst;
     QemuSemaphore postcopy_pause_sem_fault;
+    /* Wakes up the preempt thread once the preempt channel is recovered */
+    QemuSemaphore postcopy_pause_sem_fast_load;
 
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
@@ -161,6 +185,13 @@ struct MigrationIncomingState {
      * contains valid information.
      */
     QemuMutex page_request_mutex;
+
+    /* Timestamp (us) of the first section of the source's final pass */
+    int64_t downtime_load_start;
+    /* Time (us) spent loading the final pass and the device state */
+    int64_t downtime_load;
+    /* Time (us) spent starting the guest */
+    int64_t downtime_vm_start;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -192,6 +223,13 @@ struct MigrationState {
     QEMUBH *cleanup_bh;
     /* Protected by qemu_file_lock */
     QEMUFile *to_dst_file;
+    /*
+     * The postcopy preempt channel, only used by the migration thread to
+     * send the pages requested by the destination during postcopy.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once the creation of postcopy_qemufile_src has finished */
+    QemuSemaphore postcopy_qemufile_src_sem;
     QIOChannelBuffer *bioc;
     /*
      * Protects to_dst_file/from_dst_file pointers.  We need to make sure we
@@ -252,6 +290,9 @@ struct MigrationState {
     int64_t downtime_start;
     int64_t downtime;
     int64_t expected_downtime;
+    /* Breakdown of the latest downtime, and where to add its sections */
+    MigrationDowntimeStats *downtime_stats;
+    MigrationDowntimeSectionList **downtime_sections_tail;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
     /*
@@ -328,6 +369,36 @@ struct MigrationState {
      */
     uint8_t clear_bitmap_shift;
 
+    /*
+     * Whether zero pages are detected by the multifd channel threads
+     * and transmitted as part of the multifd packet.  Older qemu
+     * detect them on the migration thread and send them on the main
+     * stream, so this is left at false for machine types up to 7.0.
+     */
+    bool multifd_zero_page;
+
+    /*
+     * Whether the multifd channels keep sending background pages once
+     * postcopy has started, the destination placing them with
+     * UFFDIO_COPY.  Older qemu only use the main channel during
+     * postcopy, so this is left at false for machine types up to 7.0.
+     */
+    bool multifd_postcopy;
+
+    /*
+     * Number of threads, the caller included, that split the dirty
+     * bitmap sync of guests bigger than a chunk.  1 keeps the sync on
+     * the migration thread.
+     */
+    uint8_t dirty_sync_threads;
+
+    /*
+     * Number of helper threads saving and loading the devices whose
+     * VMStateDescription is flagged as independent.  0 or 1 save and
+     * load them on the migration thread like the other devices.
+     */
+    uint8_t device_state_threads;
+
     /*
      * This save hostname when out-going migration starts
      */
@@ -336,6 +407,19 @@ struct MigrationState {
 
 void migrate_set_state(int *state, int old_state, int new_state);
 
+typedef enum MigrationDowntimePhase {
+    MIGRATION_DOWNTIME_VM_STOP,
+    MIGRATION_DOWNTIME_ITERABLE,
+    MIGRATION_DOWNTIME_NON_ITERABLE,
+    MIGRATION_DOWNTIME_FLUSH,
+} MigrationDowntimePhase;
+
+void migration_downtime_reset(MigrationState *s);
+void migration_downtime_clear(MigrationState *s);
+void migration_downtime_add(MigrationDowntimePhase phase, int64_t time);
+void migration_downtime_add_section(const char *name, uint32_t instance_id,
+                                    int64_t time);
+
 void migration_fd_process_incoming(QEMUFile *f, Error **errp);
 void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp);
 void migration_incoming_process(void);
@@ -362,6 +446,7 @@ bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_preempt(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
@@ -369,11 +454,18 @@ bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_mapped_ram(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
+uint32_t migrate_multifd_zstd_dict_size(void);
+bool migrate_use_multifd_zero_page(void);
+bool migrate_use_multifd_postcopy(void);
+int migrate_dirty_sync_threads(void);
+int migrate_device_state_threads(void);
+bool migrate_parallel_device_state(void);
 
 #ifdef CONFIG_LINUX
 bool migrate_use_zero_copy_send(void);
@@ -0,0 +1,259 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each page is compressed on its own.  The packet data starts with the
+ * big endian compressed size of every page, followed by the compressed
+ * pages.  Pages that don't shrink are sent as is, with a size equal to
+ * the page size.
+ */
+
+struct lz4_data {
+    /* state for compression */
+    void *state;
+    /* compressed sizes, at the start of zbuff */
+    uint32_t *sizes;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+static uint32_t lz4_zbuff_len(void)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+
+    return page_count * sizeof(uint32_t) + MULTIFD_PACKET_SIZE;
+}
+
+/* Multifd lz4 compression */
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Setup each channel with lz4 compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->state = g_try_malloc(LZ4_sizeofState());
+    /* This is the maximum size of the compressed buffer */
+    z->zbuff_len = lz4_zbuff_len();
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->state || !z->zbuff) {
+        g_free(z->state);
+        g_free(z->zbuff);
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for lz4", p->id);
+        return -1;
+    }
+    z->sizes = (uint32_t *)z->zbuff;
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+
+    g_free(z->state);
+    z->state = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare date to be able to send
+ *
+ * Create a compressed buffer with all the pages that we are going to
+ * send.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+    size_t page_size = qemu_target_page_size();
+    uint32_t out_size = p->normal_num * sizeof(uint32_t);
+    uint32_t i;
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *page = p->pages->block->host + p->normal[i];
+        int ret;
+
+        /* Anything not smaller than a page is not worth it */
+        ret = LZ4_compress_fast_extState(z->state, (const char *)page,
+                                         (char *)z->zbuff + out_size,
+                                         page_size, page_size - 1, 1);
+        if (ret <= 0) {
+            memcpy(z->zbuff + out_size, page, page_size);
+            ret = page_size;
+        }
+        z->sizes[i] = cpu_to_be32(ret);
+        out_size += ret;
+    }
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = out_size;
+    p->flags |= MULTIFD_FLAG_LZ4;
+
+    return 0;
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Create the compressed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->zbuff_len = lz4_zbuff_len();
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    z->sizes = (uint32_t *)z->zbuff;
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_recv_cleanup: cleanup receive side
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lz4_data *z = p->data;
+
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+    uint32_t in_size = p->next_packet_size;
+    size_t page_size = qemu_target_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t offset = p->normal_num * sizeof(uint32_t);
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+    if (in_size < offset || in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u for %u pages",
+                   p->id, in_size, p->normal_num);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint32_t size = be32_to_cpu(z->sizes[i]);
+        char *host = multifd_recv_page_host(p, i);
+
+        if (size > page_size || size > in_size - offset) {
+            error_setg(errp, "multifd %u: page %d compressed size %u invalid",
+                       p->id, i, size);
+            return -1;
+        }
+        if (size == page_size) {
+            memcpy(host, z->zbuff + offset, page_size);
+        } else {
+            ret = LZ4_decompress_safe((const char *)z->zbuff + offset, host,
+                                      size, page_size);
+            if (ret != page_size) {
+                error_setg(errp, "multifd %u: page %d decompressed to %d "
+                           "bytes instead of %zu", p->id, i, ret, page_size);
+                return -1;
+            }
+        }
+        offset += size;
+    }
+    if (offset != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size used %u",
+                   p->id, in_size, offset);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv_pages = lz4_recv_pages
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
@@ -253,7 +253,7 @@ static int zlib_recv_pages(MultiFDRecvParams *p, Error **errp)
         }
 
         zs->avail_out = page_size;
-        zs->next_out = p->host + p->normal[i];
+        zs->next_out = multifd_recv_page_host(p, i);
 
         /*
          * Welcome to inflate semantics
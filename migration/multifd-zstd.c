@@ -12,14 +12,48 @@
 
 #include "qemu/osdep.h"
 #include <zstd.h>
+#include <zdict.h>
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "qemu/lockable.h"
 #include "exec/ramblock.h"
 #include "exec/target_page.h"
 #include "qapi/error.h"
 #include "migration.h"
+#include "ram.h"
 #include "trace.h"
 #include "multifd.h"
 
+/* Sent once per channel before any page when a dictionary is in use */
+#define MULTIFD_ZSTD_DICT_MAGIC 0x5a444943U
+
+/* Training wants about 100 times the dictionary size in samples */
+#define MULTIFD_ZSTD_DICT_SAMPLE_RATIO 100
+#define MULTIFD_ZSTD_DICT_MAX_SAMPLES 4096
+#define MULTIFD_ZSTD_DICT_MIN_SAMPLES 16
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+} __attribute__((packed)) MultiFDZstdDictHdr;
+
+/*
+ * The dictionary is trained once on the source and shared by all the
+ * channels.  Setup and cleanup of the channels happen from the same
+ * thread, which counts the users without locking.  Training reads a lot
+ * of guest RAM, so it is left to the first channel thread that sends
+ * its handshake, out of the BQL; @lock makes the others wait for it.
+ */
+static struct {
+    QemuMutex lock;
+    bool trained;
+    void *buf;
+    /* 0 when training failed: pages are sent without dictionary */
+    size_t size;
+    ZSTD_CDict *cdict;
+    unsigned int users;
+} zstd_dict;
+
 struct zstd_data {
     /* stream for compression */
     ZSTD_CStream *zcs;
@@ -32,10 +66,110 @@ struct zstd_data {
     uint8_t *zbuff;
     /* size of compressed buffer */
     uint32_t zbuff_len;
+    /* channel holds a reference on zstd_dict */
+    bool dict_user;
+    /* dictionary received from the source */
+    ZSTD_DDict *ddict;
 };
 
 /* Multifd zstd compression */
 
+/**
+ * zstd_dict_train: train the shared dictionary on a sample of guest RAM
+ *
+ * Pages are picked at a fixed stride over all the migratable RAM,
+ * skipping zero pages.  On failure the dictionary is left empty and
+ * the channels compress without it.
+ */
+static void zstd_dict_train(void)
+{
+    size_t page_size = qemu_target_page_size();
+    uint32_t dict_size = migrate_multifd_zstd_dict_size();
+    uint64_t total_pages = 0, stride, skip = 0;
+    uint32_t nb_samples, count = 0;
+    size_t *sample_sizes;
+    uint8_t *samples;
+    RAMBlock *block;
+    size_t ret;
+
+    nb_samples = MIN((uint64_t)dict_size * MULTIFD_ZSTD_DICT_SAMPLE_RATIO /
+                     page_size, MULTIFD_ZSTD_DICT_MAX_SAMPLES);
+    nb_samples = MAX(nb_samples, MULTIFD_ZSTD_DICT_MIN_SAMPLES);
+    samples = g_malloc(nb_samples * page_size);
+    sample_sizes = g_new(size_t, nb_samples);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            total_pages += block->used_length / page_size;
+        }
+        stride = MAX(total_pages / nb_samples, 1);
+
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            ram_addr_t offset;
+
+            for (offset = skip * page_size;
+                 offset < block->used_length && count < nb_samples;
+                 offset += stride * page_size) {
+                uint8_t *page = block->host + offset;
+
+                if (buffer_is_zero(page, page_size)) {
+                    continue;
+                }
+                memcpy(samples + count * page_size, page, page_size);
+                sample_sizes[count++] = page_size;
+            }
+            /* Keep the stride going across blocks */
+            skip = offset > block->used_length ?
+                   (offset - block->used_length) / page_size : 0;
+        }
+    }
+
+    if (count < MULTIFD_ZSTD_DICT_MIN_SAMPLES) {
+        trace_multifd_zstd_dict_train_failed(count, "not enough samples");
+        goto out;
+    }
+
+    zstd_dict.buf = g_malloc(dict_size);
+    ret = ZDICT_trainFromBuffer(zstd_dict.buf, dict_size, samples,
+                                sample_sizes, count);
+    if (ZDICT_isError(ret)) {
+        trace_multifd_zstd_dict_train_failed(count, ZDICT_getErrorName(ret));
+        goto out;
+    }
+    zstd_dict.cdict = ZSTD_createCDict(zstd_dict.buf, ret,
+                                       migrate_multifd_zstd_level());
+    if (!zstd_dict.cdict) {
+        trace_multifd_zstd_dict_train_failed(count, "createCDict failed");
+        goto out;
+    }
+    zstd_dict.size = ret;
+    trace_multifd_zstd_dict_train(count, ret);
+
+out:
+    if (!zstd_dict.cdict) {
+        g_free(zstd_dict.buf);
+        zstd_dict.buf = NULL;
+        zstd_dict.size = 0;
+    }
+    g_free(sample_sizes);
+    g_free(samples);
+}
+
+static void zstd_dict_put(void)
+{
+    assert(zstd_dict.users);
+    if (--zstd_dict.users) {
+        return;
+    }
+    ZSTD_freeCDict(zstd_dict.cdict);
+    zstd_dict.cdict = NULL;
+    g_free(zstd_dict.buf);
+    zstd_dict.buf = NULL;
+    zstd_dict.size = 0;
+    zstd_dict.trained = false;
+    qemu_mutex_destroy(&zstd_dict.lock);
+}
+
 /**
  * zstd_send_setup: setup send side
  *
@@ -76,6 +210,13 @@ static int zstd_send_setup(MultiFDSendParams *p, Error **errp)
         error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
         return -1;
     }
+
+    if (migrate_multifd_zstd_dict_size()) {
+        if (!zstd_dict.users++) {
+            qemu_mutex_init(&zstd_dict.lock);
+        }
+        z->dict_user = true;
+    }
     return 0;
 }
 
@@ -95,10 +236,64 @@ static void zstd_send_cleanup(MultiFDSendParams *p, Error **errp)
     z->zcs = NULL;
     g_free(z->zbuff);
     z->zbuff = NULL;
+    if (z->dict_user) {
+        zstd_dict_put();
+    }
     g_free(p->data);
     p->data = NULL;
 }
 
+/**
+ * zstd_send_handshake: send the dictionary to the destination
+ *
+ * The first channel to get here trains the dictionary.  Every channel
+ * gets a copy, so that they can start decompressing independently of
+ * each other.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int zstd_send_handshake(MultiFDSendParams *p, Error **errp)
+{
+    struct zstd_data *z = p->data;
+    MultiFDZstdDictHdr hdr;
+    size_t res;
+
+    if (!migrate_multifd_zstd_dict_size()) {
+        return 0;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&zstd_dict.lock) {
+        if (!zstd_dict.trained) {
+            zstd_dict_train();
+            zstd_dict.trained = true;
+        }
+    }
+
+    if (zstd_dict.cdict) {
+        res = ZSTD_CCtx_refCDict(z->zcs, zstd_dict.cdict);
+        if (ZSTD_isError(res)) {
+            error_setg(errp, "multifd %u: refCDict failed with error %s",
+                       p->id, ZSTD_getErrorName(res));
+            return -1;
+        }
+    }
+
+    hdr.magic = cpu_to_be32(MULTIFD_ZSTD_DICT_MAGIC);
+    hdr.size = cpu_to_be32(zstd_dict.size);
+    if (qio_channel_write_all(p->c, (char *)&hdr, sizeof(hdr), errp) != 0) {
+        return -1;
+    }
+    if (zstd_dict.size &&
+        qio_channel_write_all(p->c, zstd_dict.buf, zstd_dict.size,
+                              errp) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * zstd_send_prepare: prepare date to be able to send
  *
@@ -114,6 +309,11 @@ static int zstd_send_prepare(MultiFDSendParams *p, Error **errp)
 {
     struct zstd_data *z = p->data;
     size_t page_size = qemu_target_page_size();
+    /*
+     * A dictionary is only applied at the start of a frame, so end one
+     * frame per packet when there is one.
+     */
+    ZSTD_EndDirective last = zstd_dict.cdict ? ZSTD_e_end : ZSTD_e_flush;
     int ret;
     uint32_t i;
 
@@ -125,7 +325,7 @@ static int zstd_send_prepare(MultiFDSendParams *p, Error **errp)
         ZSTD_EndDirective flush = ZSTD_e_continue;
 
         if (i == p->normal_num - 1) {
-            flush = ZSTD_e_flush;
+            flush = last;
         }
         z->in.src = p->pages->block->host + p->normal[i];
         z->in.size = page_size;
@@ -220,12 +420,73 @@ static void zstd_recv_cleanup(MultiFDRecvParams *p)
 
     ZSTD_freeDStream(z->zds);
     z->zds = NULL;
+    ZSTD_freeDDict(z->ddict);
+    z->ddict = NULL;
     g_free(z->zbuff);
     z->zbuff = NULL;
     g_free(p->data);
     p->data = NULL;
 }
 
+/**
+ * zstd_recv_handshake: read the dictionary sent by the source
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int zstd_recv_handshake(MultiFDRecvParams *p, Error **errp)
+{
+    struct zstd_data *z = p->data;
+    uint32_t dict_size = migrate_multifd_zstd_dict_size();
+    MultiFDZstdDictHdr hdr;
+    g_autofree void *buf = NULL;
+    size_t ret;
+
+    if (!dict_size) {
+        return 0;
+    }
+
+    if (qio_channel_read_all(p->c, (char *)&hdr, sizeof(hdr), errp) != 0) {
+        return -1;
+    }
+    hdr.magic = be32_to_cpu(hdr.magic);
+    hdr.size = be32_to_cpu(hdr.size);
+    if (hdr.magic != MULTIFD_ZSTD_DICT_MAGIC) {
+        error_setg(errp, "multifd %u: zstd dictionary magic %x expected %x",
+                   p->id, hdr.magic, MULTIFD_ZSTD_DICT_MAGIC);
+        return -1;
+    }
+    if (hdr.size > dict_size) {
+        error_setg(errp, "multifd %u: zstd dictionary size %u bigger than %u",
+                   p->id, hdr.size, dict_size);
+        return -1;
+    }
+    trace_multifd_zstd_dict_recv(p->id, hdr.size);
+    if (!hdr.size) {
+        /* Training failed on the source */
+        return 0;
+    }
+
+    buf = g_malloc(hdr.size);
+    if (qio_channel_read_all(p->c, buf, hdr.size, errp) != 0) {
+        return -1;
+    }
+    z->ddict = ZSTD_createDDict(buf, hdr.size);
+    if (!z->ddict) {
+        error_setg(errp, "multifd %u: zstd createDDict failed", p->id);
+        return -1;
+    }
+    ret = ZSTD_DCtx_refDDict(z->zds, z->ddict);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd %u: refDDict failed with error %s",
+                   p->id, ZSTD_getErrorName(ret));
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * zstd_recv_pages: read the data from the channel into actual pages
  *
@@ -264,7 +525,7 @@ static int zstd_recv_pages(MultiFDRecvParams *p, Error **errp)
     z->in.pos = 0;
 
     for (i = 0; i < p->normal_num; i++) {
-        z->out.dst = p->host + p->normal[i];
+        z->out.dst = multifd_recv_page_host(p, i);
         z->out.size = page_size;
         z->out.pos = 0;
 
@@ -304,9 +565,11 @@ static MultiFDMethods multifd_zstd_ops = {
     .send_setup = zstd_send_setup,
     .send_cleanup = zstd_send_cleanup,
     .send_prepare = zstd_send_prepare,
+    .send_handshake = zstd_send_handshake,
     .recv_setup = zstd_recv_setup,
     .recv_cleanup = zstd_recv_cleanup,
-    .recv_pages = zstd_recv_pages
+    .recv_pages = zstd_recv_pages,
+    .recv_handshake = zstd_recv_handshake
 };
 
 static void multifd_zstd_register(void)
@@ -11,6 +11,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
 #include "qemu/rcu.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
@@ -20,10 +21,12 @@
 #include "ram.h"
 #include "migration.h"
 #include "socket.h"
+#include "file.h"
 #include "tls.h"
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
+#include "postcopy-ram.h"
 
 #include "qemu/yank.h"
 #include "io/channel-socket.h"
@@ -147,7 +150,7 @@ static int nocomp_recv_pages(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
     for (int i = 0; i < p->normal_num; i++) {
-        p->iov[i].iov_base = p->host + p->normal[i];
+        p->iov[i].iov_base = multifd_recv_page_host(p, i);
         p->iov[i].iov_len = page_size;
     }
     return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
@@ -265,6 +268,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->normal_pages = cpu_to_be32(p->normal_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -276,6 +280,12 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+    for (i = 0; i < p->zero_num; i++) {
+        /* there are architectures where ram_addr_t is 32 bit */
+        uint64_t temp = p->zero[i];
+
+        packet->offset[p->normal_num + i] = cpu_to_be64(temp);
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -324,10 +334,18 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->zero_num > packet->pages_alloc - p->normal_num) {
+        error_setg(errp, "multifd: received packet "
+                   "with %u zero pages and expected maximum pages are %u",
+                   p->zero_num, packet->pages_alloc - p->normal_num) ;
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->normal_num == 0) {
+    if (p->normal_num == 0 && p->zero_num == 0) {
         return 0;
     }
 
@@ -340,6 +358,15 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    if ((p->flags & MULTIFD_FLAG_POSTCOPY) &&
+        (!migrate_postcopy_ram() ||
+         qemu_ram_pagesize(block) != qemu_target_page_size())) {
+        error_setg(errp, "multifd: unexpected postcopy packet for ram block %s",
+                   block->idstr);
+        return -1;
+    }
+
+    p->block = block;
     p->host = block->host;
     for (i = 0; i < p->normal_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
@@ -353,6 +380,18 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->normal[i] = offset;
     }
 
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num + i]);
+
+        if (offset > (block->used_length - page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, block->used_length);
+            return -1;
+        }
+        p->zero[i] = offset;
+    }
+
     return 0;
 }
 
@@ -392,13 +431,30 @@ struct {
  * false.
  */
 
+/*
+ * Account what @p sent since the last call.  Only the channel threads know
+ * which pages are zero, so the migration thread counted every queued page
+ * as a normal one and the counters are corrected here.
+ *
+ * Called with p->mutex held, while the channel has no pending job.
+ */
+static void multifd_send_account(QEMUFile *f, MultiFDSendParams *p)
+{
+    qemu_file_update_transfer(f, p->pending_bytes);
+    ram_counters.multifd_bytes += p->pending_bytes;
+    ram_counters.transferred += p->pending_bytes;
+    ram_counters.normal -= p->pending_zero_pages;
+    ram_counters.duplicate += p->pending_zero_pages;
+    p->pending_bytes = 0;
+    p->pending_zero_pages = 0;
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
 
     if (qatomic_read(&multifd_send_state->exiting)) {
         return -1;
@@ -431,13 +487,12 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->block);
 
     p->packet_num = multifd_send_state->packet_num++;
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->num) * qemu_target_page_size()
-                + p->packet_len;
-    qemu_file_update_transfer(f, transferred);
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;
+    multifd_send_account(f, p);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 
@@ -472,6 +527,25 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return 1;
 }
 
+/**
+ * multifd_flush_pages: send the pages queued so far
+ *
+ * Used during postcopy when a page requested by the destination is
+ * still waiting in a partially filled packet.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @f: QEMUFile where to account the transfer
+ */
+int multifd_flush_pages(QEMUFile *f)
+{
+    if (!migrate_use_multifd() || !multifd_send_state->pages->num) {
+        return 0;
+    }
+    trace_multifd_flush_pages(multifd_send_state->pages->num);
+    return multifd_send_pages(f) < 0 ? -1 : 0;
+}
+
 static void multifd_send_terminate_threads(Error *err)
 {
     int i;
@@ -535,7 +609,11 @@ void multifd_save_cleanup(void)
         if (p->registered_yank) {
             migration_ioc_unregister_yank(p->c);
         }
-        socket_send_channel_destroy(p->c);
+        if (migrate_mapped_ram()) {
+            file_send_channel_destroy(p->c);
+        } else {
+            socket_send_channel_destroy(p->c);
+        }
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
@@ -551,6 +629,8 @@ void multifd_save_cleanup(void)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -610,9 +690,6 @@ int multifd_send_sync_main(QEMUFile *f)
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
-        qemu_file_update_transfer(f, p->packet_len);
-        ram_counters.multifd_bytes += p->packet_len;
-        ram_counters.transferred += p->packet_len;
         qemu_mutex_unlock(&p->mutex);
         qemu_sem_post(&p->sem);
 
@@ -632,26 +709,81 @@ int multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        WITH_QEMU_LOCK_GUARD(&p->mutex) {
+            multifd_send_account(f, p);
+        }
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 
     return 0;
 }
 
+/**
+ * multifd_file_write_pages: write the pages of a job at their file offsets
+ *
+ * Used with mapped-ram instead of sending a packet.  Runs of contiguous
+ * pages are written with a single pwritev().  The file bitmap is only
+ * updated once the pages have reached the file.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @block: RAMBlock the pages belong to
+ * @errp: pointer to an error
+ */
+static int multifd_file_write_pages(MultiFDSendParams *p, RAMBlock *block,
+                                    Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    uint32_t i, start = 0;
+
+    for (i = 1; i <= p->normal_num; i++) {
+        if (i < p->normal_num &&
+            p->normal[i] == p->normal[i - 1] + page_size) {
+            continue;
+        }
+        if (qio_channel_pwritev_all(p->c, p->iov + start, i - start,
+                                    block->pages_offset + p->normal[start],
+                                    errp) < 0) {
+            return -1;
+        }
+        start = i;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        set_bit_atomic(p->normal[i] / page_size, block->file_bmap);
+    }
+    for (i = 0; i < p->zero_num; i++) {
+        clear_bit_atomic(p->zero[i] / page_size, block->file_bmap);
+    }
+
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
     Error *local_err = NULL;
     int ret = 0;
     bool use_zero_copy_send = migrate_use_zero_copy_send();
+    bool use_zero_page = migrate_use_multifd_zero_page();
+    bool use_mapped_ram = migrate_mapped_ram();
 
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
+    /* With mapped-ram there are no packets, only pages at fixed offsets */
+    if (!use_mapped_ram && multifd_send_initial_packet(p, &local_err) < 0) {
         ret = -1;
         goto out;
     }
+    if (!use_mapped_ram && multifd_send_state->ops->send_handshake) {
+        ret = multifd_send_state->ops->send_handshake(p, &local_err);
+        if (ret != 0) {
+            goto out;
+        }
+    }
     /* initial packet */
     p->num_packets = 1;
 
@@ -666,17 +798,30 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint64_t packet_num = p->packet_num;
             uint32_t flags = p->flags;
+            RAMBlock *rb = p->pages->block;
+            size_t page_size = qemu_target_page_size();
+
             p->normal_num = 0;
+            p->zero_num = 0;
+            p->next_packet_size = 0;
 
-            if (use_zero_copy_send) {
+            if (use_zero_copy_send || use_mapped_ram) {
                 p->iovs_num = 0;
             } else {
                 p->iovs_num = 1;
             }
 
             for (int i = 0; i < p->pages->num; i++) {
-                p->normal[p->normal_num] = p->pages->offset[i];
-                p->normal_num++;
+                ram_addr_t offset = p->pages->offset[i];
+
+                if (use_zero_page &&
+                    buffer_is_zero(rb->host + offset, page_size)) {
+                    p->zero[p->zero_num] = offset;
+                    p->zero_num++;
+                } else {
+                    p->normal[p->normal_num] = offset;
+                    p->normal_num++;
+                }
             }
 
             if (p->normal_num) {
@@ -686,34 +831,51 @@ static void *multifd_send_thread(void *opaque)
                     break;
                 }
             }
-            multifd_send_fill_packet(p);
+            if (!use_mapped_ram) {
+                multifd_send_fill_packet(p);
+            }
             p->flags = 0;
             p->num_packets++;
             p->total_normal_pages += p->normal_num;
+            p->total_zero_pages += p->zero_num;
+            p->pending_zero_pages += p->zero_num;
+            /* Zero pages only take space in the packet header */
+            p->pending_bytes += p->next_packet_size;
+            if (!use_mapped_ram) {
+                p->pending_bytes += p->packet_len;
+            }
             p->pages->num = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, p->normal_num, flags,
-                               p->next_packet_size);
+            trace_multifd_send(p->id, packet_num, p->normal_num, p->zero_num,
+                               flags, p->next_packet_size);
 
-            if (use_zero_copy_send) {
-                /* Send header first, without zerocopy */
-                ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                            p->packet_len, &local_err);
+            if (use_mapped_ram) {
+                ret = multifd_file_write_pages(p, rb, &local_err);
                 if (ret != 0) {
                     break;
                 }
             } else {
-                /* Send header using the same writev call */
-                p->iov[0].iov_len = p->packet_len;
-                p->iov[0].iov_base = p->packet;
-            }
+                if (use_zero_copy_send) {
+                    /* Send header first, without zerocopy */
+                    ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                                p->packet_len, &local_err);
+                    if (ret != 0) {
+                        break;
+                    }
+                } else {
+                    /* Send header using the same writev call */
+                    p->iov[0].iov_len = p->packet_len;
+                    p->iov[0].iov_base = p->packet;
+                }
 
-            ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num, NULL,
-                                              0, p->write_flags, &local_err);
-            if (ret != 0) {
-                break;
+                ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num,
+                                                  NULL, 0, p->write_flags,
+                                                  &local_err);
+                if (ret != 0) {
+                    break;
+                }
             }
 
             qemu_mutex_lock(&p->mutex);
@@ -754,7 +916,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -898,6 +1061,27 @@ cleanup:
     multifd_new_send_channel_cleanup(p, sioc, local_err);
 }
 
+static void multifd_new_send_channel_create(MultiFDSendParams *p)
+{
+    Error *local_err = NULL;
+    QIOChannel *ioc;
+
+    if (!migrate_mapped_ram()) {
+        socket_send_channel_create(multifd_new_send_channel_async, p);
+        return;
+    }
+
+    /* Files can be opened right away, there is nothing to wait for */
+    trace_multifd_new_send_channel_async(p->id);
+    ioc = file_send_channel_create(&local_err);
+    if (!ioc) {
+        multifd_new_send_channel_cleanup(p, NULL, local_err);
+        return;
+    }
+    p->running = true;
+    multifd_channel_connect(p, ioc, NULL);
+}
+
 int multifd_save_setup(Error **errp)
 {
     int thread_count;
@@ -930,15 +1114,18 @@ int multifd_save_setup(Error **errp)
         p->pending_job = 0;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
-        p->packet = g_malloc0(p->packet_len);
-        p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-        p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+        if (!migrate_mapped_ram()) {
+            p->packet_len = sizeof(MultiFDPacket_t)
+                          + sizeof(uint64_t) * page_count;
+            p->packet = g_malloc0(p->packet_len);
+            p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+            p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+        }
         p->name = g_strdup_printf("multifdsend_%d", i);
         /* We need one extra place for the packet header */
         p->iov = g_new0(struct iovec, page_count + 1);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
 
         if (migrate_use_zero_copy_send()) {
             p->write_flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
@@ -946,7 +1133,7 @@ int multifd_save_setup(Error **errp)
             p->write_flags = 0;
         }
 
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        multifd_new_send_channel_create(p);
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -969,6 +1156,10 @@ struct {
     int count;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* recv channels ready for more work (mapped-ram) */
+    QemuSemaphore channels_ready;
+    /* set once userfaultfd is registered and pages can be placed */
+    QemuEvent postcopy_listen;
     /* global number of generated multifd packets */
     uint64_t packet_num;
     /* multifd ops */
@@ -1006,7 +1197,11 @@ static void multifd_recv_terminate_threads(Error *err)
             qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         }
         qemu_mutex_unlock(&p->mutex);
+        /* mapped-ram channels may be waiting for a range to load */
+        qemu_sem_post(&p->sem);
     }
+    /* Channels may be waiting to place postcopy pages */
+    qemu_event_set(&multifd_recv_state->postcopy_listen);
 }
 
 int multifd_load_cleanup(Error **errp)
@@ -1027,6 +1222,7 @@ int multifd_load_cleanup(Error **errp)
              * however try to wakeup it without harm in cleanup phase.
              */
             qemu_sem_post(&p->sem_sync);
+            qemu_sem_post(&p->sem);
             qemu_thread_join(&p->thread);
         }
     }
@@ -1038,6 +1234,7 @@ int multifd_load_cleanup(Error **errp)
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem_sync);
+        qemu_sem_destroy(&p->sem);
         g_free(p->name);
         p->name = NULL;
         p->packet_len = 0;
@@ -1047,9 +1244,15 @@ int multifd_load_cleanup(Error **errp)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_sem_destroy(&multifd_recv_state->channels_ready);
+    qemu_event_destroy(&multifd_recv_state->postcopy_listen);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -1062,7 +1265,8 @@ void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    /* mapped-ram channels are synced with multifd_recv_sync_file() */
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -1085,6 +1289,186 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_queue_file_range: load a range of a mapped-ram file
+ *
+ * Hands the range over to the first idle channel, waiting for one to
+ * become available if needed.  Use multifd_recv_sync_file() to wait for
+ * all queued ranges to be loaded.
+ *
+ * Returns 0 for success or -1 if the channels have failed
+ *
+ * @host: where to store the data
+ * @offset: file offset of the data
+ * @size: size of the range
+ */
+int multifd_recv_queue_file_range(void *host, off_t offset, size_t size)
+{
+    static int next_channel;
+    MultiFDRecvParams *p;
+    int i;
+
+    qemu_sem_wait(&multifd_recv_state->channels_ready);
+
+    next_channel %= migrate_multifd_channels();
+    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
+        p = &multifd_recv_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            error_report("%s: channel %d has already quit!", __func__, i);
+            qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        if (!p->pending_job) {
+            p->pending_job = true;
+            p->file_host = host;
+            p->file_offset = offset;
+            p->file_size = size;
+            next_channel = (i + 1) % migrate_multifd_channels();
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    qemu_sem_post(&p->sem);
+    return 0;
+}
+
+/**
+ * multifd_recv_sync_file: wait for all queued mapped-ram ranges
+ *
+ * Returns 0 for success or -1 if any channel has failed
+ */
+int multifd_recv_sync_file(void)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_wait(&multifd_recv_state->channels_ready);
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        WITH_QEMU_LOCK_GUARD(&p->mutex) {
+            if (p->quit) {
+                ret = -1;
+            }
+        }
+        qemu_sem_post(&multifd_recv_state->channels_ready);
+    }
+
+    return ret;
+}
+
+/*
+ * With mapped-ram the channels don't receive packets, they read the
+ * ranges of the file queued by the migration thread.
+ */
+static int multifd_recv_file_pages(MultiFDRecvParams *p, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+
+    while (true) {
+        void *host;
+        off_t offset;
+        size_t size;
+
+        qemu_sem_post(&multifd_recv_state->channels_ready);
+        qemu_sem_wait(&p->sem);
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            return 0;
+        }
+        host = p->file_host;
+        offset = p->file_offset;
+        size = p->file_size;
+        qemu_mutex_unlock(&p->mutex);
+
+        if (qio_channel_pread_all(p->c, host, size, offset, errp) < 0) {
+            return -1;
+        }
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending_job = false;
+        p->num_packets++;
+        p->total_normal_pages += size / page_size;
+        qemu_mutex_unlock(&p->mutex);
+    }
+}
+
+/**
+ * multifd_recv_page_host: where to store a received page
+ *
+ * Pages sent during postcopy can't be written in place, they are
+ * staged and placed atomically once they are complete.
+ *
+ * @p: Params for the channel that we are using
+ * @i: index of the page in the normal array
+ */
+void *multifd_recv_page_host(MultiFDRecvParams *p, uint32_t i)
+{
+    if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+        return p->postcopy_buf + i * qemu_target_page_size();
+    }
+    return p->host + p->normal[i];
+}
+
+/**
+ * multifd_recv_postcopy_listen: allow channels to place pages
+ *
+ * Called once userfaultfd has been registered on the destination.
+ */
+void multifd_recv_postcopy_listen(void)
+{
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    qemu_event_set(&multifd_recv_state->postcopy_listen);
+}
+
+static int multifd_recv_place_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    size_t page_size = qemu_target_page_size();
+    int ret;
+
+    /* Pages can't be placed before userfaultfd is registered */
+    qemu_event_wait(&multifd_recv_state->postcopy_listen);
+    WITH_QEMU_LOCK_GUARD(&p->mutex) {
+        /* Woken up by multifd_recv_terminate_threads() */
+        if (p->quit) {
+            return 0;
+        }
+    }
+
+    trace_multifd_recv_place_pages(p->id, p->block->idstr, p->normal_num,
+                                   p->zero_num);
+
+    for (int i = 0; i < p->normal_num; i++) {
+        ret = postcopy_place_page(mis, p->host + p->normal[i],
+                                  p->postcopy_buf + i * page_size, p->block);
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd %u: failed to place page "
+                             "at offset " RAM_ADDR_FMT, p->id, p->normal[i]);
+            return -1;
+        }
+    }
+    for (int i = 0; i < p->zero_num; i++) {
+        ret = postcopy_place_page_zero(mis, p->host + p->zero[i], p->block);
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd %u: failed to place zero "
+                             "page at offset " RAM_ADDR_FMT, p->id,
+                             p->zero[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1094,6 +1478,18 @@ static void *multifd_recv_thread(void *opaque)
     trace_multifd_recv_thread_start(p->id);
     rcu_register_thread();
 
+    if (migrate_mapped_ram()) {
+        ret = multifd_recv_file_pages(p, &local_err);
+        goto out;
+    }
+
+    if (multifd_recv_state->ops->recv_handshake) {
+        ret = multifd_recv_state->ops->recv_handshake(p, &local_err);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+
     while (true) {
         uint32_t flags;
 
@@ -1120,10 +1516,11 @@ static void *multifd_recv_thread(void *opaque)
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, p->normal_num, flags,
-                           p->next_packet_size);
+        trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
+                           flags, p->next_packet_size);
         p->num_packets++;
         p->total_normal_pages += p->normal_num;
+        p->total_zero_pages += p->zero_num;
         qemu_mutex_unlock(&p->mutex);
 
         if (p->normal_num) {
@@ -1133,22 +1530,40 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (flags & MULTIFD_FLAG_POSTCOPY) {
+            ret = multifd_recv_place_pages(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        } else {
+            for (int i = 0; i < p->zero_num; i++) {
+                ram_handle_compressed(p->host + p->zero[i], 0,
+                                      qemu_target_page_size());
+            }
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
         }
     }
 
+out:
     if (local_err) {
         multifd_recv_terminate_threads(local_err);
         error_free(local_err);
     }
+    if (migrate_mapped_ram() && ret != 0) {
+        /* Don't leave the migration thread waiting for this channel */
+        qemu_sem_post(&multifd_recv_state->channels_ready);
+    }
     qemu_mutex_lock(&p->mutex);
     p->running = false;
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -1171,6 +1586,8 @@ int multifd_load_setup(Error **errp)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     qatomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_sem_init(&multifd_recv_state->channels_ready, 0);
+    qemu_event_init(&multifd_recv_state->postcopy_listen, false);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
@@ -1178,14 +1595,22 @@ int multifd_load_setup(Error **errp)
 
         qemu_mutex_init(&p->mutex);
         qemu_sem_init(&p->sem_sync, 0);
+        qemu_sem_init(&p->sem, 0);
         p->quit = false;
+        p->pending_job = false;
         p->id = i;
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
-        p->packet = g_malloc0(p->packet_len);
+        if (!migrate_mapped_ram()) {
+            p->packet_len = sizeof(MultiFDPacket_t)
+                          + sizeof(uint64_t) * page_count;
+            p->packet = g_malloc0(p->packet_len);
+        }
         p->name = g_strdup_printf("multifdrecv_%d", i);
         p->iov = g_new0(struct iovec, page_count);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
+        if (migrate_postcopy_ram()) {
+            p->postcopy_buf = g_malloc(page_count * qemu_target_page_size());
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -1230,7 +1655,12 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
     Error *local_err = NULL;
     int id;
 
-    id = multifd_recv_initial_packet(ioc, &local_err);
+    if (migrate_mapped_ram()) {
+        /* Files have no handshake, channels are opened in order */
+        id = qatomic_read(&multifd_recv_state->count);
+    } else {
+        id = multifd_recv_initial_packet(ioc, &local_err);
+    }
     if (id < 0) {
         multifd_recv_terminate_threads(local_err);
         error_propagate_prepend(errp, local_err,
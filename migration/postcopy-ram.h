@@ -183,4 +183,15 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/*
+ * Postcopy preempt channel: a dedicated channel on which the source sends
+ * the pages requested by the destination during postcopy.
+ */
+/* Returns true if the incoming migration can be started */
+bool postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+/* Asynchronously connects the preempt channel, if the capability is set */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+/* Returns 0 once the preempt channel is connected, -1 if that failed */
+int postcopy_preempt_wait_channel(MigrationState *s);
+
 #endif
@@ -867,3 +867,131 @@ QIOChannel *qemu_file_get_ioc(QEMUFile *file)
 {
     return file->has_ioc ? QIO_CHANNEL(file->opaque) : NULL;
 }
+
+/*
+ * Get the position of the underlying channel that corresponds to the
+ * current position of the stream, i.e. where the next byte will be
+ * written to or read from.  Only valid for seekable channels.
+ *
+ * Returns the offset, or -1 on error (and sets the file error).
+ */
+off_t qemu_get_offset(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_error = NULL;
+    off_t offset;
+
+    if (!ioc) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -1;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+        if (qemu_file_get_error(f)) {
+            return -1;
+        }
+    }
+
+    offset = qio_channel_io_seek(ioc, 0, SEEK_CUR, &local_error);
+    if (offset < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return -1;
+    }
+
+    /* Discount what has been read ahead but not consumed yet */
+    return offset - (f->buf_size - f->buf_index);
+}
+
+/*
+ * Move the position of the underlying channel to @offset, so that the
+ * stream continues from there.  Any read-ahead data is dropped.  The
+ * stream position as reported by qemu_ftell() is not affected.
+ */
+void qemu_set_offset(QEMUFile *f, off_t offset)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_error = NULL;
+
+    if (!ioc) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+        if (qemu_file_get_error(f)) {
+            return;
+        }
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    if (qio_channel_io_seek(ioc, offset, SEEK_SET, &local_error) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+    }
+}
+
+/*
+ * Write @buflen bytes from @buf at @pos in the underlying channel,
+ * bypassing the stream buffer.  Only valid for seekable channels.
+ */
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t buflen,
+                        off_t pos)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_error = NULL;
+
+    if (f->last_error) {
+        return;
+    }
+
+    if (!ioc) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+
+    if (qio_channel_pwrite_all(ioc, (const char *)buf, buflen, pos,
+                               &local_error) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return;
+    }
+
+    /*
+     * The data is part of the migration all the same, so account for it
+     * in the stream position used for bandwidth calculations.
+     */
+    f->pos += buflen;
+    qemu_file_update_transfer(f, buflen);
+}
+
+/*
+ * Read @buflen bytes at @pos in the underlying channel into @buf,
+ * bypassing the stream buffer.  Only valid for seekable channels.
+ *
+ * Returns the number of bytes read, i.e. @buflen or 0 on error.
+ */
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t buflen,
+                          off_t pos)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_error = NULL;
+
+    if (f->last_error) {
+        return 0;
+    }
+
+    if (!ioc) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return 0;
+    }
+
+    if (qio_channel_pread_all(ioc, (char *)buf, buflen, pos,
+                              &local_error) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return 0;
+    }
+
+    return buflen;
+}
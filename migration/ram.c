@@ -31,6 +31,7 @@
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
+#include "qemu/units.h"
 #include "qemu/main-loop.h"
 #include "xbzrle.h"
 #include "ram.h"
@@ -82,6 +83,28 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/*
+ * mapped-ram: each RAMBlock description in the stream is followed by
+ * this header.  The pages of the block live at fixed offsets starting
+ * at pages_offset in the file, and the bitmap of pages present in the
+ * file is written at bitmap_offset once migration completes.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+/* Align the pages so that they can be accessed with O_DIRECT */
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT 0x100000
+/* Largest chunk of pages read at once when loading */
+#define MAPPED_RAM_LOAD_BUF_SIZE 0x100000
+
+typedef struct {
+    uint32_t version;
+    /* target page size, i.e. what each bit of the bitmap covers */
+    uint64_t page_size;
+    /* file offset of the bitmap of pages present in the file */
+    uint64_t bitmap_offset;
+    /* file offset of the first page of the RAMBlock */
+    uint64_t pages_offset;
+} QEMU_PACKED MappedRamHeader;
+
 XBZRLECacheStats xbzrle_counters;
 
 /* struct contains XBZRLE cache and a static page
@@ -296,9 +319,59 @@ struct RAMSrcPageRequest {
 };
 
 /* State of RAM for migration */
+/*
+ * Where the migration thread was when a postcopy request preempted the
+ * sending of a huge page on the precopy channel
+ */
+struct PostcopyPreemptState {
+    /* Whether we're preempted */
+    bool preempted;
+    /* The RAMBlock and page that was preempted */
+    RAMBlock *ram_block;
+    unsigned long ram_page;
+};
+typedef struct PostcopyPreemptState PostcopyPreemptState;
+
+/* RAM is synced in chunks of this size when there are dirty sync threads */
+#define DIRTY_SYNC_CHUNK_SIZE (1 * GiB)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} DirtySyncChunk;
+
+/*
+ * Helper threads for migration_bitmap_sync().  Chunks are word aligned in
+ * the dirty bitmaps, so they can be synced concurrently.
+ */
+typedef struct {
+    QemuThread *threads;
+    int nr_threads;
+    QemuMutex lock;
+    /* signalled when a sync starts, or when the threads need to quit */
+    QemuCond work_cond;
+    /* signalled when all the chunks of the sync are done */
+    QemuCond done_cond;
+    /* chunks of the current sync, NULL when idle */
+    GArray *chunks;
+    guint next_chunk;
+    guint done_chunks;
+    uint64_t new_dirty_pages;
+    bool quit;
+} DirtySyncThreads;
+
 struct RAMState {
     /* QEMUFile used for this migration */
     QEMUFile *f;
+    /*
+     * Which channel @f points to during postcopy preempt: either the
+     * main migration stream (RAM_CHANNEL_PRECOPY) or the preempt channel
+     * (RAM_CHANNEL_POSTCOPY)
+     */
+    unsigned int postcopy_channel;
+    /* Postcopy preemption information */
+    PostcopyPreemptState postcopy_preempt_state;
     /* UFFD file descriptor, used in 'write-tracking' migration */
     int uffdio_fd;
     /* Last block that we have visited searching for dirty pages */
@@ -344,6 +417,8 @@ struct RAMState {
     uint64_t migration_dirty_pages;
     /* Protects modification of the bitmap and migration dirty pages */
     QemuMutex bitmap_mutex;
+    /* Created on the first sync that has more than one chunk */
+    DirtySyncThreads *sync_threads;
     /* The RAMBlock used in the last src_page_requests */
     RAMBlock *last_req_rb;
     /* Queue of outstanding page requests from the destination */
@@ -416,6 +491,8 @@ struct PageSearchStatus {
     bool         complete_round;
     /* Whether current page is explicitly requested by postcopy */
     bool         postcopy_requested;
+    /* Which channel the page should be sent on with postcopy preempt */
+    unsigned int postcopy_target_channel;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -1005,6 +1082,158 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * Sync the next chunk of the current sync, if any is left.
+ * Called with t->lock held, which is dropped while syncing.
+ */
+static bool dirty_sync_run_one(DirtySyncThreads *t)
+{
+    DirtySyncChunk *c;
+    uint64_t new_dirty_pages = 0;
+
+    if (!t->chunks || t->next_chunk >= t->chunks->len) {
+        return false;
+    }
+    c = &g_array_index(t->chunks, DirtySyncChunk, t->next_chunk++);
+    qemu_mutex_unlock(&t->lock);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        new_dirty_pages = cpu_physical_memory_sync_dirty_bitmap(c->block,
+                                                                c->start,
+                                                                c->length);
+    }
+    trace_migration_bitmap_sync_chunk(c->block->idstr, c->start, c->length,
+                                      new_dirty_pages);
+
+    qemu_mutex_lock(&t->lock);
+    t->new_dirty_pages += new_dirty_pages;
+    if (++t->done_chunks == t->chunks->len) {
+        qemu_cond_signal(&t->done_cond);
+    }
+    return true;
+}
+
+static void *dirty_sync_thread(void *opaque)
+{
+    DirtySyncThreads *t = opaque;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&t->lock);
+    while (!t->quit) {
+        if (!dirty_sync_run_one(t)) {
+            qemu_cond_wait(&t->work_cond, &t->lock);
+        }
+    }
+    qemu_mutex_unlock(&t->lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static DirtySyncThreads *dirty_sync_threads_create(int nr_threads)
+{
+    DirtySyncThreads *t = g_new0(DirtySyncThreads, 1);
+    int i;
+
+    qemu_mutex_init(&t->lock);
+    qemu_cond_init(&t->work_cond);
+    qemu_cond_init(&t->done_cond);
+    t->nr_threads = nr_threads;
+    t->threads = g_new0(QemuThread, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(t->threads + i, "mig/dirty-sync",
+                           dirty_sync_thread, t, QEMU_THREAD_JOINABLE);
+    }
+    return t;
+}
+
+static void dirty_sync_threads_destroy(DirtySyncThreads *t)
+{
+    int i;
+
+    qemu_mutex_lock(&t->lock);
+    t->quit = true;
+    qemu_cond_broadcast(&t->work_cond);
+    qemu_mutex_unlock(&t->lock);
+
+    for (i = 0; i < t->nr_threads; i++) {
+        qemu_thread_join(t->threads + i);
+    }
+    g_free(t->threads);
+    qemu_cond_destroy(&t->done_cond);
+    qemu_cond_destroy(&t->work_cond);
+    qemu_mutex_destroy(&t->lock);
+    g_free(t);
+}
+
+/*
+ * Sync the dirty bitmap of all RAMBlocks.  Big guests are split in
+ * chunks that the sync threads and the caller work on in parallel.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ */
+static void ramblock_sync_dirty_bitmaps(RAMState *rs)
+{
+    int nr_threads = migrate_dirty_sync_threads();
+    DirtySyncThreads *t;
+    GArray *chunks;
+    RAMBlock *block;
+    uint64_t new_dirty_pages;
+
+    chunks = g_array_new(false, false, sizeof(DirtySyncChunk));
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length;
+             start += DIRTY_SYNC_CHUNK_SIZE) {
+            DirtySyncChunk c = {
+                .block = block,
+                .start = start,
+                .length = MIN(DIRTY_SYNC_CHUNK_SIZE,
+                              block->used_length - start),
+            };
+            g_array_append_val(chunks, c);
+        }
+    }
+
+    if (nr_threads <= 1 || chunks->len <= 1) {
+        g_array_free(chunks, true);
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+        return;
+    }
+
+    if (!rs->sync_threads) {
+        /* The caller is one of the threads */
+        rs->sync_threads = dirty_sync_threads_create(nr_threads - 1);
+    }
+    t = rs->sync_threads;
+
+    qemu_mutex_lock(&t->lock);
+    t->chunks = chunks;
+    t->next_chunk = 0;
+    t->done_chunks = 0;
+    t->new_dirty_pages = 0;
+    qemu_cond_broadcast(&t->work_cond);
+
+    while (dirty_sync_run_one(t)) {
+        /* nothing */
+    }
+    while (t->done_chunks < chunks->len) {
+        qemu_cond_wait(&t->done_cond, &t->lock);
+    }
+    new_dirty_pages = t->new_dirty_pages;
+    t->chunks = NULL;
+    qemu_mutex_unlock(&t->lock);
+
+    g_array_free(chunks, true);
+
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1115,7 +1344,7 @@ static void migration_trigger_throttle(RAMState *rs)
 
 static void migration_bitmap_sync(RAMState *rs)
 {
-    RAMBlock *block;
+    int64_t start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int64_t end_time;
 
     ram_counters.dirty_sync_count++;
@@ -1129,9 +1358,7 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
-        }
+        ramblock_sync_dirty_bitmaps(rs);
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
@@ -1139,6 +1366,10 @@ static void migration_bitmap_sync(RAMState *rs)
     memory_global_after_dirty_log_sync();
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
 
+    ram_counters.dirty_sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   start_us;
+    ram_counters.dirty_sync_time_total += ram_counters.dirty_sync_time;
+
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
@@ -1225,7 +1456,22 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
  */
 static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    int len;
+
+    if (migrate_mapped_ram()) {
+        if (!buffer_is_zero(block->host + offset, TARGET_PAGE_SIZE)) {
+            return -1;
+        }
+        /*
+         * Zero pages are not written to the file, the destination
+         * memory is already zeroed.  Drop any previous copy instead.
+         */
+        clear_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    len = save_zero_page_to_file(rs, rs->f, block, offset);
 
     if (len) {
         ram_counters.duplicate++;
@@ -1287,14 +1533,20 @@ static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
 static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
                             uint8_t *buf, bool async)
 {
-    ram_transferred_add(save_page_header(rs, rs->f, block,
-                                         offset | RAM_SAVE_FLAG_PAGE));
-    if (async) {
-        qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
-                              migrate_release_ram() &&
-                              migration_in_postcopy());
+    if (migrate_mapped_ram()) {
+        qemu_put_buffer_at(rs->f, buf, TARGET_PAGE_SIZE,
+                           block->pages_offset + offset);
+        set_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
     } else {
-        qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+        ram_transferred_add(save_page_header(rs, rs->f, block,
+                                             offset | RAM_SAVE_FLAG_PAGE));
+        if (async) {
+            qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
+                                  migrate_release_ram() &&
+                                  migration_in_postcopy());
+        } else {
+            qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+        }
     }
     ram_transferred_add(TARGET_PAGE_SIZE);
     ram_counters.normal++;
@@ -1491,6 +1743,7 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
 {
     /* This is not a postcopy requested page */
     pss->postcopy_requested = false;
+    pss->postcopy_target_channel = RAM_CHANNEL_PRECOPY;
 
     pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
     if (pss->complete_round && pss->block == rs->last_seen_block &&
@@ -1947,6 +2200,191 @@ void ram_write_tracking_stop(void)
 }
 #endif /* defined(__linux__) */
 
+static void postcopy_preempt_reset(RAMState *rs)
+{
+    memset(&rs->postcopy_preempt_state, 0, sizeof(PostcopyPreemptState));
+}
+
+/*
+ * Check whether two addr/offset of the ramblock falls onto the same host huge
+ * page.  Returns true if so, false otherwise.
+ */
+static bool offset_on_same_huge_page(RAMBlock *rb, uint64_t addr1,
+                                     uint64_t addr2)
+{
+    size_t page_size = qemu_ram_pagesize(rb);
+
+    addr1 = ROUND_DOWN(addr1, page_size);
+    addr2 = ROUND_DOWN(addr2, page_size);
+
+    return addr1 == addr2;
+}
+
+/*
+ * Whether a previous preempted precopy huge page contains current requested
+ * page?  Returns true if so, false otherwise.
+ *
+ * This should really happen very rarely, because it means when we were sending
+ * during background migration for postcopy we're sending exactly the page that
+ * some vcpu got faulted on on dest node.  When it happens, we probably don't
+ * need to do much but drop the request, because we know right after we restore
+ * the precopy stream it'll be serviced.  It'll slightly affect the order of
+ * postcopy requests to be serviced (e.g. it'll be the same as we move current
+ * request to the end of the queue) but it shouldn't be a big deal.  The most
+ * important thing is we can _never_ try to send a partial-sent huge page on the
+ * POSTCOPY channel again, otherwise that huge page will got "split brain" on
+ * two channels (PRECOPY, POSTCOPY).
+ */
+static bool postcopy_preempted_contains(RAMState *rs, RAMBlock *block,
+                                        ram_addr_t offset)
+{
+    PostcopyPreemptState *state = &rs->postcopy_preempt_state;
+
+    /* No preemption at all? */
+    if (!state->preempted) {
+        return false;
+    }
+
+    /* Not even the same ramblock? */
+    if (state->ram_block != block) {
+        return false;
+    }
+
+    return offset_on_same_huge_page(block, offset,
+                                    state->ram_page << TARGET_PAGE_BITS);
+}
+
+/* Returns true if we need to preempt the sending of a precopy huge page */
+static bool postcopy_needs_preempt(RAMState *rs, PageSearchStatus *pss)
+{
+    /* Not enabled eager preempt?  Then never do that. */
+    if (!migrate_postcopy_preempt()) {
+        return false;
+    }
+
+    /* If the ramblock we're sending is a small page?  Never bother. */
+    if (qemu_ram_pagesize(pss->block) == TARGET_PAGE_SIZE) {
+        return false;
+    }
+
+    /* Not in postcopy at all? */
+    if (!migration_in_postcopy()) {
+        return false;
+    }
+
+    /*
+     * If we're already handling a postcopy request, don't preempt as this page
+     * has got the same high priority.
+     */
+    if (pss->postcopy_requested) {
+        return false;
+    }
+
+    /* If there's postcopy requests, then check it up! */
+    return postcopy_has_request(rs);
+}
+
+/* Remember where we stopped so that we can resume the huge page later */
+static void postcopy_do_preempt(RAMState *rs, PageSearchStatus *pss)
+{
+    PostcopyPreemptState *p_state = &rs->postcopy_preempt_state;
+
+    trace_postcopy_preempt_triggered(pss->block->idstr, pss->page);
+
+    /*
+     * Time to preempt precopy. Cache current PSS into preempt state, so that
+     * after handling the postcopy pages we can recover to it.  We need to do
+     * so because the dest VM will have partial of the precopy huge page kept
+     * over in its tmp huge page caches; better move on with it when we can.
+     */
+    p_state->ram_block = pss->block;
+    p_state->ram_page = pss->page;
+    p_state->preempted = true;
+}
+
+/* Whether we're preempted by a postcopy request during sending a huge page */
+static bool postcopy_preempt_triggered(RAMState *rs)
+{
+    return rs->postcopy_preempt_state.preempted;
+}
+
+static void postcopy_preempt_restore(RAMState *rs, PageSearchStatus *pss,
+                                     bool postcopy_requested)
+{
+    PostcopyPreemptState *state = &rs->postcopy_preempt_state;
+
+    assert(state->preempted);
+
+    pss->block = state->ram_block;
+    pss->page = state->ram_page;
+
+    /* Whether this is a postcopy request? */
+    pss->postcopy_requested = postcopy_requested;
+    /*
+     * When restoring a preempted page, the old data resides in PRECOPY
+     * slow channel, even if postcopy_requested is set.  So always use
+     * PRECOPY channel here.
+     */
+    pss->postcopy_target_channel = RAM_CHANNEL_PRECOPY;
+
+    trace_postcopy_preempt_restored(pss->block->idstr, pss->page);
+
+    /* Reset preempt state, most importantly, set preempted==false */
+    postcopy_preempt_reset(rs);
+}
+
+static void postcopy_preempt_choose_channel(RAMState *rs, PageSearchStatus *pss)
+{
+    MigrationState *s = migrate_get_current();
+    unsigned int channel = pss->postcopy_target_channel;
+    QEMUFile *next;
+
+    if (channel != rs->postcopy_channel) {
+        if (channel == RAM_CHANNEL_PRECOPY) {
+            next = s->to_dst_file;
+        } else {
+            next = s->postcopy_qemufile_src;
+        }
+        /* Update and cache the current channel */
+        rs->f = next;
+        rs->postcopy_channel = channel;
+
+        /*
+         * If channel switched, reset last_sent_block since the old sent block
+         * may not be on the same channel.
+         */
+        rs->last_sent_block = NULL;
+
+        trace_postcopy_preempt_switch_channel(channel);
+    }
+
+    trace_postcopy_preempt_send_host_page(pss->block->idstr, pss->page);
+}
+
+/* We need to make sure rs->f always points to the default channel elsewhere */
+static void postcopy_preempt_reset_channel(RAMState *rs)
+{
+    if (migrate_postcopy_preempt() && migration_in_postcopy()) {
+        rs->postcopy_channel = RAM_CHANNEL_PRECOPY;
+        rs->f = migrate_get_current()->to_dst_file;
+        trace_postcopy_preempt_reset_channel();
+    }
+}
+
+/**
+ * ram_postcopy_preempt_shutdown: terminate the postcopy preempt channel
+ *
+ * Sends RAM_SAVE_FLAG_EOS on the preempt channel, which makes the preempt
+ * thread on the destination quit.
+ *
+ * @s: current migration state
+ */
+void ram_postcopy_preempt_shutdown(MigrationState *s)
+{
+    qemu_put_be64(s->postcopy_qemufile_src, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(s->postcopy_qemufile_src);
+}
+
 /**
  * get_queued_page: unqueue a page from the postcopy requests
  *
@@ -1964,7 +2402,20 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     block = unqueue_page(rs, &offset);
 
-    if (!block) {
+    if (block) {
+        /* See comment above postcopy_preempted_contains() */
+        if (postcopy_preempted_contains(rs, block, offset)) {
+            trace_postcopy_preempt_hit(block->idstr, offset);
+            /*
+             * If what we preempted previously was exactly what we're
+             * requesting right now, restore the preempted precopy
+             * immediately, boosting its priority as it's requested by
+             * postcopy.
+             */
+            postcopy_preempt_restore(rs, pss, true);
+            return true;
+        }
+    } else {
         /*
          * Poll write faults too if background snapshot is enabled; that's
          * when we have vcpus got blocked by the write protected pages.
@@ -1987,6 +2438,8 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
          */
         pss->complete_round = false;
         pss->postcopy_requested = true;
+        /* Requested pages go on the preempt channel if there is one */
+        pss->postcopy_target_channel = RAM_CHANNEL_POSTCOPY;
     }
 
     return !!block;
@@ -2131,6 +2584,22 @@ static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return false;
 }
 
+/**
+ * postcopy_can_use_multifd: whether a postcopy page can go over multifd
+ *
+ * The destination places multifd pages one target page at a time, so
+ * only blocks backed by target sized pages qualify.  Pages requested by
+ * the destination stay on the main channel so they are not queued
+ * behind background pages.
+ *
+ * @pss: data about the page we want to send
+ */
+static bool postcopy_can_use_multifd(PageSearchStatus *pss)
+{
+    return migrate_use_multifd_postcopy() && !pss->postcopy_requested &&
+           qemu_ram_pagesize(pss->block) == TARGET_PAGE_SIZE;
+}
+
 /**
  * ram_save_target_page: save one target page
  *
@@ -2143,6 +2612,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    bool use_multifd;
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -2153,6 +2623,24 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
         return 1;
     }
 
+    /*
+     * Do not use multifd for:
+     * 1. Compression as the first page in the new block should be posted out
+     *    before sending the compressed page
+     * 2. In postcopy, unless postcopy_can_use_multifd() allows it
+     */
+    use_multifd = !save_page_use_compression(rs) && migrate_use_multifd()
+                  && (!migration_in_postcopy() ||
+                      postcopy_can_use_multifd(pss));
+
+    /*
+     * When the multifd channels detect zero pages themselves, leave the
+     * scanning to them so that it scales with the number of channels.
+     */
+    if (use_multifd && migrate_use_multifd_zero_page()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2166,14 +2654,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -2211,7 +2692,16 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss)
         return 0;
     }
 
+    if (migrate_postcopy_preempt() && migration_in_postcopy()) {
+        postcopy_preempt_choose_channel(rs, pss);
+    }
+
     do {
+        if (postcopy_needs_preempt(rs, pss)) {
+            postcopy_do_preempt(rs, pss);
+            break;
+        }
+
         /* Check the pages is dirty and if it is send it */
         if (migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
             tmppages = ram_save_target_page(rs, pss);
@@ -2235,6 +2725,32 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss)
     /* The offset we leave with is the min boundary of host page and block */
     pss->page = MIN(pss->page, hostpage_boundary);
 
+    /*
+     * When with postcopy preempt mode, flush the data as soon as possible for
+     * postcopy requests, because we've already sent a whole huge page, so the
+     * dst node should already have enough resource to atomically filling in
+     * the current missing page.
+     *
+     * More importantly, when using separate postcopy channel, we must do
+     * explicit flush or it won't flush until the buffer is full.
+     */
+    if (migrate_postcopy_preempt() && pss->postcopy_requested) {
+        qemu_fflush(rs->f);
+    }
+
+    /*
+     * A requested page that was already clean may still be sitting in a
+     * partially filled multifd packet, push it out so the faulting vcpu
+     * doesn't wait for the packet to fill up.
+     */
+    if (!pages && pss->postcopy_requested && migration_in_postcopy() &&
+        migrate_use_multifd_postcopy()) {
+        res = multifd_flush_pages(rs->f);
+        if (res < 0) {
+            return res;
+        }
+    }
+
     res = ram_save_release_protection(rs, pss, start_page);
     return (res < 0 ? res : pages);
 }
@@ -2276,8 +2792,17 @@ static int ram_find_and_save_block(RAMState *rs)
         found = get_queued_page(rs, &pss);
 
         if (!found) {
-            /* priority queue empty, so just search for something dirty */
-            found = find_dirty_block(rs, &pss, &again);
+            /*
+             * Recover previous precopy ramblock/offset if postcopy has
+             * preempted precopy.  Otherwise find the next dirty bit.
+             */
+            if (postcopy_preempt_triggered(rs)) {
+                postcopy_preempt_restore(rs, &pss, false);
+                found = true;
+            } else {
+                /* priority queue empty, so just search for something dirty */
+                found = find_dirty_block(rs, &pss, &again);
+            }
         }
 
         if (found) {
@@ -2342,6 +2867,10 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        if ((*rsp)->sync_threads) {
+            dirty_sync_threads_destroy((*rsp)->sync_threads);
+            (*rsp)->sync_threads = NULL;
+        }
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2391,6 +2920,8 @@ static void ram_save_cleanup(void *opaque)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -2405,6 +2936,8 @@ static void ram_state_reset(RAMState *rs)
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->xbzrle_enabled = false;
+    postcopy_preempt_reset(rs);
+    rs->postcopy_channel = RAM_CHANNEL_PRECOPY;
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
@@ -2890,6 +3423,73 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
+/**
+ * mapped_ram_setup_ramblock: reserve the file area of a RAMBlock
+ *
+ * Writes the mapped-ram header of @block to the stream and moves the
+ * stream past the space reserved for the bitmap and the pages of the
+ * block, so that the next block (or the rest of the stream) follows.
+ *
+ * Returns zero on success and a negative errno value if the file could
+ * not be positioned; the file error is set in that case.
+ *
+ * @file: QEMUFile where to send the data
+ * @block: RAMBlock being described
+ */
+static int mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
+{
+    MappedRamHeader header = {};
+    long num_pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = DIV_ROUND_UP(num_pages, BITS_PER_BYTE);
+    off_t offset;
+
+    block->file_bmap = bitmap_new(num_pages);
+
+    offset = qemu_get_offset(file);
+    if (offset < 0) {
+        return qemu_file_get_error(file) ?: -EIO;
+    }
+
+    block->bitmap_offset = offset + sizeof(header);
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bitmap_size,
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    header.version = cpu_to_be32(MAPPED_RAM_HDR_VERSION);
+    header.page_size = cpu_to_be64(TARGET_PAGE_SIZE);
+    header.bitmap_offset = cpu_to_be64(block->bitmap_offset);
+    header.pages_offset = cpu_to_be64(block->pages_offset);
+
+    qemu_put_buffer(file, (uint8_t *)&header, sizeof(header));
+
+    /* The next block starts right after the pages of this one */
+    qemu_set_offset(file, block->pages_offset + block->used_length);
+    return qemu_file_get_error(file);
+}
+
+/**
+ * mapped_ram_save_bitmaps: write the final bitmaps of all RAMBlocks
+ *
+ * Must be called once no page will be written to the file anymore.
+ *
+ * @file: QEMUFile where to send the data
+ */
+static void mapped_ram_save_bitmaps(QEMUFile *file)
+{
+    RAMBlock *block;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        long num_pages = block->used_length >> TARGET_PAGE_BITS;
+        g_autofree unsigned long *le_bitmap = bitmap_new(num_pages);
+
+        bitmap_to_le(le_bitmap, block->file_bmap, num_pages);
+        qemu_put_buffer_at(file, (uint8_t *)le_bitmap,
+                           DIV_ROUND_UP(num_pages, BITS_PER_BYTE),
+                           block->bitmap_offset);
+    }
+}
+
 /*
  * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -2911,6 +3511,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int ret;
 
+    if (migrate_mapped_ram()) {
+        QIOChannel *ioc = qemu_file_get_ioc(f);
+
+        if (!ioc ||
+            !qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+            error_report("mapped-ram requires migrating to a file");
+            return -1;
+        }
+    }
+
     if (compress_threads_save_setup()) {
         return -1;
     }
@@ -2938,6 +3548,14 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram()) {
+                ret = mapped_ram_setup_ramblock(f, block);
+                if (ret < 0) {
+                    error_report("Failed to reserve the mapped-ram area of "
+                                 "RAMBlock %s", block->idstr);
+                    return ret;
+                }
+            }
         }
     }
 
@@ -3048,6 +3666,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
+    postcopy_preempt_reset_channel(rs);
+
     /*
      * Must occur before EOS (or any QEMUFile operation)
      * because of RDMA protocol.
@@ -3117,6 +3737,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
             }
         }
 
+        postcopy_preempt_reset_channel(rs);
         flush_compressed_data(rs);
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     }
@@ -3130,6 +3751,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         return ret;
     }
 
+    if (migrate_mapped_ram()) {
+        mapped_ram_save_bitmaps(f);
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -3211,9 +3836,10 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
  */
 static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
-                                              QEMUFile *f, int flags)
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    RAMBlock *block = mis->last_recv_block;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3240,7 +3866,7 @@ static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
         return NULL;
     }
 
-    mis->last_recv_block = block;
+    mis->last_recv_block[channel] = block;
 
     return block;
 }
@@ -3655,19 +4281,20 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the preempt channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the channel to use for loading
  */
-int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    /* Currently we only use channel 0.  TODO: use all the channels */
-    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[0];
+    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[channel];
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
@@ -3694,7 +4321,7 @@ int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(mis, f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
             if (!block) {
                 ret = -EINVAL;
                 break;
@@ -3799,7 +4426,9 @@ int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3894,6 +4523,141 @@ void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+/**
+ * mapped_ram_read_pages: load the pages of a RAMBlock from the file
+ *
+ * Returns 0 for success or -errno in case of error
+ *
+ * @f: QEMUFile where to read the data from
+ * @block: RAMBlock being loaded
+ * @num_pages: number of target pages in @block
+ * @bitmap: pages of @block that are present in the file
+ */
+static int mapped_ram_read_pages(QEMUFile *f, RAMBlock *block,
+                                 long num_pages, unsigned long *bitmap)
+{
+    unsigned long set_bit_idx, clear_bit_idx;
+
+    for (set_bit_idx = find_first_bit(bitmap, num_pages);
+         set_bit_idx < num_pages;
+         set_bit_idx = find_next_bit(bitmap, num_pages, clear_bit_idx + 1)) {
+        ram_addr_t offset = (ram_addr_t)set_bit_idx << TARGET_PAGE_BITS;
+        size_t unread;
+
+        clear_bit_idx = find_next_zero_bit(bitmap, num_pages,
+                                           set_bit_idx + 1);
+        unread = (clear_bit_idx - set_bit_idx) << TARGET_PAGE_BITS;
+
+        while (unread > 0) {
+            size_t size = MIN(unread, MAPPED_RAM_LOAD_BUF_SIZE);
+            void *host = host_from_ram_block_offset(block, offset);
+
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, offset);
+                return -EINVAL;
+            }
+
+            if (migrate_use_multifd()) {
+                if (multifd_recv_queue_file_range(host,
+                                                  block->pages_offset + offset,
+                                                  size) < 0) {
+                    return -EIO;
+                }
+            } else if (qemu_get_buffer_at(f, host, size,
+                                          block->pages_offset + offset) !=
+                       size) {
+                return qemu_file_get_error(f) ?: -EIO;
+            }
+
+            ramblock_recv_bitmap_set_range(block, host,
+                                           size >> TARGET_PAGE_BITS);
+            offset += size;
+            unread -= size;
+        }
+    }
+
+    if (migrate_use_multifd()) {
+        return multifd_recv_sync_file();
+    }
+
+    return 0;
+}
+
+/**
+ * mapped_ram_load_ramblock: load a RAMBlock stored with mapped-ram
+ *
+ * Reads the header of @block from the stream, loads all pages present
+ * in the file and moves the stream past the area of the block.
+ *
+ * Returns 0 for success or -errno in case of error
+ *
+ * @f: QEMUFile where to read the data from
+ * @block: RAMBlock being loaded
+ * @length: length of @block on the source
+ */
+static int mapped_ram_load_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    g_autofree unsigned long *le_bitmap = NULL;
+    g_autofree unsigned long *bitmap = NULL;
+    MappedRamHeader header;
+    long num_pages = length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = DIV_ROUND_UP(num_pages, BITS_PER_BYTE);
+    uint64_t bitmap_offset;
+    int ret;
+
+    if (qemu_get_buffer(f, (uint8_t *)&header, sizeof(header)) !=
+        sizeof(header)) {
+        error_report("Failed to read mapped-ram header of block %s",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    header.version = be32_to_cpu(header.version);
+    header.page_size = be64_to_cpu(header.page_size);
+    bitmap_offset = be64_to_cpu(header.bitmap_offset);
+    block->pages_offset = be64_to_cpu(header.pages_offset);
+
+    if (header.version > MAPPED_RAM_HDR_VERSION) {
+        error_report("Unsupported mapped-ram header version %" PRIu32
+                     " for block %s (max %d)",
+                     header.version, block->idstr, MAPPED_RAM_HDR_VERSION);
+        return -EINVAL;
+    }
+
+    if (header.page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size %" PRIu64
+                     " for block %s (expected %d)",
+                     header.page_size, block->idstr, TARGET_PAGE_SIZE);
+        return -EINVAL;
+    }
+
+    if (!QEMU_IS_ALIGNED(block->pages_offset, TARGET_PAGE_SIZE)) {
+        error_report("Unaligned mapped-ram pages offset 0x%" PRIx64
+                     " for block %s", block->pages_offset, block->idstr);
+        return -EINVAL;
+    }
+
+    le_bitmap = bitmap_new(num_pages);
+    bitmap = bitmap_new(num_pages);
+    if (qemu_get_buffer_at(f, (uint8_t *)le_bitmap, bitmap_size,
+                           bitmap_offset) != bitmap_size) {
+        error_report("Failed to read mapped-ram bitmap of block %s",
+                     block->idstr);
+        return qemu_file_get_error(f) ?: -EIO;
+    }
+    bitmap_from_le(bitmap, le_bitmap, num_pages);
+
+    ret = mapped_ram_read_pages(f, block, num_pages, bitmap);
+    if (ret) {
+        return ret;
+    }
+
+    /* The next block starts right after the pages of this one */
+    qemu_set_offset(f, block->pages_offset + length);
+    return qemu_file_get_error(f);
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3945,7 +4709,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(mis, f, flags);
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -4034,6 +4799,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_ramblock(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4122,7 +4890,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -65,7 +65,9 @@
 #include "qemu/bitmap.h"
 #include "net/announce.h"
 #include "qemu/yank.h"
+#include "qemu/units.h"
 #include "yank_functions.h"
+#include "multifd.h"
 
 const unsigned int postcopy_ram_discard_version;
 
@@ -92,6 +94,8 @@ enum qemu_vm_cmd {
 };
 
 #define MAX_VM_CMD_PACKAGED_SIZE UINT32_MAX
+/* Larger independent device states are sent as normal sections */
+#define MAX_VM_SECTION_PARALLEL_SIZE (64 * MiB)
 static struct mig_cmd_args {
     ssize_t     len; /* -1 = variable */
     const char *name;
@@ -249,6 +253,8 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* set while the state is being saved by a helper thread */
+    struct SaveParallelJob *parallel_job;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -275,6 +281,7 @@ static bool should_validate_capability(int capability)
     /* Validate only new capabilities to keep compatibility. */
     switch (capability) {
     case MIGRATION_CAPABILITY_X_IGNORE_SHARED:
+    case MIGRATION_CAPABILITY_PARALLEL_DEVICE_STATE:
         return true;
     default:
         return false;
@@ -1360,10 +1367,143 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * Devices flagged as independent are saved by helper threads into their
+ * own buffer, that is then copied into the stream in the usual order.
+ */
+typedef struct SaveParallelJob {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    JSONWriter *vmdesc;
+    QemuEvent done;
+    /* time spent saving the state (us) */
+    int64_t time;
+    int ret;
+} SaveParallelJob;
+
+static void savevm_parallel_save_job(gpointer data, gpointer user_data)
+{
+    SaveParallelJob *job = data;
+    SaveStateEntry *se = job->se;
+    int64_t start;
+
+    rcu_register_thread();
+
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    trace_savevm_section_start(se->idstr, se->section_id);
+    json_writer_start_object(job->vmdesc, NULL);
+    json_writer_str(job->vmdesc, "name", se->idstr);
+    json_writer_int64(job->vmdesc, "instance_id", se->instance_id);
+
+    save_section_header(job->f, se, QEMU_VM_SECTION_FULL);
+    job->ret = vmstate_save(job->f, se, job->vmdesc);
+    trace_savevm_section_end(se->idstr, se->section_id, job->ret);
+    save_section_footer(job->f, se);
+
+    json_writer_end_object(job->vmdesc);
+    qemu_fflush(job->f);
+    if (!job->ret) {
+        job->ret = qemu_file_get_error(job->f);
+    }
+    job->time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+    qemu_event_set(&job->done);
+
+    rcu_unregister_thread();
+}
+
+/*
+ * Start saving the independent devices that need to be saved.  Returns
+ * the thread pool to wait for, or NULL if there is nothing to do.
+ */
+static GThreadPool *savevm_parallel_save_start(void)
+{
+    int nr_threads = migrate_device_state_threads();
+    GThreadPool *pool = NULL;
+    SaveStateEntry *se;
+
+    if (!migrate_parallel_device_state() || nr_threads <= 1) {
+        return NULL;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SaveParallelJob *job;
+
+        if (!se->vmsd || !se->vmsd->independent ||
+            !vmstate_save_needed(se->vmsd, se->opaque)) {
+            continue;
+        }
+
+        if (!pool) {
+            pool = g_thread_pool_new(savevm_parallel_save_job, NULL,
+                                     nr_threads, false, NULL);
+        }
+
+        job = g_new0(SaveParallelJob, 1);
+        job->se = se;
+        job->bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(job->bioc), "migration-device-state");
+        job->f = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+        object_unref(OBJECT(job->bioc));
+        job->vmdesc = json_writer_new(false);
+        qemu_event_init(&job->done, false);
+        se->parallel_job = job;
+        g_thread_pool_push(pool, job, NULL);
+    }
+
+    return pool;
+}
+
+/* Copy the state saved by a helper thread into the stream */
+static int savevm_parallel_save_put(QEMUFile *f, SaveStateEntry *se,
+                                    JSONWriter *vmdesc)
+{
+    SaveParallelJob *job = se->parallel_job;
+
+    qemu_event_wait(&job->done);
+    trace_savevm_section_parallel(se->idstr, se->section_id,
+                                  job->bioc->usage);
+    if (job->ret) {
+        return job->ret;
+    }
+    if (job->bioc->usage <= MAX_VM_SECTION_PARALLEL_SIZE) {
+        qemu_put_byte(f, QEMU_VM_SECTION_PARALLEL);
+        qemu_put_be32(f, job->bioc->usage);
+    }
+    qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+    json_writer_raw(vmdesc, NULL, json_writer_get(job->vmdesc));
+    migration_downtime_add_section(se->idstr, se->instance_id, job->time);
+    return 0;
+}
+
+static void savevm_parallel_save_cleanup(GThreadPool *pool)
+{
+    SaveStateEntry *se;
+
+    if (!pool) {
+        return;
+    }
+    /* Wait for all the jobs, including those not consumed on error */
+    g_thread_pool_free(pool, false, true);
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SaveParallelJob *job = se->parallel_job;
+
+        if (job) {
+            qemu_fclose(job->f);
+            json_writer_free(job->vmdesc);
+            qemu_event_destroy(&job->done);
+            g_free(job);
+            se->parallel_job = NULL;
+        }
+    }
+}
+
 static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1379,6 +1519,7 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
                 continue;
             }
         }
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_savevm_section_start(se->idstr, se->section_id);
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
@@ -1390,6 +1531,8 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
             qemu_file_set_error(f, ret);
             return -1;
         }
+        migration_downtime_add_section(se->idstr, se->instance_id,
+                            qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
     }
 
     return 0;
@@ -1400,15 +1543,28 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool inactivate_disks)
 {
     g_autoptr(JSONWriter) vmdesc = NULL;
+    GThreadPool *pool;
     int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
+    /* The independent devices are saved while we do the others */
+    pool = savevm_parallel_save_start();
+
     vmdesc = json_writer_new(false);
     json_writer_start_object(vmdesc, NULL);
     json_writer_int64(vmdesc, "page_size", qemu_target_page_size());
     json_writer_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->parallel_job) {
+            ret = savevm_parallel_save_put(f, se, vmdesc);
+            if (ret) {
+                qemu_file_set_error(f, ret);
+                goto out;
+            }
+            continue;
+        }
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
@@ -1418,6 +1574,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
             continue;
         }
 
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_savevm_section_start(se->idstr, se->section_id);
 
         json_writer_start_object(vmdesc, NULL);
@@ -1428,13 +1585,17 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
-            return ret;
+            goto out;
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
 
         json_writer_end_object(vmdesc);
+        migration_downtime_add_section(se->idstr, se->instance_id,
+                            qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
     }
+    savevm_parallel_save_cleanup(pool);
+    pool = NULL;
 
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
@@ -1463,6 +1624,10 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     }
 
     return 0;
+
+out:
+    savevm_parallel_save_cleanup(pool);
+    return ret;
 }
 
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
@@ -1471,6 +1636,7 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     int ret;
     Error *local_err = NULL;
     bool in_postcopy = migration_in_postcopy();
+    int64_t start;
 
     if (precopy_notify(PRECOPY_NOTIFY_COMPLETE, &local_err)) {
         error_report_err(local_err);
@@ -1481,24 +1647,33 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     cpu_synchronize_all_states();
 
     if (!in_postcopy || iterable_only) {
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = qemu_savevm_state_complete_precopy_iterable(f, in_postcopy);
         if (ret) {
             return ret;
         }
+        migration_downtime_add(MIGRATION_DOWNTIME_ITERABLE,
+                               qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
     }
 
     if (iterable_only) {
         goto flush;
     }
 
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy,
                                                           inactivate_disks);
     if (ret) {
         return ret;
     }
+    migration_downtime_add(MIGRATION_DOWNTIME_NON_ITERABLE,
+                           qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
 
 flush:
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     qemu_fflush(f);
+    migration_downtime_add(MIGRATION_DOWNTIME_FLUSH,
+                           qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
     return 0;
 }
 
@@ -1567,6 +1742,7 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
     }
 
     migrate_init(ms);
+    migration_downtime_clear(ms);
     memset(&ram_counters, 0, sizeof(ram_counters));
     memset(&compression_counters, 0, sizeof(compression_counters));
     ms->to_dst_file = f;
@@ -1978,6 +2154,8 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
             postcopy_ram_incoming_cleanup(mis);
             return -1;
         }
+        /* multifd channels can start placing postcopy pages now */
+        multifd_recv_postcopy_listen();
     }
 
     trace_loadvm_postcopy_handle_listen("after uffd");
@@ -2152,6 +2330,11 @@ static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
      */
     qemu_sem_post(&mis->postcopy_pause_sem_fault);
 
+    if (migrate_postcopy_preempt()) {
+        /* The new preempt channel is connected, let the thread load again */
+        qemu_sem_post(&mis->postcopy_pause_sem_fast_load);
+    }
+
     return 0;
 }
 
@@ -2390,8 +2573,11 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
-static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+/*
+ * Read the header of a full section and find the matching handler.
+ * On success, returns 0 and @pse points to the handler.
+ */
+static int qemu_loadvm_section_find_full(QEMUFile *f, SaveStateEntry **pse)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2442,19 +2628,166 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    *pse = se;
+    return 0;
+}
+
+static int qemu_loadvm_section_load_full(QEMUFile *f, SaveStateEntry *se)
+{
+    int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    int ret;
+
     ret = vmstate_load(f, se);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%"PRIx32" of"
-                     " device '%s'", instance_id, idstr);
+                     " device '%s'", se->instance_id, se->idstr);
         return ret;
     }
     if (!check_section_footer(f, se)) {
         return -EINVAL;
     }
+    trace_qemu_loadvm_state_section_time(se->idstr, se->instance_id,
+                            qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
 
     return 0;
 }
 
+static int
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+{
+    SaveStateEntry *se;
+    int ret;
+
+    ret = qemu_loadvm_section_find_full(f, &se);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qemu_loadvm_section_load_full(f, se);
+}
+
+/*
+ * Sections of independent devices sent with QEMU_VM_SECTION_PARALLEL are
+ * loaded by helper threads.  They must all be loaded before anything
+ * else can depend on them, i.e. before a command or the end of the
+ * device state.
+ */
+typedef struct LoadParallelJob {
+    QEMUFile *f;
+    SaveStateEntry *se;
+} LoadParallelJob;
+
+static struct {
+    GThreadPool *pool;
+    QemuMutex lock;
+    /* first error returned by a job */
+    int ret;
+} loadvm_parallel;
+
+static void loadvm_parallel_load_job(gpointer data, gpointer user_data)
+{
+    LoadParallelJob *job = data;
+    int ret;
+
+    rcu_register_thread();
+
+    ret = qemu_loadvm_section_load_full(job->f, job->se);
+    qemu_fclose(job->f);
+    if (ret < 0) {
+        qemu_mutex_lock(&loadvm_parallel.lock);
+        if (!loadvm_parallel.ret) {
+            loadvm_parallel.ret = ret;
+        }
+        qemu_mutex_unlock(&loadvm_parallel.lock);
+    }
+    g_free(job);
+
+    rcu_unregister_thread();
+}
+
+/* Wait for the pending parallel sections, returns the first error */
+static int loadvm_parallel_wait(void)
+{
+    int ret;
+
+    if (!loadvm_parallel.pool) {
+        return 0;
+    }
+    g_thread_pool_free(loadvm_parallel.pool, false, true);
+    loadvm_parallel.pool = NULL;
+    qemu_mutex_destroy(&loadvm_parallel.lock);
+    ret = loadvm_parallel.ret;
+    loadvm_parallel.ret = 0;
+    return ret;
+}
+
+static int
+qemu_loadvm_section_parallel(QEMUFile *f, MigrationIncomingState *mis)
+{
+    QIOChannelBuffer *bioc;
+    LoadParallelJob *job;
+    QEMUFile *packf;
+    SaveStateEntry *se;
+    uint32_t length;
+    int ret;
+
+    length = qemu_get_be32(f);
+    trace_qemu_loadvm_state_section_parallel(length);
+
+    if (length > MAX_VM_SECTION_PARALLEL_SIZE) {
+        error_report("%s: Unreasonably large parallel section: %u",
+                     __func__, length);
+        return -EINVAL;
+    }
+
+    bioc = qio_channel_buffer_new(length);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-loadvm-parallel");
+    ret = qemu_get_buffer(f, bioc->data, length);
+    if (ret != length) {
+        object_unref(OBJECT(bioc));
+        error_report("%s: Failed to read parallel section: %d", __func__, ret);
+        return (ret < 0) ? ret : -EAGAIN;
+    }
+    bioc->usage += length;
+
+    packf = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    /* Only independent devices may be loaded outside of the main thread */
+    if (qemu_get_byte(packf) != QEMU_VM_SECTION_FULL) {
+        error_report("%s: Parallel section is not a full section", __func__);
+        ret = -EINVAL;
+        goto err;
+    }
+    ret = qemu_loadvm_section_find_full(packf, &se);
+    if (ret < 0) {
+        goto err;
+    }
+    if (!se->vmsd || !se->vmsd->independent) {
+        error_report("%s: Device '%s' can't be loaded in parallel",
+                     __func__, se->idstr);
+        ret = -EINVAL;
+        goto err;
+    }
+
+    if (!loadvm_parallel.pool) {
+        qemu_mutex_init(&loadvm_parallel.lock);
+        loadvm_parallel.pool =
+            g_thread_pool_new(loadvm_parallel_load_job, NULL,
+                              MAX(migrate_device_state_threads(), 1),
+                              false, NULL);
+    }
+    job = g_new0(LoadParallelJob, 1);
+    job->f = packf;
+    job->se = se;
+    g_thread_pool_push(loadvm_parallel.pool, job, NULL);
+    return 0;
+
+err:
+    qemu_fclose(packf);
+    return ret;
+}
+
 static int
 qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
 {
@@ -2575,16 +2908,6 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 {
     int i;
 
-    /*
-     * If network is interrupted, any temp page we received will be useless
-     * because we didn't mark them as "received" in receivedmap.  After a
-     * proper recovery later (which will sync src dirty bitmap with receivedmap
-     * on dest) these cached small pages will be resent again.
-     */
-    for (i = 0; i < mis->postcopy_channels; i++) {
-        postcopy_temp_page_reset(&mis->postcopy_tmp_pages[i]);
-    }
-
     trace_postcopy_pause_incoming();
 
     assert(migrate_postcopy_ram());
@@ -2607,6 +2930,27 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
     mis->to_src_file = NULL;
     qemu_mutex_unlock(&mis->rp_mutex);
 
+    if (mis->postcopy_qemufile_dst) {
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        /* Take the mutex to make sure the preempt thread has halted */
+        qemu_mutex_lock(&mis->postcopy_prio_thread_mutex);
+        migration_ioc_unregister_yank_from_file(mis->postcopy_qemufile_dst);
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+        qemu_mutex_unlock(&mis->postcopy_prio_thread_mutex);
+    }
+
+    /*
+     * If network is interrupted, any temp page we received will be useless
+     * because we didn't mark them as "received" in receivedmap.  After a
+     * proper recovery later (which will sync src dirty bitmap with receivedmap
+     * on dest) these cached small pages will be resent again.  This is done
+     * after the preempt thread halted, as it owns one of the temp pages.
+     */
+    for (i = 0; i < mis->postcopy_channels; i++) {
+        postcopy_temp_page_reset(&mis->postcopy_tmp_pages[i]);
+    }
+
     migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_ACTIVE,
                       MIGRATION_STATUS_POSTCOPY_PAUSED);
 
@@ -2628,6 +2972,7 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
     uint8_t section_type;
+    int parallel_ret;
     int ret = 0;
 
 retry:
@@ -2648,14 +2993,30 @@ retry:
                 goto out;
             }
             break;
-        case QEMU_VM_SECTION_PART:
+        case QEMU_VM_SECTION_PARALLEL:
+            ret = qemu_loadvm_section_parallel(f, mis);
+            if (ret < 0) {
+                goto out;
+            }
+            break;
         case QEMU_VM_SECTION_END:
+            /* The source has stopped and is sending its final pass */
+            if (!mis->downtime_load_start) {
+                mis->downtime_load_start =
+                    qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            }
+            /* fall through */
+        case QEMU_VM_SECTION_PART:
             ret = qemu_loadvm_section_part_end(f, mis);
             if (ret < 0) {
                 goto out;
             }
             break;
         case QEMU_VM_COMMAND:
+            ret = loadvm_parallel_wait();
+            if (ret < 0) {
+                goto out;
+            }
             ret = loadvm_process_command(f);
             trace_qemu_loadvm_state_section_command(ret);
             if ((ret < 0) || (ret == LOADVM_QUIT)) {
@@ -2673,6 +3034,10 @@ retry:
     }
 
 out:
+    parallel_ret = loadvm_parallel_wait();
+    if (ret >= 0 && parallel_ret < 0) {
+        ret = parallel_ret;
+    }
     if (ret < 0) {
         qemu_file_set_error(f, ret);
 
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,46 +25,91 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/* Returns the offset of the first byte from @i on that differs */
+static int xbzrle_zrun_end_int(uint8_t *old_buf, uint8_t *new_buf,
+                               int i, int slen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    /* not aligned to sizeof(long) */
+    while ((i % sizeof(long)) && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    if (i % sizeof(long)) {
+        return i;
+    }
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
+    /* word at a time for speed */
+    while (i < slen &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
 
-    while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
-        }
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
+/* Returns the offset of the first byte from @i on that is unchanged */
+static int xbzrle_nzrun_end_int(uint8_t *old_buf, uint8_t *new_buf,
+                                int i, int slen)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
 
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
+    /* not aligned to sizeof(long) */
+    while ((i % sizeof(long)) && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    if (i % sizeof(long)) {
+        return i;
+    }
 
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i < slen) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            while (old_buf[i] != new_buf[i]) {
                 i++;
             }
+            break;
+        }
+        i += sizeof(long);
+    }
+    return i;
+}
+
+typedef int (*xbzrle_run_end_fn)(uint8_t *old_buf, uint8_t *new_buf,
+                                 int i, int slen);
+
+/*
+ * The encoder proper.  The run scanners are the only part that differs
+ * between the accelerated variants, so that they all produce the same
+ * output.  Forced inlining lets the compiler inline the scanners too.
+ */
+static inline QEMU_ALWAYS_INLINE int
+xbzrle_encode_common(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                     uint8_t *dst, int dlen,
+                     xbzrle_run_end_fn zrun_end, xbzrle_run_end_fn nzrun_end)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, end;
+    uint8_t *nzrun_start;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
         }
 
+        end = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
+
         /* buffer unchanged */
         if (zrun_len == slen) {
             return 0;
@@ -76,42 +122,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
+        i = end;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -120,12 +140,188 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
 }
 
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_common(old_buf, new_buf, slen, dst, dlen,
+                                xbzrle_zrun_end_int, xbzrle_nzrun_end_int);
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_zrun_end_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        uint32_t ne = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (ne) {
+            return i + ctz32(ne);
+        }
+    }
+    return xbzrle_zrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_end_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                 int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return xbzrle_nzrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_common(old_buf, new_buf, slen, dst, dlen,
+                                xbzrle_zrun_end_avx2, xbzrle_nzrun_end_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int xbzrle_zrun_end_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                  int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t ne = _mm512_cmpneq_epi8_mask(o, n);
+
+        if (ne) {
+            return i + ctz64(ne);
+        }
+    }
+    return xbzrle_zrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_end_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                   int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+
+        if (eq) {
+            return i + ctz64(eq);
+        }
+    }
+    return xbzrle_nzrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_common(old_buf, new_buf, slen, dst, dlen,
+                                xbzrle_zrun_end_avx512,
+                                xbzrle_nzrun_end_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+static unsigned cpuid_cache;
+static int (*xbzrle_encode_accel)(uint8_t *, uint8_t *, int,
+                                  uint8_t *, int) = xbzrle_encode_buffer_int;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    xbzrle_encode_accel = fn;
+}
+
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* 0xe6: OPMASK, ZMM, YMM and XMM state are enabled by OS */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX512BW_OPT || CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -278,6 +278,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us "
+                       "(total %" PRIu64 " us)\n",
+                       info->ram->dirty_sync_time,
+                       info->ram->dirty_sync_time_total);
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
@@ -385,6 +389,45 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->vfio->transferred >> 10);
     }
 
+    if (info->has_downtime_stats) {
+        MigrationDowntimeStats *stats = info->downtime_stats;
+        MigrationDowntimeSectionList *sec;
+        MigrationDowntimeSection *slowest = NULL;
+
+        monitor_printf(mon, "downtime breakdown (us):");
+        if (stats->has_vm_stop) {
+            monitor_printf(mon, " vm-stop %" PRId64, stats->vm_stop);
+        }
+        if (stats->has_iterable) {
+            monitor_printf(mon, " iterable %" PRId64, stats->iterable);
+        }
+        if (stats->has_non_iterable) {
+            monitor_printf(mon, " non-iterable %" PRId64,
+                           stats->non_iterable);
+        }
+        if (stats->has_flush) {
+            monitor_printf(mon, " flush %" PRId64, stats->flush);
+        }
+        if (stats->has_load) {
+            monitor_printf(mon, " load %" PRId64, stats->load);
+        }
+        if (stats->has_vm_start) {
+            monitor_printf(mon, " vm-start %" PRId64, stats->vm_start);
+        }
+        monitor_printf(mon, "\n");
+
+        for (sec = stats->sections; sec; sec = sec->next) {
+            if (!slowest || sec->value->time > slowest->time) {
+                slowest = sec->value;
+            }
+        }
+        if (slowest) {
+            monitor_printf(mon, "downtime slowest section: %s/%u %" PRId64
+                           " us\n", slowest->name, slowest->instance_id,
+                           slowest->time);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
 }
 
@@ -490,6 +533,9 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_COMPRESSION),
             MultiFDCompression_str(params->multifd_compression));
+        monitor_printf(mon, "%s: %u bytes\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZSTD_DICT_SIZE),
+            params->multifd_zstd_dict_size);
         monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
@@ -1309,6 +1355,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_uint8(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_ZSTD_DICT_SIZE:
+        p->has_multifd_zstd_dict_size = true;
+        visit_type_uint32(v, param, &p->multifd_zstd_dict_size, &err);
+        break;
 #ifdef CONFIG_LINUX
     case MIGRATION_PARAMETER_ZERO_COPY_SEND:
         p->has_zero_copy_send = true;
@@ -40,6 +40,19 @@
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
 
+/*
+ * Read payloads smaller than this are copied even with zero copy enabled,
+ * because the completion notification costs more than the copy.
+ */
+#define NBD_ZERO_COPY_MIN_SIZE (16 * KiB)
+
+/*
+ * Stop using zero copy for new replies while this many bytes of sent
+ * payloads still wait for their completion notification.  The limit of a
+ * client is lowered whenever the kernel cannot pin any more pages for it.
+ */
+#define NBD_ZERO_COPY_MAX_PENDING (64 * MiB)
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -80,9 +93,19 @@ typedef struct NBDRequestData NBDRequestData;
 struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
+    size_t data_len;
     bool complete;
+    bool zero_copy; /* data may have been sent with zero copy */
 };
 
+/* A read payload sent with zero copy, which the kernel may still access */
+typedef struct NBDZeroCopyBuffer {
+    void *data;
+    size_t size;
+    ssize_t seq; /* Buffer is unused once this many writes have completed */
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuffer) next;
+} NBDZeroCopyBuffer;
+
 struct NBDExport {
     BlockExport common;
 
@@ -99,6 +122,8 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    bool zero_copy;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -127,6 +152,16 @@ struct NBDClient {
     QIOChannelSocket *sioc; /* The underlying data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
 
+    /*
+     * If non-NULL, the socket is served in this AioContext rather than the
+     * export's one.  Only block layer calls move to the export's AioContext.
+     * recv_coroutine, read_yielding and nb_requests are then only written
+     * from @ctx; the export's callbacks read nb_requests and write quiescing
+     * atomically, and leave the rest to a bottom half in @ctx.
+     */
+    AioContext *ctx;
+    bool kick_pending; /* nbd_client_kick_bh() is scheduled */
+
     Coroutine *recv_coroutine;
 
     CoMutex send_lock;
@@ -147,10 +182,42 @@ struct NBDClient {
     uint32_t opt; /* Current option being negotiated */
     uint32_t optlen; /* remaining length of data in ioc for the option being
                         negotiated now */
+
+    /* Send read payloads with zero copy; only for plain sockets */
+    bool zero_copy;
+    QSIMPLEQ_HEAD(, NBDZeroCopyBuffer) zero_copy_bufs;
+    size_t zero_copy_pending; /* Total size of zero_copy_bufs */
+    size_t zero_copy_max_pending;
 };
 
 static void nbd_client_receive_next_request(NBDClient *client);
 
+/* AioContext in which the client's socket is served */
+static AioContext *nbd_client_ctx(NBDClient *client)
+{
+    return client->ctx ?: client->exp->common.ctx;
+}
+
+/*
+ * Move the current request to the export's AioContext before accessing the
+ * block layer, and back to the client's AioContext before touching the
+ * client or its socket again.  No-ops unless the client has its own
+ * AioContext.
+ */
+static coroutine_fn void nbd_co_enter_export(NBDClient *client)
+{
+    if (client->ctx) {
+        aio_co_reschedule_self(client->exp->common.ctx);
+    }
+}
+
+static coroutine_fn void nbd_co_leave_export(NBDClient *client)
+{
+    if (client->ctx) {
+        aio_co_reschedule_self(client->ctx);
+    }
+}
+
 /* Basic flow for negotiation
 
    Server         Client
@@ -1350,9 +1417,16 @@ static coroutine_fn int nbd_negotiate(NBDClient *client, Error **errp)
         return ret;
     }
 
-    /* Attach the channel to the same AioContext as the export */
-    if (client->exp && client->exp->common.ctx) {
-        qio_channel_attach_aio_context(client->ioc, client->exp->common.ctx);
+    /* Attach the channel to its own AioContext, or the export's one */
+    if (client->exp && nbd_client_ctx(client)) {
+        qio_channel_attach_aio_context(client->ioc, nbd_client_ctx(client));
+    }
+
+    /* The kernel cannot send data from our buffers through TLS */
+    if (client->exp && client->exp->zero_copy &&
+        client->ioc == QIO_CHANNEL(client->sioc)) {
+        client->zero_copy = qio_channel_socket_enable_zero_copy(client->sioc);
+        trace_nbd_negotiate_zero_copy(client->zero_copy);
     }
 
     assert(!client->optlen);
@@ -1361,6 +1435,57 @@ static coroutine_fn int nbd_negotiate(NBDClient *client, Error **errp)
     return 0;
 }
 
+/*
+ * Free the read payloads that the kernel is done sending.  This also
+ * empties the socket error queue, which would keep waking up the
+ * coroutines waiting on the socket otherwise.
+ */
+static void nbd_zero_copy_reap(NBDClient *client)
+{
+    NBDZeroCopyBuffer *buf;
+    Error *local_err = NULL;
+    ssize_t sent;
+
+    if (!client->zero_copy) {
+        return;
+    }
+
+    sent = qio_channel_socket_zero_copy_poll(client->sioc, &local_err);
+    if (sent < 0) {
+        /* Sending will fail too and disconnect the client */
+        trace_nbd_zero_copy_reap_fail(error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
+
+    while ((buf = QSIMPLEQ_FIRST(&client->zero_copy_bufs)) &&
+           buf->seq <= sent) {
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_bufs, next);
+        client->zero_copy_pending -= buf->size;
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+}
+
+/*
+ * Keep @data alive until the writes queued so far have completed, because
+ * some of them may still send from it.
+ */
+static void nbd_zero_copy_release(NBDClient *client, void *data, size_t size)
+{
+    NBDZeroCopyBuffer *buf = g_new(NBDZeroCopyBuffer, 1);
+
+    *buf = (NBDZeroCopyBuffer) {
+        .data = data,
+        .size = size,
+        .seq = client->sioc->zero_copy_queued,
+    };
+    QSIMPLEQ_INSERT_TAIL(&client->zero_copy_bufs, buf, next);
+    client->zero_copy_pending += size;
+
+    nbd_zero_copy_reap(client);
+}
+
 /* nbd_read_eof
  * Tries to read @size bytes from @ioc. This is a local implementation of
  * qio_channel_readv_all_eof. We have it here because we need it to be
@@ -1384,9 +1509,11 @@ nbd_read_eof(NBDClient *client, void *buffer, size_t size, Error **errp)
             client->read_yielding = true;
             qio_channel_yield(client->ioc, G_IO_IN);
             client->read_yielding = false;
-            if (client->quiescing) {
+            if (qatomic_read(&client->quiescing)) {
                 return -EAGAIN;
             }
+            /* Zero copy completions also wake us up, collect them */
+            nbd_zero_copy_reap(client);
             continue;
         } else if (len < 0) {
             return -EIO;
@@ -1452,30 +1579,77 @@ static int nbd_receive_request(NBDClient *client, NBDRequest *request,
 
 void nbd_client_get(NBDClient *client)
 {
-    client->refcount++;
+    qatomic_inc(&client->refcount);
+}
+
+static void nbd_client_free(NBDClient *client)
+{
+    NBDZeroCopyBuffer *buf;
+
+    /*
+     * Shutting down the socket does not drop its send queue, so the kernel
+     * may still send from the buffers.  Unless it is done with them,
+     * reset the connection to discard the queue before freeing them.
+     */
+    nbd_zero_copy_reap(client);
+    if (!QSIMPLEQ_EMPTY(&client->zero_copy_bufs)) {
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+        trace_nbd_zero_copy_abort(client->zero_copy_pending);
+        setsockopt(client->sioc->fd, SOL_SOCKET, SO_LINGER,
+                   &linger, sizeof(linger));
+        qio_channel_close(QIO_CHANNEL(client->sioc), NULL);
+    }
+    while ((buf = QSIMPLEQ_FIRST(&client->zero_copy_bufs))) {
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_bufs, next);
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+
+    qio_channel_detach_aio_context(client->ioc);
+    object_unref(OBJECT(client->sioc));
+    object_unref(OBJECT(client->ioc));
+    if (client->tlscreds) {
+        object_unref(OBJECT(client->tlscreds));
+    }
+    g_free(client->tlsauthz);
+    if (client->exp) {
+        QTAILQ_REMOVE(&client->exp->clients, client, next);
+        blk_exp_unref(&client->exp->common);
+    }
+    g_free(client->export_meta.bitmaps);
+    g_free(client);
+}
+
+static void nbd_client_free_bh(void *opaque)
+{
+    NBDClient *client = opaque;
+    AioContext *ctx = client->exp->common.ctx;
+
+    /* exp->clients is protected by the export's AioContext */
+    aio_context_acquire(ctx);
+    nbd_client_free(client);
+    aio_context_release(ctx);
 }
 
 void nbd_client_put(NBDClient *client)
 {
-    if (--client->refcount == 0) {
+    if (qatomic_fetch_dec(&client->refcount) == 1) {
         /* The last reference should be dropped by client->close,
          * which is called by client_close.
          */
         assert(client->closing);
 
-        qio_channel_detach_aio_context(client->ioc);
-        object_unref(OBJECT(client->sioc));
-        object_unref(OBJECT(client->ioc));
-        if (client->tlscreds) {
-            object_unref(OBJECT(client->tlscreds));
-        }
-        g_free(client->tlsauthz);
-        if (client->exp) {
-            QTAILQ_REMOVE(&client->exp->clients, client, next);
-            blk_exp_unref(&client->exp->common);
+        if (client->ctx && client->exp) {
+            /*
+             * The last reference may be dropped in the client's own
+             * AioContext, which must not take the export's lock.
+             */
+            aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                    nbd_client_free_bh, client);
+        } else {
+            nbd_client_free(client);
         }
-        g_free(client->export_meta.bitmaps);
-        g_free(client);
     }
 }
 
@@ -1504,7 +1678,8 @@ static NBDRequestData *nbd_request_get(NBDClient *client)
     NBDRequestData *req;
 
     assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
-    client->nb_requests++;
+    /* Pairs with the barrier in nbd_drained_begin(), see nbd_trip() */
+    qatomic_inc(&client->nb_requests);
 
     req = g_new0(NBDRequestData, 1);
     nbd_client_get(client);
@@ -1517,13 +1692,17 @@ static void nbd_request_put(NBDRequestData *req)
     NBDClient *client = req->client;
 
     if (req->data) {
-        qemu_vfree(req->data);
+        if (req->zero_copy) {
+            nbd_zero_copy_release(client, req->data, req->data_len);
+        } else {
+            qemu_vfree(req->data);
+        }
     }
     g_free(req);
 
-    client->nb_requests--;
+    qatomic_dec(&client->nb_requests);
 
-    if (client->quiescing && client->nb_requests == 0) {
+    if (qatomic_read(&client->quiescing) && client->nb_requests == 0) {
         aio_wait_kick();
     }
 
@@ -1542,11 +1721,14 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
     exp->common.ctx = ctx;
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
-        qio_channel_attach_aio_context(client->ioc, ctx);
+        assert(qatomic_read(&client->nb_requests) == 0);
 
-        assert(client->nb_requests == 0);
-        assert(client->recv_coroutine == NULL);
-        assert(client->send_coroutine == NULL);
+        /* Clients with their own AioContext are not affected */
+        if (!client->ctx) {
+            qio_channel_attach_aio_context(client->ioc, ctx);
+            assert(client->recv_coroutine == NULL);
+            assert(client->send_coroutine == NULL);
+        }
     }
 }
 
@@ -1558,7 +1740,9 @@ static void blk_aio_detach(void *opaque)
     trace_nbd_blk_aio_detach(exp->name, exp->common.ctx);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
-        qio_channel_detach_aio_context(client->ioc);
+        if (!client->ctx) {
+            qio_channel_detach_aio_context(client->ioc);
+        }
     }
 
     exp->common.ctx = NULL;
@@ -1570,8 +1754,42 @@ static void nbd_drained_begin(void *opaque)
     NBDClient *client;
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
-        client->quiescing = true;
+        qatomic_set(&client->quiescing, true);
+    }
+
+    /* Pairs with nbd_request_get() in nbd_trip(), see there */
+    smp_mb();
+}
+
+/*
+ * Clients with their own AioContext only touch their receive coroutine
+ * from there, so the export's callbacks hand the work over to these
+ * bottom halves.  The caller passes a reference to the client.
+ */
+static void nbd_client_receive_next_request_bh(void *opaque)
+{
+    NBDClient *client = opaque;
+
+    aio_context_acquire(client->ctx);
+    nbd_client_receive_next_request(client);
+    aio_context_release(client->ctx);
+
+    nbd_client_put(client);
+}
+
+static void nbd_client_kick_bh(void *opaque)
+{
+    NBDClient *client = opaque;
+
+    qatomic_set(&client->kick_pending, false);
+
+    aio_context_acquire(client->ctx);
+    if (client->recv_coroutine != NULL && client->read_yielding) {
+        qemu_aio_coroutine_enter(client->ctx, client->recv_coroutine);
     }
+    aio_context_release(client->ctx);
+
+    nbd_client_put(client);
 }
 
 static void nbd_drained_end(void *opaque)
@@ -1580,8 +1798,15 @@ static void nbd_drained_end(void *opaque)
     NBDClient *client;
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
-        client->quiescing = false;
-        nbd_client_receive_next_request(client);
+        qatomic_set(&client->quiescing, false);
+        if (client->ctx) {
+            nbd_client_get(client);
+            aio_bh_schedule_oneshot(client->ctx,
+                                    nbd_client_receive_next_request_bh,
+                                    client);
+        } else {
+            nbd_client_receive_next_request(client);
+        }
     }
 }
 
@@ -1591,18 +1816,25 @@ static bool nbd_drained_poll(void *opaque)
     NBDClient *client;
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
-        if (client->nb_requests != 0) {
-            /*
-             * If there's a coroutine waiting for a request on nbd_read_eof()
-             * enter it here so we don't depend on the client to wake it up.
-             */
+        if (qatomic_read(&client->nb_requests) == 0) {
+            continue;
+        }
+
+        /*
+         * If there's a coroutine waiting for a request on nbd_read_eof()
+         * enter it here so we don't depend on the client to wake it up.
+         */
+        if (!client->ctx) {
             if (client->recv_coroutine != NULL && client->read_yielding) {
                 qemu_aio_coroutine_enter(exp->common.ctx,
                                          client->recv_coroutine);
             }
-
-            return true;
+        } else if (!qatomic_xchg(&client->kick_pending, true)) {
+            nbd_client_get(client);
+            aio_bh_schedule_oneshot(client->ctx, nbd_client_kick_bh, client);
         }
+
+        return true;
     }
 
     return false;
@@ -1772,6 +2004,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1871,6 +2104,68 @@ const BlockExportDriver blk_exp_nbd = {
     .request_shutdown   = nbd_export_request_shutdown,
 };
 
+/*
+ * Like qio_channel_writev_full_all(), but with zero copy enabled, collect
+ * the completions before waiting for the socket.  They are signalled as
+ * an error condition on the socket, which would otherwise wake us up right
+ * away again, for example when all MAX_NBD_REQUESTS are being answered
+ * and no coroutine is left to read them in nbd_read_eof().
+ *
+ * If the kernel runs out of locked memory for a zero copy send, the rest
+ * is copied instead and fewer bytes are kept in flight from now on.
+ */
+static int coroutine_fn nbd_co_writev(NBDClient *client, struct iovec *iov,
+                                      unsigned niov, int flags, Error **errp)
+{
+    struct iovec *local_iov, *local_iov_head;
+    unsigned int nlocal_iov = niov;
+    Error *local_err = NULL;
+    int ret = -EIO;
+
+    if (!client->zero_copy) {
+        return qio_channel_writev_full_all(client->ioc, iov, niov, NULL, 0,
+                                           flags, errp) < 0 ? -EIO : 0;
+    }
+
+    local_iov = local_iov_head = g_new(struct iovec, niov);
+    nlocal_iov = iov_copy(local_iov, nlocal_iov, iov, niov,
+                          0, iov_size(iov, niov));
+
+    while (nlocal_iov > 0) {
+        ssize_t len;
+
+        len = qio_channel_writev_full(client->ioc, local_iov, nlocal_iov,
+                                      NULL, 0, flags, &local_err);
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            nbd_zero_copy_reap(client);
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (len < 0 && errno == ENOBUFS &&
+            (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY)) {
+            error_free(local_err);
+            local_err = NULL;
+            client->zero_copy_max_pending =
+                MAX(client->zero_copy_pending / 2, NBD_ZERO_COPY_MIN_SIZE);
+            trace_nbd_zero_copy_enobufs(client->zero_copy_pending,
+                                        client->zero_copy_max_pending);
+            flags &= ~QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+            continue;
+        }
+        if (len < 0) {
+            error_propagate(errp, local_err);
+            goto out;
+        }
+
+        iov_discard_front(&local_iov, &nlocal_iov, len);
+    }
+
+    ret = 0;
+out:
+    g_free(local_iov_head);
+    return ret;
+}
+
 static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
                                         unsigned niov, Error **errp)
 {
@@ -1880,7 +2175,41 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
-    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    ret = nbd_co_writev(client, iov, niov, 0, errp);
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
+/*
+ * Send a reply whose header is in iov[0] and whose read payload is in
+ * iov[1].  If the client allows it, the payload is sent with zero copy;
+ * the caller then must not free it before nbd_zero_copy_release().
+ */
+static int coroutine_fn nbd_co_send_read_payload(NBDClient *client,
+                                                 struct iovec *iov,
+                                                 Error **errp)
+{
+    int ret;
+
+    if (!client->zero_copy || iov[1].iov_len < NBD_ZERO_COPY_MIN_SIZE ||
+        client->zero_copy_pending >= client->zero_copy_max_pending) {
+        return nbd_co_send_iov(client, iov, 2, errp);
+    }
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    /* The header is on the stack, only the payload can be sent in place */
+    qio_channel_set_cork(client->ioc, true);
+    ret = nbd_co_writev(client, iov, 1, 0, errp);
+    if (ret == 0) {
+        ret = nbd_co_writev(client, &iov[1], 1,
+                            QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, errp);
+    }
+    qio_channel_set_cork(client->ioc, false);
 
     client->send_coroutine = NULL;
     qemu_co_mutex_unlock(&client->send_lock);
@@ -1914,7 +2243,10 @@ static int nbd_co_send_simple_reply(NBDClient *client,
                                    len);
     set_be_simple_reply(&reply, nbd_err, handle);
 
-    return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
+    if (!len) {
+        return nbd_co_send_iov(client, iov, 1, errp);
+    }
+    return nbd_co_send_read_payload(client, iov, errp);
 }
 
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
@@ -1963,7 +2295,7 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_read_payload(client, iov, errp);
 }
 
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
@@ -2007,12 +2339,15 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
 
     while (progress < size) {
         int64_t pnum;
-        int status = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
-                                             offset + progress,
-                                             size - progress, &pnum, NULL,
-                                             NULL);
+        int status;
         bool final;
 
+        nbd_co_enter_export(client);
+        status = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
+                                         offset + progress, size - progress,
+                                         &pnum, NULL, NULL);
+        nbd_co_leave_export(client);
+
         if (status < 0) {
             char *msg = g_strdup_printf("unable to check for holes: %s",
                                         strerror(-status));
@@ -2039,8 +2374,10 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
+            nbd_co_enter_export(client);
             ret = blk_pread(exp->common.blk, offset + progress,
                             data + progress, pnum);
+            nbd_co_leave_export(client);
             if (ret < 0) {
                 error_setg_errno(errp, -ret, "reading from file failed");
                 break;
@@ -2230,11 +2567,13 @@ static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
     unsigned int nb_extents = dont_fragment ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
     g_autoptr(NBDExtentArray) ea = nbd_extent_array_new(nb_extents);
 
+    nbd_co_enter_export(client);
     if (context_id == NBD_META_ID_BASE_ALLOCATION) {
         ret = blockstatus_to_extents(bs, offset, length, ea);
     } else {
         ret = blockalloc_to_extents(bs, offset, length, ea);
     }
+    nbd_co_leave_export(client);
     if (ret < 0) {
         return nbd_co_send_structured_error(
                 client, handle, -ret, "can't get block status", errp);
@@ -2339,6 +2678,9 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
                 error_setg(errp, "No memory");
                 return -ENOMEM;
             }
+            req->data_len = request->len;
+            req->zero_copy = client->zero_copy &&
+                             request->type == NBD_CMD_READ;
         }
     }
 
@@ -2430,7 +2772,9 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
 
     /* XXX: NBD Protocol only documents use of FUA with WRITE */
     if (request->flags & NBD_CMD_FLAG_FUA) {
+        nbd_co_enter_export(client);
         ret = blk_co_flush(exp->common.blk);
+        nbd_co_leave_export(client);
         if (ret < 0) {
             return nbd_send_generic_reply(client, request->handle, ret,
                                           "flush failed", errp);
@@ -2444,7 +2788,9 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    nbd_co_enter_export(client);
     ret = blk_pread(exp->common.blk, request->from, data, request->len);
+    nbd_co_leave_export(client);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "reading from file failed", errp);
@@ -2479,8 +2825,10 @@ static coroutine_fn int nbd_do_cmd_cache(NBDClient *client, NBDRequest *request,
 
     assert(request->type == NBD_CMD_CACHE);
 
+    nbd_co_enter_export(client);
     ret = blk_co_preadv(exp->common.blk, request->from, request->len,
                         NULL, BDRV_REQ_COPY_ON_READ | BDRV_REQ_PREFETCH);
+    nbd_co_leave_export(client);
 
     return nbd_send_generic_reply(client, request->handle, ret,
                                   "caching data failed", errp);
@@ -2511,8 +2859,10 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         if (request->flags & NBD_CMD_FLAG_FUA) {
             flags |= BDRV_REQ_FUA;
         }
+        nbd_co_enter_export(client);
         ret = blk_pwrite(exp->common.blk, request->from, data, request->len,
                          flags);
+        nbd_co_leave_export(client);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "writing to file failed", errp);
 
@@ -2527,8 +2877,10 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         if (request->flags & NBD_CMD_FLAG_FAST_ZERO) {
             flags |= BDRV_REQ_NO_FALLBACK;
         }
+        nbd_co_enter_export(client);
         ret = blk_pwrite_zeroes(exp->common.blk, request->from, request->len,
                                 flags);
+        nbd_co_leave_export(client);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "writing to file failed", errp);
 
@@ -2537,15 +2889,19 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         abort();
 
     case NBD_CMD_FLUSH:
+        nbd_co_enter_export(client);
         ret = blk_co_flush(exp->common.blk);
+        nbd_co_leave_export(client);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "flush failed", errp);
 
     case NBD_CMD_TRIM:
+        nbd_co_enter_export(client);
         ret = blk_co_pdiscard(exp->common.blk, request->from, request->len);
         if (ret >= 0 && request->flags & NBD_CMD_FLAG_FUA) {
             ret = blk_co_flush(exp->common.blk);
         }
+        nbd_co_leave_export(client);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "discard failed", errp);
 
@@ -2632,18 +2988,23 @@ static coroutine_fn void nbd_trip(void *opaque)
         return;
     }
 
-    if (client->quiescing) {
+    /*
+     * Count the request before checking quiescing.  With the barrier in
+     * nbd_drained_begin(), either we see quiescing or nbd_drained_poll()
+     * sees the request, even if the client has its own AioContext.
+     */
+    req = nbd_request_get(client);
+    if (qatomic_read(&client->quiescing)) {
         /*
          * We're switching between AIO contexts. Don't attempt to receive a new
          * request and kick the main context which may be waiting for us.
          */
-        nbd_client_put(client);
         client->recv_coroutine = NULL;
-        aio_wait_kick();
+        nbd_request_put(req);
+        nbd_client_put(client);
         return;
     }
 
-    req = nbd_request_get(client);
     ret = nbd_co_receive_request(req, &request, &local_err);
     client->recv_coroutine = NULL;
 
@@ -2656,7 +3017,10 @@ static coroutine_fn void nbd_trip(void *opaque)
     }
 
     if (ret == -EAGAIN) {
-        assert(client->quiescing);
+        /*
+         * Drained section; for a client with its own AioContext,
+         * nbd_drained_end() may already have cleared quiescing.
+         */
         goto done;
     }
 
@@ -2707,10 +3071,10 @@ disconnect:
 static void nbd_client_receive_next_request(NBDClient *client)
 {
     if (!client->recv_coroutine && client->nb_requests < MAX_NBD_REQUESTS &&
-        !client->quiescing) {
+        !qatomic_read(&client->quiescing) && !client->closing) {
         nbd_client_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, client);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_ctx(client), client->recv_coroutine);
     }
 }
 
@@ -2736,8 +3100,11 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
  * Create a new client listener using the given channel @sioc.
  * Begin servicing it in a coroutine.  When the connection closes, call
  * @close_fn with an indication of whether the client completed negotiation.
+ * If @ctx is non-NULL, requests are received and answered in @ctx instead
+ * of the export's AioContext.
  */
 void nbd_client_new(QIOChannelSocket *sioc,
+                    AioContext *ctx,
                     QCryptoTLSCreds *tlscreds,
                     const char *tlsauthz,
                     void (*close_fn)(NBDClient *, bool))
@@ -2757,6 +3124,9 @@ void nbd_client_new(QIOChannelSocket *sioc,
     client->ioc = QIO_CHANNEL(sioc);
     object_ref(OBJECT(client->ioc));
     client->close_fn = close_fn;
+    client->ctx = ctx;
+    QSIMPLEQ_INIT(&client->zero_copy_bufs);
+    client->zero_copy_max_pending = NBD_ZERO_COPY_MAX_PENDING;
 
     co = qemu_coroutine_create(nbd_co_client_start, client);
     qemu_coroutine_enter(co);
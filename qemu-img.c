@@ -47,8 +47,10 @@
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
 #include "block/block_int.h"
+#include "block/aio_task.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "block/qcow2.h"
 #include "crypto/init.h"
 #include "trace/control.h"
 #include "qemu/throttle.h"
@@ -218,6 +220,11 @@ void help(void)
            "  '-f' first image format\n"
            "  '-F' second image format\n"
            "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "  '-m' specifies how many chunks are compared in parallel (defaults to 8)\n"
+           "\n"
+           "Parameters to rebase subcommand:\n"
+           "  '-m' specifies how many chunks are compared and rewritten in parallel in\n"
+           "       safe mode (defaults to 8)\n"
            "\n"
            "Parameters to dd subcommand:\n"
            "  'bs=BYTES' read and write up to BYTES bytes at a time "
@@ -1272,6 +1279,11 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
     assert(bytes > 0);
 
     res = !!memcmp(buf1, buf2, i);
+    if (!res && !memcmp(buf1 + i, buf2 + i, bytes - i)) {
+        /* One call over the whole buffer is faster than one per sector */
+        *pnum = bytes;
+        return 0;
+    }
     while (i < bytes) {
         int64_t len = MIN(bytes - i, BDRV_SECTOR_SIZE);
 
@@ -1287,44 +1299,247 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 
 #define IO_BUF_SIZE (2 * MiB)
 
-/*
- * Check if passed sectors are empty (not allocated or contain only 0 bytes)
- *
- * Intended for use by 'qemu-img compare': Returns 0 in case sectors are
- * filled with 0, 1 if sectors contain non-zero data (this is a comparison
- * failure), and 4 on error (the exit status for read errors), after emitting
- * an error message.
- *
- * @param blk:  BlockBackend for the image
- * @param offset: Starting offset to check
- * @param bytes: Number of bytes to check
- * @param filename: Name of disk file we are checking (logging purpose)
- * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
- */
-static int check_empty_sectors(BlockBackend *blk, int64_t offset,
-                               int64_t bytes, const char *filename,
-                               uint8_t *buffer, bool quiet)
+#define MAX_COROUTINES 256
+
+static bool parse_num_coroutines(const char *arg, long *num_coroutines)
 {
-    int ret = 0;
-    int64_t idx;
+    if (qemu_strtol(arg, NULL, 0, num_coroutines) ||
+        *num_coroutines < 1 || *num_coroutines > MAX_COROUTINES) {
+        error_report("Invalid number of coroutines. Allowed number of"
+                     " coroutines is between 1 and %d", MAX_COROUTINES);
+        return false;
+    }
+    return true;
+}
 
-    ret = blk_pread(blk, offset, buffer, bytes);
-    if (ret < 0) {
-        error_report("Error while reading offset %" PRId64 " of %s: %s",
-                     offset, filename, strerror(-ret));
-        return 4;
+/* Print how fast -p went through @bytes, starting at @start_us */
+static void print_progress_rate(bool progress, const char *what,
+                                int64_t bytes, int64_t start_us)
+{
+    double secs = (g_get_monotonic_time() - start_us) / 1e6;
+
+    if (!progress) {
+        return;
+    }
+    printf("%s %" PRId64 " MiB in %.1f seconds (%.1f MiB/s)\n",
+           what, bytes / MiB, secs, secs > 0 ? bytes / secs / MiB : 0);
+}
+
+typedef struct ImgCompareState {
+    BlockBackend *blk[2];
+    const char *filename[2];
+    int64_t total_size[2];
+    int64_t progress_base;
+    long num_coroutines;
+    bool strict;
+    bool quiet;
+
+    /*
+     * Chunks are read and compared in parallel, so that a task may find a
+     * difference after another task found one at a higher offset.  Only
+     * the failure at the lowest offset is kept, which is the one that
+     * comparing sequentially would have reported.
+     */
+    int64_t fail_offset;
+    char *fail_msg;
+    int ret; /* exit status, see img_compare() */
+    bool done;
+} ImgCompareState;
+
+typedef struct ImgCompareTask {
+    AioTask task;
+    ImgCompareState *s;
+    int64_t offset;
+    int64_t bytes;
+    /*
+     * Bit i is set if image i is read.  If both are read, they are
+     * compared, otherwise the one image must read as zeroes.
+     */
+    unsigned images;
+} ImgCompareTask;
+
+static void img_compare_fail(ImgCompareState *s, int64_t offset, int ret,
+                             char *msg)
+{
+    if (offset < s->fail_offset) {
+        g_free(s->fail_msg);
+        s->fail_offset = offset;
+        s->fail_msg = msg;
+        s->ret = ret;
+    } else {
+        g_free(msg);
+    }
+}
+
+static int coroutine_fn img_compare_task_entry(AioTask *task)
+{
+    ImgCompareTask *t = container_of(task, ImgCompareTask, task);
+    ImgCompareState *s = t->s;
+    uint8_t *buf[2] = { NULL, NULL };
+    int64_t pnum, idx;
+    int i, ret;
+
+    for (i = 0; i < 2; i++) {
+        if (!(t->images & (1 << i))) {
+            continue;
+        }
+        buf[i] = blk_blockalign(s->blk[i], t->bytes);
+        ret = blk_co_pread(s->blk[i], t->offset, t->bytes, buf[i], 0);
+        if (ret < 0) {
+            img_compare_fail(s, t->offset, 4,
+                             g_strdup_printf("Error while reading offset %"
+                                             PRId64 " of %s: %s", t->offset,
+                                             s->filename[i], strerror(-ret)));
+            goto out;
+        }
+    }
+
+    if (buf[0] && buf[1]) {
+        ret = compare_buffers(buf[0], buf[1], t->bytes, &pnum);
+        if (ret || pnum != t->bytes) {
+            idx = ret ? 0 : pnum;
+        } else {
+            idx = -1;
+        }
+    } else {
+        idx = find_nonzero(buf[0] ?: buf[1], t->bytes);
     }
-    idx = find_nonzero(buffer, bytes);
     if (idx >= 0) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                offset + idx);
-        return 1;
+        img_compare_fail(s, t->offset + idx, 1,
+                         g_strdup_printf("Content mismatch at offset %"
+                                         PRId64 "!", t->offset + idx));
     }
 
+    qemu_progress_print(((float) t->bytes / s->progress_base) * 100, 100);
+out:
+    qemu_vfree(buf[0]);
+    qemu_vfree(buf[1]);
     return 0;
 }
 
+static void coroutine_fn img_compare_start_task(ImgCompareState *s,
+                                                AioTaskPool *pool,
+                                                int64_t offset, int64_t bytes,
+                                                unsigned images)
+{
+    ImgCompareTask *t = g_new(ImgCompareTask, 1);
+
+    *t = (ImgCompareTask) {
+        .task.func = img_compare_task_entry,
+        .s = s,
+        .offset = offset,
+        .bytes = bytes,
+        .images = images,
+    };
+    aio_task_pool_start_task(pool, &t->task);
+}
+
+/*
+ * Walk the block status of both images and start a task for every chunk
+ * whose data must be read.
+ */
+static void coroutine_fn img_compare_co(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    AioTaskPool *pool = aio_task_pool_new(s->num_coroutines);
+    int64_t total_size = MIN(s->total_size[0], s->total_size[1]);
+    int64_t offset = 0;
+    int64_t pnum1, pnum2, chunk;
+
+    while (offset < total_size && !s->fail_msg) {
+        int status1, status2, allocated1, allocated2;
+
+        status1 = bdrv_block_status_above(blk_bs(s->blk[0]), NULL, offset,
+                                          s->total_size[0] - offset, &pnum1,
+                                          NULL, NULL);
+        if (status1 < 0) {
+            img_compare_fail(s, offset, 3,
+                             g_strdup_printf("Sector allocation test failed "
+                                             "for %s", s->filename[0]));
+            break;
+        }
+        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+
+        status2 = bdrv_block_status_above(blk_bs(s->blk[1]), NULL, offset,
+                                          s->total_size[1] - offset, &pnum2,
+                                          NULL, NULL);
+        if (status2 < 0) {
+            img_compare_fail(s, offset, 3,
+                             g_strdup_printf("Sector allocation test failed "
+                                             "for %s", s->filename[1]));
+            break;
+        }
+        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+
+        assert(pnum1 && pnum2);
+        chunk = MIN(pnum1, pnum2);
+
+        if (s->strict) {
+            if (status1 != status2) {
+                img_compare_fail(s, offset, 1,
+                                 g_strdup_printf("Strict mode: Offset %" PRId64
+                                                 " block status mismatch!",
+                                                 offset));
+                break;
+            }
+        }
+        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+            /* nothing to do */
+        } else if (allocated1 == allocated2) {
+            if (allocated1) {
+                chunk = MIN(chunk, IO_BUF_SIZE);
+                img_compare_start_task(s, pool, offset, chunk, 3);
+                offset += chunk;
+                continue;
+            }
+        } else {
+            chunk = MIN(chunk, IO_BUF_SIZE);
+            img_compare_start_task(s, pool, offset, chunk,
+                                   allocated1 ? 1 : 2);
+            offset += chunk;
+            continue;
+        }
+        offset += chunk;
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
+    }
+
+    /* A difference in the common part comes before the size mismatch */
+    aio_task_pool_wait_all(pool);
+
+    if (!s->fail_msg && s->total_size[0] != s->total_size[1]) {
+        int over = s->total_size[0] > s->total_size[1] ? 0 : 1;
+        BlockBackend *blk_over = s->blk[over];
+        int ret;
+
+        qprintf(s->quiet, "Warning: Image size mismatch!\n");
+
+        while (offset < s->progress_base && !s->fail_msg) {
+            ret = bdrv_block_status_above(blk_bs(blk_over), NULL, offset,
+                                          s->progress_base - offset, &chunk,
+                                          NULL, NULL);
+            if (ret < 0) {
+                img_compare_fail(s, offset, 3,
+                                 g_strdup_printf("Sector allocation test "
+                                                 "failed for %s",
+                                                 s->filename[over]));
+                break;
+            }
+            if (ret & BDRV_BLOCK_ALLOCATED && !(ret & BDRV_BLOCK_ZERO)) {
+                chunk = MIN(chunk, IO_BUF_SIZE);
+                img_compare_start_task(s, pool, offset, chunk, 1 << over);
+            } else {
+                qemu_progress_print(((float) chunk / s->progress_base) * 100,
+                                    100);
+            }
+            offset += chunk;
+        }
+        aio_task_pool_wait_all(pool);
+    }
+
+    aio_task_pool_free(pool);
+    s->done = true;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1336,22 +1551,19 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
-    int64_t total_size;
-    int64_t offset = 0;
-    int64_t chunk;
     int c;
-    uint64_t progress_base;
+    uint64_t progress_base = 0;
     bool image_opts = false;
     bool force_share = false;
+    long num_coroutines = 8;
+    int64_t start_us = g_get_monotonic_time();
+    ImgCompareState s;
+    Coroutine *co;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1362,7 +1574,7 @@ static int img_compare(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:T:pqsUm:",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1398,6 +1610,11 @@ static int img_compare(int argc, char **argv)
         case 'U':
             force_share = true;
             break;
+        case 'm':
+            if (!parse_num_coroutines(optarg, &num_coroutines)) {
+                return 2;
+            }
+            break;
         case OPTION_OBJECT:
             {
                 Error *local_err = NULL;
@@ -1455,11 +1672,6 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
-
-    buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1474,7 +1686,6 @@ static int img_compare(int argc, char **argv)
         ret = 4;
         goto out;
     }
-    total_size = MIN(total_size1, total_size2);
     progress_base = MAX(total_size1, total_size2);
 
     qemu_progress_print(0, 100);
@@ -1485,136 +1696,45 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
-
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
-
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
-
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, buf1, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, buf2, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
-        } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
-            }
-        }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+    s = (ImgCompareState) {
+        .blk = { blk1, blk2 },
+        .filename = { filename1, filename2 },
+        .total_size = { total_size1, total_size2 },
+        .progress_base = progress_base,
+        .num_coroutines = num_coroutines,
+        .strict = strict,
+        .quiet = quiet,
+        .fail_offset = INT64_MAX,
+    };
+    co = qemu_coroutine_create(img_compare_co, &s);
+    qemu_coroutine_enter(co);
+    while (!s.done) {
+        main_loop_wait(false);
     }
 
-    if (total_size1 != total_size2) {
-        BlockBackend *blk_over;
-        const char *filename_over;
-
-        qprintf(quiet, "Warning: Image size mismatch!\n");
-        if (total_size1 > total_size2) {
-            blk_over = blk1;
-            filename_over = filename1;
+    if (s.fail_msg) {
+        if (s.ret == 1) {
+            qprintf(quiet, "%s\n", s.fail_msg);
         } else {
-            blk_over = blk2;
-            filename_over = filename2;
-        }
-
-        while (offset < progress_base) {
-            ret = bdrv_block_status_above(blk_bs(blk_over), NULL, offset,
-                                          progress_base - offset, &chunk,
-                                          NULL, NULL);
-            if (ret < 0) {
-                ret = 3;
-                error_report("Sector allocation test failed for %s",
-                             filename_over);
-                goto out;
-
-            }
-            if (ret & BDRV_BLOCK_ALLOCATED && !(ret & BDRV_BLOCK_ZERO)) {
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = check_empty_sectors(blk_over, offset, chunk,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    goto out;
-                }
-            }
-            offset += chunk;
-            qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+            error_report("%s", s.fail_msg);
         }
+        g_free(s.fail_msg);
+        ret = s.ret;
+        goto out;
     }
 
     qprintf(quiet, "Images are identical.\n");
     ret = 0;
 
 out:
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
 out3:
     qemu_progress_end();
+    if (ret == 0) {
+        print_progress_rate(progress, "Compared", progress_base, start_us);
+    }
     return ret;
 }
 
@@ -1641,7 +1761,6 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -2332,10 +2451,7 @@ static int img_convert(int argc, char **argv)
             skip_create = true;
             break;
         case 'm':
-            if (qemu_strtol(optarg, NULL, 0, &s.num_coroutines) ||
-                s.num_coroutines < 1 || s.num_coroutines > MAX_COROUTINES) {
-                error_report("Invalid number of coroutines. Allowed number of"
-                             " coroutines is between 1 and %d", MAX_COROUTINES);
+            if (!parse_num_coroutines(optarg, &s.num_coroutines)) {
                 goto fail_getopt;
             }
             break;
@@ -2635,6 +2751,15 @@ static int img_convert(int argc, char **argv)
         open_opts = qdict_new();
         qemu_opt_foreach(opts, img_add_key_secrets, open_opts, &error_abort);
 
+        /*
+         * Let every coroutine compress or encrypt its data in a thread of
+         * its own instead of waiting for the four threads of the default
+         */
+        if (!strcmp(drv->format_name, "qcow2")) {
+            qdict_put_int(open_opts, "max-threads",
+                          MIN(s.num_coroutines, QCOW2_MAX_THREADS_LIMIT));
+        }
+
         /* Create the new image */
         ret = bdrv_create(drv, out_filename, opts, &local_err);
         if (ret < 0) {
@@ -3455,11 +3580,228 @@ static int img_snapshot(int argc, char **argv)
     return 0;
 }
 
+typedef struct ImgRebaseState {
+    BlockBackend *blk;
+    BlockBackend *blk_old_backing;
+    BlockBackend *blk_new_backing;
+    BlockDriverState *unfiltered_bs;
+    BlockDriverState *prefix_chain_bs;
+    int64_t size;
+    int64_t old_backing_size;
+    int64_t new_backing_size;
+    long num_coroutines;
+    int ret;
+    bool done;
+} ImgRebaseState;
+
+typedef struct ImgRebaseTask {
+    AioTask task;
+    ImgRebaseState *s;
+    int64_t offset;
+    int64_t bytes;
+} ImgRebaseTask;
+
+/*
+ * Copy the parts of the given range that differ between the old and the
+ * new backing file into the COW file.
+ */
+static int coroutine_fn img_rebase_task_entry(AioTask *task)
+{
+    ImgRebaseTask *t = container_of(task, ImgRebaseTask, task);
+    ImgRebaseState *s = t->s;
+    int64_t offset = t->offset;
+    int64_t n = t->bytes;
+    uint8_t *buf_old = blk_blockalign(s->blk, n);
+    uint8_t *buf_new = blk_blockalign(s->blk, n);
+    bool buf_old_is_zero = false;
+    uint64_t written = 0;
+    int ret;
+
+    if (offset >= s->old_backing_size) {
+        memset(buf_old, 0, n);
+        buf_old_is_zero = true;
+    } else {
+        ret = blk_co_pread(s->blk_old_backing, offset, n, buf_old, 0);
+        if (ret < 0) {
+            error_report("error while reading from old backing file");
+            goto out;
+        }
+    }
+
+    if (offset >= s->new_backing_size || !s->blk_new_backing) {
+        memset(buf_new, 0, n);
+    } else {
+        ret = blk_co_pread(s->blk_new_backing, offset, n, buf_new, 0);
+        if (ret < 0) {
+            error_report("error while reading from new backing file");
+            goto out;
+        }
+    }
+
+    /* If they differ, we need to write to the COW file */
+    while (written < n) {
+        int64_t pnum;
+
+        if (compare_buffers(buf_old + written, buf_new + written,
+                            n - written, &pnum))
+        {
+            if (buf_old_is_zero) {
+                ret = blk_co_pwrite_zeroes(s->blk, offset + written, pnum, 0);
+            } else {
+                ret = blk_co_pwrite(s->blk, offset + written,
+                                    pnum, buf_old + written, 0);
+            }
+            if (ret < 0) {
+                error_report("Error while writing to COW image: %s",
+                    strerror(-ret));
+                goto out;
+            }
+        }
+
+        written += pnum;
+    }
+    ret = 0;
+    qemu_progress_print(((float) n / s->size) * 100, 100);
+
+out:
+    qemu_vfree(buf_old);
+    qemu_vfree(buf_new);
+    return ret;
+}
+
+/*
+ * Return how many bytes at @offset, up to @bytes, are known to read as
+ * zeroes from @blk, whose length is @size, or a negative errno value.
+ */
+static int64_t coroutine_fn img_rebase_zero_bytes(BlockBackend *blk,
+                                                  int64_t size,
+                                                  int64_t offset,
+                                                  int64_t bytes)
+{
+    int64_t pnum;
+    int ret;
+
+    if (!blk || offset >= size) {
+        return bytes;
+    }
+
+    ret = bdrv_block_status_above(blk_bs(blk), NULL, offset,
+                                  MIN(bytes, size - offset), &pnum,
+                                  NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    return (ret & BDRV_BLOCK_ZERO) ? pnum : 0;
+}
+
+/*
+ * Check each unallocated cluster in the COW file and start a task for the
+ * ones whose content may change with the new backing file.
+ */
+static void coroutine_fn img_rebase_co(void *opaque)
+{
+    ImgRebaseState *s = opaque;
+    AioTaskPool *pool = aio_task_pool_new(s->num_coroutines);
+    int64_t offset, n, zero_old, zero_new;
+    int ret = 0;
+
+    for (offset = 0; offset < s->size; offset += n) {
+        ImgRebaseTask *t;
+
+        if (aio_task_pool_status(pool) < 0) {
+            break;
+        }
+
+        /* How many bytes can we handle with the next read? */
+        n = MIN(IO_BUF_SIZE, s->size - offset);
+
+        /* If the cluster is allocated, we don't need to take action */
+        ret = bdrv_is_allocated(s->unfiltered_bs, offset, n, &n);
+        if (ret < 0) {
+            error_report("error while reading image metadata: %s",
+                         strerror(-ret));
+            break;
+        }
+        if (ret) {
+            ret = 0;
+            qemu_progress_print(((float) n / s->size) * 100, 100);
+            continue;
+        }
+
+        if (s->prefix_chain_bs) {
+            /*
+             * If cluster wasn't changed since prefix_chain, we don't need
+             * to take action
+             */
+            ret = bdrv_is_allocated_above(bdrv_cow_bs(s->unfiltered_bs),
+                                          s->prefix_chain_bs, false,
+                                          offset, n, &n);
+            if (ret < 0) {
+                error_report("error while reading image metadata: %s",
+                             strerror(-ret));
+                break;
+            }
+            if (!ret) {
+                qemu_progress_print(((float) n / s->size) * 100, 100);
+                continue;
+            }
+            ret = 0;
+        }
+
+        /*
+         * Take into consideration that backing files may be smaller than
+         * the COW image.
+         */
+        if (offset < s->old_backing_size && offset + n > s->old_backing_size) {
+            n = s->old_backing_size - offset;
+        }
+        if (s->blk_new_backing && offset < s->new_backing_size &&
+            offset + n > s->new_backing_size) {
+            n = s->new_backing_size - offset;
+        }
+
+        /* Nothing changes where both backing files read as zeroes */
+        zero_old = img_rebase_zero_bytes(s->blk_old_backing,
+                                         s->old_backing_size, offset, n);
+        zero_new = zero_old <= 0 ? zero_old :
+                   img_rebase_zero_bytes(s->blk_new_backing,
+                                         s->new_backing_size, offset,
+                                         zero_old);
+        if (zero_new < 0) {
+            ret = zero_new;
+            error_report("error while reading image metadata: %s",
+                         strerror(-ret));
+            break;
+        }
+        if (zero_new > 0) {
+            n = zero_new;
+            qemu_progress_print(((float) n / s->size) * 100, 100);
+            continue;
+        }
+
+        t = g_new(ImgRebaseTask, 1);
+        *t = (ImgRebaseTask) {
+            .task.func = img_rebase_task_entry,
+            .s = s,
+            .offset = offset,
+            .bytes = n,
+        };
+        aio_task_pool_start_task(pool, &t->task);
+    }
+
+    aio_task_pool_wait_all(pool);
+    if (!ret) {
+        ret = aio_task_pool_status(pool);
+    }
+    aio_task_pool_free(pool);
+
+    s->ret = ret;
+    s->done = true;
+}
+
 static int img_rebase(int argc, char **argv)
 {
     BlockBackend *blk = NULL, *blk_old_backing = NULL, *blk_new_backing = NULL;
-    uint8_t *buf_old = NULL;
-    uint8_t *buf_new = NULL;
     BlockDriverState *bs = NULL, *prefix_chain_bs = NULL;
     BlockDriverState *unfiltered_bs;
     char *filename;
@@ -3472,6 +3814,9 @@ static int img_rebase(int argc, char **argv)
     bool quiet = false;
     Error *local_err = NULL;
     bool image_opts = false;
+    long num_coroutines = 8;
+    int64_t start_us = g_get_monotonic_time();
+    int64_t rebased_size = 0;
 
     /* Parse commandline parameters */
     fmt = NULL;
@@ -3487,7 +3832,7 @@ static int img_rebase(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:b:upt:T:qU",
+        c = getopt_long(argc, argv, ":hf:F:b:upt:T:qUm:",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -3535,6 +3880,11 @@ static int img_rebase(int argc, char **argv)
         case 'U':
             force_share = true;
             break;
+        case 'm':
+            if (!parse_num_coroutines(optarg, &num_coroutines)) {
+                return 1;
+            }
+            break;
         }
     }
 
@@ -3688,144 +4038,56 @@ static int img_rebase(int argc, char **argv)
      * the image is the same as the original one at any time.
      */
     if (!unsafe) {
-        int64_t size;
-        int64_t old_backing_size = 0;
-        int64_t new_backing_size = 0;
-        uint64_t offset;
-        int64_t n;
-        float local_progress = 0;
-
-        buf_old = blk_blockalign(blk, IO_BUF_SIZE);
-        buf_new = blk_blockalign(blk, IO_BUF_SIZE);
+        ImgRebaseState s = {
+            .blk = blk,
+            .blk_old_backing = blk_old_backing,
+            .blk_new_backing = blk_new_backing,
+            .unfiltered_bs = unfiltered_bs,
+            .prefix_chain_bs = prefix_chain_bs,
+            .num_coroutines = num_coroutines,
+        };
+        Coroutine *co;
 
-        size = blk_getlength(blk);
-        if (size < 0) {
+        s.size = blk_getlength(blk);
+        if (s.size < 0) {
             error_report("Could not get size of '%s': %s",
-                         filename, strerror(-size));
+                         filename, strerror(-s.size));
             ret = -1;
             goto out;
         }
         if (blk_old_backing) {
-            old_backing_size = blk_getlength(blk_old_backing);
-            if (old_backing_size < 0) {
+            s.old_backing_size = blk_getlength(blk_old_backing);
+            if (s.old_backing_size < 0) {
                 char backing_name[PATH_MAX];
 
                 bdrv_get_backing_filename(bs, backing_name,
                                           sizeof(backing_name));
                 error_report("Could not get size of '%s': %s",
-                             backing_name, strerror(-old_backing_size));
+                             backing_name, strerror(-s.old_backing_size));
                 ret = -1;
                 goto out;
             }
         }
         if (blk_new_backing) {
-            new_backing_size = blk_getlength(blk_new_backing);
-            if (new_backing_size < 0) {
+            s.new_backing_size = blk_getlength(blk_new_backing);
+            if (s.new_backing_size < 0) {
                 error_report("Could not get size of '%s': %s",
-                             out_baseimg, strerror(-new_backing_size));
+                             out_baseimg, strerror(-s.new_backing_size));
                 ret = -1;
                 goto out;
             }
         }
 
-        if (size != 0) {
-            local_progress = (float)100 / (size / MIN(size, IO_BUF_SIZE));
+        co = qemu_coroutine_create(img_rebase_co, &s);
+        qemu_coroutine_enter(co);
+        while (!s.done) {
+            main_loop_wait(false);
         }
-
-        for (offset = 0; offset < size; offset += n) {
-            bool buf_old_is_zero = false;
-
-            /* How many bytes can we handle with the next read? */
-            n = MIN(IO_BUF_SIZE, size - offset);
-
-            /* If the cluster is allocated, we don't need to take action */
-            ret = bdrv_is_allocated(unfiltered_bs, offset, n, &n);
-            if (ret < 0) {
-                error_report("error while reading image metadata: %s",
-                             strerror(-ret));
-                goto out;
-            }
-            if (ret) {
-                continue;
-            }
-
-            if (prefix_chain_bs) {
-                /*
-                 * If cluster wasn't changed since prefix_chain, we don't need
-                 * to take action
-                 */
-                ret = bdrv_is_allocated_above(bdrv_cow_bs(unfiltered_bs),
-                                              prefix_chain_bs, false,
-                                              offset, n, &n);
-                if (ret < 0) {
-                    error_report("error while reading image metadata: %s",
-                                 strerror(-ret));
-                    goto out;
-                }
-                if (!ret) {
-                    continue;
-                }
-            }
-
-            /*
-             * Read old and new backing file and take into consideration that
-             * backing files may be smaller than the COW image.
-             */
-            if (offset >= old_backing_size) {
-                memset(buf_old, 0, n);
-                buf_old_is_zero = true;
-            } else {
-                if (offset + n > old_backing_size) {
-                    n = old_backing_size - offset;
-                }
-
-                ret = blk_pread(blk_old_backing, offset, buf_old, n);
-                if (ret < 0) {
-                    error_report("error while reading from old backing file");
-                    goto out;
-                }
-            }
-
-            if (offset >= new_backing_size || !blk_new_backing) {
-                memset(buf_new, 0, n);
-            } else {
-                if (offset + n > new_backing_size) {
-                    n = new_backing_size - offset;
-                }
-
-                ret = blk_pread(blk_new_backing, offset, buf_new, n);
-                if (ret < 0) {
-                    error_report("error while reading from new backing file");
-                    goto out;
-                }
-            }
-
-            /* If they differ, we need to write to the COW file */
-            uint64_t written = 0;
-
-            while (written < n) {
-                int64_t pnum;
-
-                if (compare_buffers(buf_old + written, buf_new + written,
-                                    n - written, &pnum))
-                {
-                    if (buf_old_is_zero) {
-                        ret = blk_pwrite_zeroes(blk, offset + written, pnum, 0);
-                    } else {
-                        ret = blk_pwrite(blk, offset + written,
-                                         buf_old + written, pnum, 0);
-                    }
-                    if (ret < 0) {
-                        error_report("Error while writing to COW image: %s",
-                            strerror(-ret));
-                        goto out;
-                    }
-                }
-
-                written += pnum;
-            }
-            qemu_progress_print(local_progress, 100);
+        ret = s.ret;
+        if (ret < 0) {
+            goto out;
         }
+        rebased_size = s.size;
     }
 
     /*
@@ -3865,13 +4127,14 @@ out:
         blk_unref(blk_old_backing);
         blk_unref(blk_new_backing);
     }
-    qemu_vfree(buf_old);
-    qemu_vfree(buf_new);
 
     blk_unref(blk);
     if (ret) {
         return 1;
     }
+    if (!unsafe) {
+        print_progress_rate(progress, "Rebased", rebased_size, start_us);
+    }
     return 0;
 }
 
@@ -364,7 +364,12 @@ static void nbd_accept(QIONetListener *listener, QIOChannelSocket *cioc,
 
     nb_fds++;
     nbd_update_server_watch();
-    nbd_client_new(cioc, tlscreds, tlsauthz, nbd_client_closed);
+    /*
+     * Clients are served in the main loop.  Unlike nbd-server-start, there
+     * is no "iothreads" option: --object is processed before qemu-nbd forks
+     * and before the main loop exists, so IOThreads can't be created here.
+     */
+    nbd_client_new(cioc, NULL, tlscreds, tlsauthz, nbd_client_closed);
 }
 
 static void nbd_update_server_watch(void)
@@ -0,0 +1,492 @@
+/*
+ * Dirty page rate limit implementation code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "cpu.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qmp/qdict.h"
+#include "sysemu/dirtyrate.h"
+#include "sysemu/dirtylimit.h"
+#include "monitor/hmp.h"
+#include "monitor/monitor.h"
+#include "exec/memory.h"
+#include "hw/boards.h"
+#include "sysemu/kvm.h"
+#include "trace.h"
+
+/*
+ * Stop adjusting the throttle of a vcpu once its dirty page rate is
+ * within DIRTYLIMIT_TOLERANCE_RANGE of the quota.
+ */
+#define DIRTYLIMIT_TOLERANCE_RANGE  25  /* MB/s */
+/*
+ * Adjust the sleep time of a vcpu linearly if the dirty page rate is
+ * off the quota by more than DIRTYLIMIT_LINEAR_ADJUSTMENT_PCT, by a
+ * fixed step otherwise.
+ */
+#define DIRTYLIMIT_LINEAR_ADJUSTMENT_PCT     50
+/*
+ * Max sleep time of a vcpu, as a multiple of the time it takes to fill
+ * its dirty ring.
+ */
+#define DIRTYLIMIT_THROTTLE_PCT_MAX 99
+
+typedef struct VcpuDirtyLimitState {
+    bool enabled;
+    /* Quota of dirty page rate in MB/s, zero if not enabled */
+    uint64_t quota;
+    /* Last measured dirty page rate in MB/s */
+    int64_t current;
+} VcpuDirtyLimitState;
+
+typedef struct DirtyLimitState {
+    /* Indexed by cpu_index */
+    VcpuDirtyLimitState *states;
+    /* Max cpus number configured by user */
+    int max_cpus;
+    /* Number of vcpus with a limit set */
+    int limited_nvcpu;
+    /* Highest dirty page rate seen, used to estimate the ring full time */
+    uint64_t max_dirtyrate;
+    /* Cleared to make the stat thread free the state and exit */
+    bool running;
+} DirtyLimitState;
+
+static DirtyLimitState *dirtylimit_state;
+/* Protects dirtylimit_state and its contents */
+static QemuMutex dirtylimit_mutex;
+
+static void __attribute__((__constructor__)) dirtylimit_mutex_init(void)
+{
+    qemu_mutex_init(&dirtylimit_mutex);
+}
+
+bool dirtylimit_in_service(void)
+{
+    return !!qatomic_read(&dirtylimit_state);
+}
+
+static bool dirtylimit_check_supported(Error **errp)
+{
+    if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "dirty page limit feature requires KVM with"
+                   " accelerator property 'dirty-ring-size' set'");
+        return false;
+    }
+    return true;
+}
+
+static bool dirtylimit_vcpu_index_valid(int64_t cpu_index)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+
+    return cpu_index >= 0 && cpu_index < ms->smp.max_cpus &&
+           qemu_get_cpu(cpu_index);
+}
+
+static inline int64_t dirtylimit_dirty_ring_full_time(DirtyLimitState *s,
+                                                      uint64_t dirtyrate)
+{
+    uint64_t dirty_ring_size_MB =
+        ((uint64_t)kvm_dirty_ring_size() * TARGET_PAGE_SIZE) >> 20;
+
+    if (s->max_dirtyrate < dirtyrate) {
+        s->max_dirtyrate = dirtyrate;
+    }
+
+    return dirty_ring_size_MB * 1000000 / s->max_dirtyrate;
+}
+
+static inline bool dirtylimit_done(uint64_t quota, uint64_t current)
+{
+    uint64_t min, max;
+
+    min = MIN(quota, current);
+    max = MAX(quota, current);
+
+    return (max - min) <= DIRTYLIMIT_TOLERANCE_RANGE;
+}
+
+static inline bool dirtylimit_need_linear_adjustment(uint64_t quota,
+                                                     uint64_t current)
+{
+    uint64_t min, max;
+
+    min = MIN(quota, current);
+    max = MAX(quota, current);
+
+    return ((max - min) * 100 / max) > DIRTYLIMIT_LINEAR_ADJUSTMENT_PCT;
+}
+
+static void dirtylimit_set_throttle(DirtyLimitState *s, CPUState *cpu,
+                                    uint64_t quota, uint64_t current)
+{
+    int64_t ring_full_time_us = 0;
+    uint64_t sleep_pct = 0;
+    int64_t throttle_us = 0;
+
+    if (current == 0) {
+        cpu->throttle_us_per_full = 0;
+        return;
+    }
+
+    ring_full_time_us = dirtylimit_dirty_ring_full_time(s, current);
+
+    if (dirtylimit_need_linear_adjustment(quota, current)) {
+        if (quota < current) {
+            sleep_pct = (current - quota) * 100 / current;
+            throttle_us =
+                ring_full_time_us * sleep_pct / (double)(100 - sleep_pct);
+            cpu->throttle_us_per_full += throttle_us;
+        } else {
+            sleep_pct = (quota - current) * 100 / quota;
+            throttle_us =
+                ring_full_time_us * sleep_pct / (double)(100 - sleep_pct);
+            cpu->throttle_us_per_full -= throttle_us;
+        }
+
+        trace_dirtylimit_throttle_pct(cpu->cpu_index, sleep_pct, throttle_us);
+    } else {
+        if (quota < current) {
+            cpu->throttle_us_per_full += ring_full_time_us / 10;
+        } else {
+            cpu->throttle_us_per_full -= ring_full_time_us / 10;
+        }
+    }
+
+    /*
+     * With a big dirty ring the dirty page rate may never reach the
+     * quota; cap the sleep time so the vcpu still makes progress.
+     */
+    cpu->throttle_us_per_full = MIN(cpu->throttle_us_per_full,
+        ring_full_time_us * DIRTYLIMIT_THROTTLE_PCT_MAX);
+
+    cpu->throttle_us_per_full = MAX(cpu->throttle_us_per_full, 0);
+}
+
+/* Must be called with dirtylimit_mutex held */
+static void dirtylimit_process(DirtyLimitState *s)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimitState *state = &s->states[cpu->cpu_index];
+
+        if (!state->enabled) {
+            continue;
+        }
+        if (!dirtylimit_done(state->quota, state->current)) {
+            dirtylimit_set_throttle(s, cpu, state->quota, state->current);
+        }
+    }
+}
+
+static void dirtylimit_stat_collect(DirtyLimitState *s)
+{
+    VcpuStat stat;
+    int i;
+
+    vcpu_calculate_dirtyrate(DIRTYLIMIT_CALC_TIME_MS, &stat,
+                             GLOBAL_DIRTY_LIMIT, false);
+
+    WITH_QEMU_LOCK_GUARD(&dirtylimit_mutex) {
+        for (i = 0; i < stat.nvcpu; i++) {
+            s->states[stat.rates[i].id].current = stat.rates[i].dirty_rate;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            dirtylimit_process(s);
+        }
+    }
+
+    g_free(stat.rates);
+}
+
+static void *dirtylimit_stat_thread(void *opaque)
+{
+    DirtyLimitState *s = opaque;
+
+    rcu_register_thread();
+
+    while (qatomic_read(&s->running)) {
+        dirtylimit_stat_collect(s);
+    }
+
+    /* dirtylimit_stop() has already unpublished the state */
+    trace_dirtylimit_state_finalize();
+    g_free(s->states);
+    g_free(s);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Must be called with the BQL held */
+static void dirtylimit_start(void)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    DirtyLimitState *s = g_new0(DirtyLimitState, 1);
+    QemuThread thread;
+
+    s->max_cpus = ms->smp.max_cpus;
+    s->states = g_new0(VcpuDirtyLimitState, s->max_cpus);
+    s->running = true;
+
+    trace_dirtylimit_state_initialize(s->max_cpus);
+
+    memory_global_dirty_log_start(GLOBAL_DIRTY_LIMIT);
+
+    WITH_QEMU_LOCK_GUARD(&dirtylimit_mutex) {
+        qatomic_set(&dirtylimit_state, s);
+    }
+
+    qemu_thread_create(&thread, "dirtylimit-stat", dirtylimit_stat_thread,
+                       s, QEMU_THREAD_DETACHED);
+}
+
+/*
+ * Must be called with the BQL held.  The stat thread needs the BQL to
+ * sync the dirty log, so don't wait for it: it frees the old state once
+ * its current measurement is over.  No vcpu is limited at this point,
+ * so that measurement doesn't change any throttle.
+ */
+static void dirtylimit_stop(void)
+{
+    DirtyLimitState *s = NULL;
+    CPUState *cpu;
+
+    WITH_QEMU_LOCK_GUARD(&dirtylimit_mutex) {
+        s = dirtylimit_state;
+        qatomic_set(&dirtylimit_state, NULL);
+        if (s) {
+            qatomic_set(&s->running, false);
+        }
+    }
+    if (!s) {
+        return;
+    }
+
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_LIMIT);
+    CPU_FOREACH(cpu) {
+        cpu->throttle_us_per_full = 0;
+    }
+}
+
+/* Must be called with dirtylimit_mutex held */
+static void dirtylimit_set_vcpu(DirtyLimitState *s, int cpu_index,
+                                uint64_t quota, bool enable)
+{
+    VcpuDirtyLimitState *state = &s->states[cpu_index];
+
+    trace_dirtylimit_set_vcpu(cpu_index, quota);
+
+    if (enable) {
+        if (!state->enabled) {
+            s->limited_nvcpu++;
+        }
+    } else {
+        if (state->enabled) {
+            s->limited_nvcpu--;
+        }
+        qemu_get_cpu(cpu_index)->throttle_us_per_full = 0;
+    }
+
+    state->quota = enable ? quota : 0;
+    state->enabled = enable;
+}
+
+/* Must be called with dirtylimit_mutex held */
+static void dirtylimit_set_all(DirtyLimitState *s, uint64_t quota,
+                               bool enable)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        dirtylimit_set_vcpu(s, cpu->cpu_index, quota, enable);
+    }
+}
+
+void dirtylimit_vcpu_execute(CPUState *cpu)
+{
+    int64_t sleep_us = 0;
+
+    WITH_QEMU_LOCK_GUARD(&dirtylimit_mutex) {
+        if (dirtylimit_state &&
+            dirtylimit_state->states[cpu->cpu_index].enabled) {
+            sleep_us = cpu->throttle_us_per_full;
+        }
+    }
+
+    if (sleep_us) {
+        trace_dirtylimit_vcpu_execute(cpu->cpu_index, sleep_us);
+        g_usleep(sleep_us);
+    }
+}
+
+void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index,
+                                 int64_t cpu_index,
+                                 Error **errp)
+{
+    bool stop = false;
+
+    if (!dirtylimit_check_supported(errp)) {
+        return;
+    }
+
+    if (has_cpu_index && !dirtylimit_vcpu_index_valid(cpu_index)) {
+        error_setg(errp, "incorrect cpu index specified");
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&dirtylimit_mutex) {
+        if (!dirtylimit_state) {
+            return;
+        }
+        if (has_cpu_index) {
+            dirtylimit_set_vcpu(dirtylimit_state, cpu_index, 0, false);
+        } else {
+            dirtylimit_set_all(dirtylimit_state, 0, false);
+        }
+        stop = !dirtylimit_state->limited_nvcpu;
+    }
+
+    if (stop) {
+        dirtylimit_stop();
+    }
+}
+
+void qmp_set_vcpu_dirty_limit(bool has_cpu_index,
+                              int64_t cpu_index,
+                              uint64_t dirty_rate,
+                              Error **errp)
+{
+    if (!dirtylimit_check_supported(errp)) {
+        return;
+    }
+
+    if (has_cpu_index && !dirtylimit_vcpu_index_valid(cpu_index)) {
+        error_setg(errp, "incorrect cpu index specified");
+        return;
+    }
+
+    if (!dirty_rate) {
+        qmp_cancel_vcpu_dirty_limit(has_cpu_index, cpu_index, errp);
+        return;
+    }
+
+    if (!dirtylimit_in_service()) {
+        dirtylimit_start();
+    }
+
+    WITH_QEMU_LOCK_GUARD(&dirtylimit_mutex) {
+        if (has_cpu_index) {
+            dirtylimit_set_vcpu(dirtylimit_state, cpu_index, dirty_rate, true);
+        } else {
+            dirtylimit_set_all(dirtylimit_state, dirty_rate, true);
+        }
+    }
+}
+
+static DirtyLimitInfo *dirtylimit_query_vcpu(DirtyLimitState *s,
+                                             int cpu_index)
+{
+    DirtyLimitInfo *info = g_malloc0(sizeof(*info));
+
+    info->cpu_index = cpu_index;
+    info->limit_rate = s->states[cpu_index].quota;
+    info->current_rate = s->states[cpu_index].current;
+
+    return info;
+}
+
+DirtyLimitInfoList *qmp_query_vcpu_dirty_limit(Error **errp)
+{
+    DirtyLimitInfoList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    QEMU_LOCK_GUARD(&dirtylimit_mutex);
+
+    if (!dirtylimit_state) {
+        return NULL;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (dirtylimit_state->states[cpu->cpu_index].enabled) {
+            QAPI_LIST_APPEND(tail,
+                             dirtylimit_query_vcpu(dirtylimit_state,
+                                                   cpu->cpu_index));
+        }
+    }
+
+    return head;
+}
+
+void hmp_set_vcpu_dirty_limit(Monitor *mon, const QDict *qdict)
+{
+    int64_t dirty_rate = qdict_get_int(qdict, "dirty_rate");
+    int64_t cpu_index = qdict_get_try_int(qdict, "cpu_index", -1);
+    Error *err = NULL;
+
+    if (dirty_rate < 0) {
+        monitor_printf(mon, "Incorrect dirty rate specified!\n");
+        return;
+    }
+
+    qmp_set_vcpu_dirty_limit(cpu_index != -1, cpu_index, dirty_rate, &err);
+    if (err) {
+        hmp_handle_error(mon, err);
+        return;
+    }
+
+    monitor_printf(mon, "[Please use 'info vcpu_dirty_limit' to query "
+                   "dirty limit for virtual CPU]\n");
+}
+
+void hmp_cancel_vcpu_dirty_limit(Monitor *mon, const QDict *qdict)
+{
+    int64_t cpu_index = qdict_get_try_int(qdict, "cpu_index", -1);
+    Error *err = NULL;
+
+    qmp_cancel_vcpu_dirty_limit(cpu_index != -1, cpu_index, &err);
+    if (err) {
+        hmp_handle_error(mon, err);
+        return;
+    }
+
+    monitor_printf(mon, "[Please use 'info vcpu_dirty_limit' to query "
+                   "dirty limit for virtual CPU]\n");
+}
+
+void hmp_info_vcpu_dirty_limit(Monitor *mon, const QDict *qdict)
+{
+    DirtyLimitInfoList *limit, *head, *info = NULL;
+    Error *err = NULL;
+
+    if (!dirtylimit_in_service()) {
+        monitor_printf(mon, "Dirty page limit not enabled!\n");
+        return;
+    }
+
+    info = qmp_query_vcpu_dirty_limit(&err);
+    if (err) {
+        hmp_handle_error(mon, err);
+        return;
+    }
+
+    head = info;
+    for (limit = head; limit != NULL; limit = limit->next) {
+        monitor_printf(mon, "vcpu[%"PRIi64"], limit rate %"PRIu64 " (MB/s),"
+                            " current rate %"PRIu64 " (MB/s)\n",
+                            limit->value->cpu_index,
+                            limit->value->limit_rate,
+                            limit->value->current_rate);
+    }
+
+    qapi_free_DirtyLimitInfoList(info);
+}
@@ -0,0 +1,128 @@
+/*
+ * Xor Based Zero Run Length Encoding speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define XBZRLE_PAGE_SIZE 4096
+#define XBZRLE_BENCH_PAGES 1024
+
+typedef struct XbzrleBenchOpts {
+    const char *name;
+    /* number of modified runs per page */
+    int runs;
+    /* maximum length of each run */
+    int run_len;
+} XbzrleBenchOpts;
+
+static const XbzrleBenchOpts bench_opts[] = {
+    { "unchanged", 0, 0 },
+    { "1-run", 1, 8 },
+    { "sparse", 16, 16 },
+    { "dense", 256, 8 },
+    { "rewritten", 64, 128 },
+};
+
+static void bench_fill(const XbzrleBenchOpts *opts, uint8_t *old,
+                       uint8_t *new)
+{
+    int p, i, j;
+
+    for (p = 0; p < XBZRLE_BENCH_PAGES; p++) {
+        uint8_t *o = old + p * XBZRLE_PAGE_SIZE;
+        uint8_t *n = new + p * XBZRLE_PAGE_SIZE;
+
+        for (i = 0; i < XBZRLE_PAGE_SIZE; i++) {
+            o[i] = g_test_rand_int();
+        }
+        memcpy(n, o, XBZRLE_PAGE_SIZE);
+        for (i = 0; i < opts->runs; i++) {
+            int start = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+            int len = g_test_rand_int_range(1, opts->run_len + 1);
+
+            for (j = start; j < MIN(start + len, XBZRLE_PAGE_SIZE); j++) {
+                n[j] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+}
+
+static void test_encode_speed(void)
+{
+    const size_t total = 4 * GiB;
+    size_t n = ARRAY_SIZE(bench_opts);
+    uint8_t *old[ARRAY_SIZE(bench_opts)], *new[ARRAY_SIZE(bench_opts)];
+    uint8_t *ref[ARRAY_SIZE(bench_opts)];
+    uint8_t *dst = g_malloc(XBZRLE_PAGE_SIZE);
+    int ref_len[ARRAY_SIZE(bench_opts)][XBZRLE_BENCH_PAGES];
+    int accel = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        old[i] = g_malloc(XBZRLE_PAGE_SIZE * XBZRLE_BENCH_PAGES);
+        new[i] = g_malloc(XBZRLE_PAGE_SIZE * XBZRLE_BENCH_PAGES);
+        ref[i] = g_malloc(XBZRLE_PAGE_SIZE * XBZRLE_BENCH_PAGES);
+        bench_fill(&bench_opts[i], old[i], new[i]);
+    }
+
+    /* Implementation 0 is the best one available, the last is plain C */
+    do {
+        for (i = 0; i < n; i++) {
+            size_t remain = total;
+            int p, rc;
+
+            /* the output must not depend on the implementation */
+            for (p = 0; p < XBZRLE_BENCH_PAGES; p++) {
+                uint8_t *r = ref[i] + p * XBZRLE_PAGE_SIZE;
+
+                rc = xbzrle_encode_buffer(old[i] + p * XBZRLE_PAGE_SIZE,
+                                          new[i] + p * XBZRLE_PAGE_SIZE,
+                                          XBZRLE_PAGE_SIZE, dst,
+                                          XBZRLE_PAGE_SIZE);
+                if (!accel) {
+                    ref_len[i][p] = rc;
+                    memcpy(r, dst, MAX(rc, 0));
+                } else {
+                    g_assert_cmpint(rc, ==, ref_len[i][p]);
+                    g_assert(memcmp(r, dst, MAX(rc, 0)) == 0);
+                }
+            }
+
+            g_test_timer_start();
+            while (remain) {
+                for (p = 0; p < XBZRLE_BENCH_PAGES && remain; p++) {
+                    xbzrle_encode_buffer(old[i] + p * XBZRLE_PAGE_SIZE,
+                                         new[i] + p * XBZRLE_PAGE_SIZE,
+                                         XBZRLE_PAGE_SIZE, dst,
+                                         XBZRLE_PAGE_SIZE);
+                    remain -= XBZRLE_PAGE_SIZE;
+                }
+            }
+            g_test_timer_elapsed();
+
+            g_test_message("xbzrle encode(%s): implementation %d "
+                           "%.2f MB/sec", bench_opts[i].name, accel,
+                           total / MiB / g_test_timer_last());
+        }
+        accel++;
+    } while (test_xbzrle_encode_next_accel());
+
+    for (i = 0; i < n; i++) {
+        g_free(ref[i]);
+        g_free(new[i]);
+        g_free(old[i]);
+    }
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/benchmark/encode", test_encode_speed);
+
+    return g_test_run();
+}
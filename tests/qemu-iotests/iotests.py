@@ -391,6 +391,10 @@ def __init__(self, *args):
     def close(self):
         self._p.communicate('q\n')
 
+    def kill(self):
+        self._p.kill()
+        self._p.communicate()
+
     def _read_output(self):
         pattern = 'qemu-io> '
         n = len(pattern)
@@ -15,6 +15,7 @@
 #include "libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -218,6 +219,47 @@ static void read_blocktime(QTestState *who)
     qobject_unref(rsp_return);
 }
 
+/*
+ * Check that the breakdown of the downtime (us) adds up: the phases fit
+ * in the downtime (ms), and every section in the phases it was saved in.
+ */
+static void read_downtime_stats(QTestState *who)
+{
+    QDict *rsp_return, *stats;
+    int64_t downtime, vm_stop, iterable, non_iterable, flush;
+    const QListEntry *entry;
+    QList *sections;
+
+    rsp_return = migrate_query_not_failed(who);
+    downtime = qdict_get_int(rsp_return, "downtime");
+    g_assert(qdict_haskey(rsp_return, "downtime-stats"));
+    stats = qdict_get_qdict(rsp_return, "downtime-stats");
+    vm_stop = qdict_get_int(stats, "vm-stop");
+    iterable = qdict_get_int(stats, "iterable");
+    non_iterable = qdict_get_int(stats, "non-iterable");
+    flush = qdict_get_int(stats, "flush");
+
+    g_assert_cmpint(vm_stop, >=, 0);
+    g_assert_cmpint(iterable, >=, 0);
+    /* Every machine has some device state to save */
+    g_assert_cmpint(non_iterable, >, 0);
+    g_assert_cmpint(flush, >=, 0);
+    g_assert_cmpint(vm_stop + iterable + non_iterable + flush, <=,
+                    (downtime + 1) * 1000);
+
+    sections = qdict_get_qlist(stats, "sections");
+    g_assert(!qlist_empty(sections));
+    QLIST_FOREACH_ENTRY(sections, entry) {
+        QDict *section = qobject_to(QDict, qlist_entry_obj(entry));
+
+        g_assert_cmpstr(qdict_get_str(section, "name"), !=, "");
+        g_assert_cmpint(qdict_get_int(section, "time"), >=, 0);
+        g_assert_cmpint(qdict_get_int(section, "time"), <=,
+                        iterable + non_iterable);
+    }
+    qobject_unref(rsp_return);
+}
+
 static void wait_for_migration_pass(QTestState *who)
 {
     uint64_t initial_pass = get_migration_pass(who);
@@ -969,9 +1011,21 @@ test_migrate_tls_x509_finish(QTestState *from,
 #endif /* CONFIG_TASN1 */
 #endif /* CONFIG_GNUTLS */
 
+/*
+ * A hook that runs after the src and dst QEMUs have been
+ * created, but before the migration is started. This can
+ * be used to set migration parameters and capabilities.
+ *
+ * Returns: NULL, or a pointer to opaque state to be
+ *          later passed to the TestMigrateFinishHook
+ */
+typedef void * (*TestMigrateStartHook)(QTestState *from,
+                                       QTestState *to);
+
 static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     QTestState **to_ptr,
-                                    MigrateStart *args)
+                                    MigrateStart *args,
+                                    TestMigrateStartHook start_hook)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
@@ -991,6 +1045,10 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_parameter_int(from, "max-bandwidth", 30000000);
     migrate_set_parameter_int(from, "downtime-limit", 1);
 
+    if (start_hook) {
+        start_hook(from, to);
+    }
+
     /* Wait for the first serial output from the source */
     wait_for_serial("src_serial");
 
@@ -1018,27 +1076,139 @@ static void migrate_postcopy_complete(QTestState *from, QTestState *to)
     test_migrate_end(from, to, true);
 }
 
-static void test_postcopy(void)
+static void test_postcopy_common(TestMigrateStartHook start_hook)
 {
     MigrateStart args = {};
     QTestState *from, *to;
 
-    if (migrate_postcopy_prepare(&from, &to, &args)) {
+    if (migrate_postcopy_prepare(&from, &to, &args, start_hook)) {
         return;
     }
     migrate_postcopy_start(from, to);
     migrate_postcopy_complete(from, to);
 }
 
-static void test_postcopy_recovery(void)
+static void test_postcopy(void)
+{
+    test_postcopy_common(NULL);
+}
+
+static void *
+test_migrate_postcopy_preempt_start(QTestState *from, QTestState *to)
+{
+    migrate_set_capability(from, "postcopy-preempt", true);
+    migrate_set_capability(to, "postcopy-preempt", true);
+
+    return NULL;
+}
+
+static void test_postcopy_preempt(void)
+{
+    test_postcopy_common(test_migrate_postcopy_preempt_start);
+}
+
+static void *
+test_migrate_postcopy_multifd_start(QTestState *from, QTestState *to)
+{
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+
+    return NULL;
+}
+
+static void test_postcopy_multifd(void)
+{
+    MigrateStart args = {
+        .opts_source = "-global migration.multifd-postcopy=on",
+        .opts_target = "-global migration.multifd-postcopy=on",
+    };
+    QTestState *from, *to;
+    int64_t multifd_bytes;
+
+    if (migrate_postcopy_prepare(&from, &to, &args,
+                                 test_migrate_postcopy_multifd_start)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    multifd_bytes = read_ram_property_int(from, "multifd-bytes");
+
+    /*
+     * The guest keeps dirtying its RAM, so background pages are left
+     * once postcopy starts; they go to the multifd channels in
+     * MULTIFD_FLAG_POSTCOPY packets and must be placed correctly on the
+     * destination, which test_migrate_end() checks.
+     */
+    wait_for_migration_complete(from);
+    g_assert_cmpint(read_ram_property_int(from, "multifd-bytes"), >,
+                    multifd_bytes);
+
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_multifd_recovery(void)
 {
     MigrateStart args = {
         .hide_stderr = true,
+        .opts_source = "-global migration.multifd-postcopy=on",
+        .opts_target = "-global migration.multifd-postcopy=on",
     };
     QTestState *from, *to;
     g_autofree char *uri = NULL;
+    QDict *rsp;
 
-    if (migrate_postcopy_prepare(&from, &to, &args)) {
+    if (migrate_postcopy_prepare(&from, &to, &args,
+                                 test_migrate_postcopy_multifd_start)) {
+        return;
+    }
+
+    /* Multifd channels are accounted in the same rate limit */
+    migrate_set_parameter_int(from, "max-postcopy-bandwidth", 4096);
+    migrate_postcopy_start(from, to);
+    wait_for_migration_status(from, "postcopy-active", NULL);
+
+    /*
+     * The migration is never resumed, so stop the destination while its
+     * page faults are still served: no vCPU may be left waiting for a
+     * page when it quits.
+     */
+    qtest_qmp_discard_response(to, "{ 'execute' : 'stop'}");
+
+    migrate_pause(from);
+    wait_for_migration_status(to, "postcopy-paused",
+                              (const char * []) { "failed", "active",
+                                                  "completed", NULL });
+
+    uri = g_strdup_printf("unix:%s/migsocket-recover", tmpfs);
+    migrate_recover(to, uri);
+    wait_for_migration_status(from, "postcopy-paused",
+                              (const char * []) { "failed", "active",
+                                                  "completed", NULL });
+
+    /* Recovery doesn't re-create the multifd channels */
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate',"
+                          "  'arguments': { 'uri': %s, 'resume': true }}",
+                    uri);
+    g_assert(qdict_haskey(rsp, "error"));
+    g_assert_cmpstr(qdict_get_str(qdict_get_qdict(rsp, "error"), "desc"), ==,
+                    "Postcopy recovery cannot work when multifd-postcopy "
+                    "is set");
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, false);
+}
+
+static void test_postcopy_recovery_common(TestMigrateStartHook start_hook)
+{
+    MigrateStart args = {
+        .hide_stderr = true,
+    };
+    QTestState *from, *to;
+    g_autofree char *uri = NULL;
+
+    if (migrate_postcopy_prepare(&from, &to, &args, start_hook)) {
         return;
     }
 
@@ -1092,6 +1262,17 @@ static void test_postcopy_recovery(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_recovery(void)
+{
+    test_postcopy_recovery_common(NULL);
+}
+
+static void test_postcopy_preempt_recovery(void)
+{
+    /* Both the main and the preempt channel are re-established */
+    test_postcopy_recovery_common(test_migrate_postcopy_preempt_start);
+}
+
 static void test_baddest(void)
 {
     MigrateStart args = {
@@ -1107,17 +1288,6 @@ static void test_baddest(void)
     test_migrate_end(from, to, false);
 }
 
-/*
- * A hook that runs after the src and dst QEMUs have been
- * created, but before the migration is started. This can
- * be used to set migration parameters and capabilities.
- *
- * Returns: NULL, or a pointer to opaque state to be
- *          later passed to the TestMigrateFinishHook
- */
-typedef void * (*TestMigrateStartHook)(QTestState *from,
-                                       QTestState *to);
-
 /*
  * A hook that runs after the migration has finished,
  * regardless of whether it succeeded or failed, but
@@ -1240,6 +1410,7 @@ static void test_precopy_common(MigrateCommon *args)
 
         wait_for_serial("dest_serial");
         wait_for_migration_complete(from);
+        read_downtime_stats(from);
     }
 
     if (args->finish_hook) {
@@ -1260,6 +1431,71 @@ static void test_precopy_unix_plain(void)
     test_precopy_common(&args);
 }
 
+static void *
+test_migrate_parallel_device_state_start(QTestState *from,
+                                         QTestState *to)
+{
+    migrate_set_capability(from, "parallel-device-state", true);
+    migrate_set_capability(to, "parallel-device-state", true);
+
+    return NULL;
+}
+
+/*
+ * Devices flagged as independent (port92 on x86) are saved and loaded
+ * by helper threads.
+ */
+static void test_precopy_unix_parallel_device_state(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start = {
+            .opts_source = "-global migration.x-device-state-threads=4",
+            .opts_target = "-global migration.x-device-state-threads=4",
+        },
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .start_hook = test_migrate_parallel_device_state_start,
+    };
+
+    test_precopy_common(&args);
+}
+
+static void
+test_migrate_dirty_sync_threads_finish(QTestState *from,
+                                       QTestState *to,
+                                       void *opaque)
+{
+    int64_t sync_count = read_ram_property_int(from, "dirty-sync-count");
+    int64_t sync_time = read_ram_property_int(from, "dirty-sync-time");
+    int64_t sync_time_total = read_ram_property_int(from,
+                                                    "dirty-sync-time-total");
+
+    /* The total adds up the time of every sync, the last one included */
+    g_assert_cmpint(sync_count, >=, 3);
+    g_assert_cmpint(sync_time_total, >, 0);
+    g_assert_cmpint(sync_time_total, >=, sync_time);
+}
+
+/*
+ * Every RAMBlock is a chunk of its own, so the bitmap of the guest RAM
+ * and of the ROMs are synchronized by different threads.
+ */
+static void test_precopy_unix_dirty_sync_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start = {
+            .opts_source = "-global migration.x-dirty-sync-threads=4",
+        },
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .finish_hook = test_migrate_dirty_sync_threads_finish,
+        .iterations = 2,
+    };
+
+    test_precopy_common(&args);
+}
 
 static void test_precopy_unix_dirty_ring(void)
 {
@@ -1785,13 +2021,55 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 {
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zstd");
 }
+
+static void *
+test_migrate_precopy_tcp_multifd_zstd_dict_start(QTestState *from,
+                                                 QTestState *to)
+{
+    migrate_set_parameter_int(from, "multifd-zstd-dict-size", 16384);
+    migrate_set_parameter_int(to, "multifd-zstd-dict-size", 16384);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "zstd");
+}
 #endif /* CONFIG_ZSTD */
 
+#ifdef CONFIG_LZ4
+static void *
+test_migrate_precopy_tcp_multifd_lz4_start(QTestState *from,
+                                           QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "lz4");
+}
+#endif /* CONFIG_LZ4 */
+
+static void
+test_migrate_precopy_tcp_multifd_finish(QTestState *from,
+                                        QTestState *to,
+                                        void *opaque)
+{
+    int64_t page_size = read_ram_property_int(from, "page-size");
+    int64_t normal = read_ram_property_int(from, "normal");
+    int64_t duplicate = read_ram_property_int(from, "duplicate");
+    int64_t multifd_bytes = read_ram_property_int(from, "multifd-bytes");
+
+    /*
+     * The guest only dirties part of its RAM, so the channels find zero
+     * pages.  They must be accounted as duplicates and not be counted in
+     * the bytes sent, which only add the packet headers to the normal
+     * pages.
+     */
+    g_assert_cmpint(duplicate, >, 0);
+    g_assert_cmpint(multifd_bytes, >=, normal * page_size);
+    g_assert_cmpint(multifd_bytes - normal * page_size, <,
+                    duplicate * page_size);
+}
+
 static void test_multifd_tcp_none(void)
 {
     MigrateCommon args = {
         .listen_uri = "defer",
         .start_hook = test_migrate_precopy_tcp_multifd_start,
+        .finish_hook = test_migrate_precopy_tcp_multifd_finish,
     };
     test_precopy_common(&args);
 }
@@ -1814,6 +2092,26 @@ static void test_multifd_tcp_zstd(void)
     };
     test_precopy_common(&args);
 }
+
+static void test_multifd_tcp_zstd_dict(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_zstd_dict_start,
+    };
+    test_precopy_common(&args);
+}
+#endif
+
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_lz4_start,
+    };
+    test_precopy_common(&args);
+}
 #endif
 
 #ifdef CONFIG_GNUTLS
@@ -2070,6 +2368,97 @@ static void test_multifd_tcp_cancel(void)
     test_migrate_end(from, to2, true);
 }
 
+/*
+ * Save the stopped source to a mapped-ram file, then load the file
+ * into the destination and check that the guest carries on from there.
+ */
+static void test_mapped_ram_file_common(bool multifd)
+{
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp;
+    g_autofree char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    qtest_qmp_discard_response(from, "{ 'execute' : 'stop'}");
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+
+    rsp = qtest_qmp(to, "{ 'execute': 'migrate-incoming',"
+                        "  'arguments': { 'uri': %s }}", uri);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+}
+
+static void test_mapped_ram_file(void)
+{
+    test_mapped_ram_file_common(false);
+}
+
+static void test_mapped_ram_file_multifd(void)
+{
+    test_mapped_ram_file_common(true);
+}
+
+/* mapped-ram needs to seek in its stream, sockets can't */
+static void test_mapped_ram_socket_uri(void)
+{
+    MigrateStart args = {
+        .hide_stderr = true,
+    };
+    QTestState *from, *to;
+    QDict *rsp;
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "mapped-ram", true);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate',"
+                          "  'arguments': { 'uri': %s }}", uri);
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    /* The incoming side already listens on the socket */
+    rsp = qtest_qmp(to, "{ 'execute': 'migrate-set-capabilities',"
+                        "  'arguments': { 'capabilities': [ {"
+                        "    'capability': 'mapped-ram',"
+                        "    'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, false);
+}
+
 static bool kvm_dirty_ring_supported(void)
 {
 #if defined(__linux__) && defined(HOST_X86_64)
@@ -2093,6 +2482,91 @@ static bool kvm_dirty_ring_supported(void)
 #endif
 }
 
+static void test_vcpu_dirty_limit(void)
+{
+    MigrateStart args = {
+        .hide_stderr = true,
+        .use_dirty_ring = true,
+    };
+    QTestState *from, *to;
+    QDict *rsp, *info;
+    QList *list;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    /* Wait for the guest to start dirtying memory */
+    wait_for_serial("src_serial");
+
+    rsp = qtest_qmp(from, "{ 'execute': 'set-vcpu-dirty-limit',"
+                          "'arguments': { 'cpu-index': 0,"
+                          "               'dirty-rate': 1 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'query-vcpu-dirty-limit' }");
+    list = qdict_get_qlist(rsp, "return");
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    info = qobject_to(QDict, qlist_peek(list));
+    g_assert_cmpint(qdict_get_int(info, "cpu-index"), ==, 0);
+    g_assert_cmpint(qdict_get_int(info, "limit-rate"), ==, 1);
+    qobject_unref(rsp);
+
+    /* A vcpu that doesn't exist can't be limited */
+    rsp = qtest_qmp(from, "{ 'execute': 'set-vcpu-dirty-limit',"
+                          "'arguments': { 'cpu-index': 1024,"
+                          "               'dirty-rate': 1 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'cancel-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'query-vcpu-dirty-limit' }");
+    list = qdict_get_qlist(rsp, "return");
+    g_assert(qlist_empty(list));
+    qobject_unref(rsp);
+
+    /* Limit again while the previous stat thread may still be exiting */
+    rsp = qtest_qmp(from, "{ 'execute': 'set-vcpu-dirty-limit',"
+                          "'arguments': { 'dirty-rate': 1 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'cancel-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, false);
+}
+
+/* Without the KVM dirty ring, both commands must fail */
+static void test_vcpu_dirty_limit_unsupported(void)
+{
+    MigrateStart args = {
+        .hide_stderr = true,
+    };
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    rsp = qtest_qmp(from, "{ 'execute': 'set-vcpu-dirty-limit',"
+                          "'arguments': { 'dirty-rate': 1 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'cancel-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, false);
+}
+
 int main(int argc, char **argv)
 {
     char template[] = "/tmp/migration-test-XXXXXX";
@@ -2135,9 +2609,19 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt/unix", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/preempt/recovery",
+                   test_postcopy_preempt_recovery);
+    qtest_add_func("/migration/postcopy/multifd/unix", test_postcopy_multifd);
+    qtest_add_func("/migration/postcopy/multifd/recovery",
+                   test_postcopy_multifd_recovery);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix/plain", test_precopy_unix_plain);
     qtest_add_func("/migration/precopy/unix/xbzrle", test_precopy_unix_xbzrle);
+    qtest_add_func("/migration/precopy/unix/parallel-device-state",
+                   test_precopy_unix_parallel_device_state);
+    qtest_add_func("/migration/precopy/unix/dirty-sync-threads",
+                   test_precopy_unix_dirty_sync_threads);
 #ifdef CONFIG_GNUTLS
     qtest_add_func("/migration/precopy/unix/tls/psk",
                    test_precopy_unix_tls_psk);
@@ -2183,6 +2667,12 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/mapped-ram/file",
+                   test_mapped_ram_file);
+    qtest_add_func("/migration/mapped-ram/file/multifd",
+                   test_mapped_ram_file_multifd);
+    qtest_add_func("/migration/mapped-ram/socket-uri",
+                   test_mapped_ram_socket_uri);
     qtest_add_func("/migration/multifd/tcp/plain/none",
                    test_multifd_tcp_none);
     qtest_add_func("/migration/multifd/tcp/plain/cancel",
@@ -2192,6 +2682,12 @@ int main(int argc, char **argv)
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/plain/zstd",
                    test_multifd_tcp_zstd);
+    qtest_add_func("/migration/multifd/tcp/plain/zstd/dict",
+                   test_multifd_tcp_zstd_dict);
+#endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/plain/lz4",
+                   test_multifd_tcp_lz4);
 #endif
 #ifdef CONFIG_GNUTLS
     qtest_add_func("/migration/multifd/tcp/tls/psk/match",
@@ -2215,7 +2711,11 @@ int main(int argc, char **argv)
     if (kvm_dirty_ring_supported()) {
         qtest_add_func("/migration/dirty_ring",
                        test_precopy_unix_dirty_ring);
+        qtest_add_func("/migration/vcpu_dirty_limit",
+                       test_vcpu_dirty_limit);
     }
+    qtest_add_func("/migration/vcpu_dirty_limit/unsupported",
+                   test_vcpu_dirty_limit_unsupported);
 
     ret = g_test_run();
 
@@ -771,6 +771,110 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+/* Write @pattern to @sector on @vq and read it back */
+static void write_read_vq(QVirtioDevice *dev, QGuestAllocator *alloc,
+                          QVirtQueue *vq, uint64_t sector, const char *pattern)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t status;
+    char *data;
+    QTestState *qts = global_qtest;
+
+    req.type = VIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    strcpy(req.data, pattern);
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    guest_free(alloc, req_addr);
+
+    req.type = VIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, true, true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    data = g_malloc0(512);
+    memread(req_addr + 16, data, 512);
+    g_assert_cmpstr(data, ==, pattern);
+    g_free(data);
+
+    guest_free(alloc, req_addr);
+}
+
+/*
+ * With x-iothreads=io0,io1 the second virtqueue is processed in io1, out of
+ * the AioContext of the BlockBackend.  Both virtqueues must work, also
+ * after a drained section, which disables and enables the ioeventfds of
+ * io1: block_resize drains the disk.
+ */
+static void iothreads(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtQueue *vq[2];
+    uint64_t features;
+    int i;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    for (i = 0; i < 2; i++) {
+        vq[i] = qvirtqueue_setup(dev, t_alloc, i);
+    }
+
+    qvirtio_set_driver_ok(dev);
+
+    write_read_vq(dev, t_alloc, vq[0], 0, "IO0");
+    write_read_vq(dev, t_alloc, vq[1], 1, "IO1");
+
+    qmp_discard_response("{ 'execute': 'block_resize', "
+                         " 'arguments': { 'device': 'drive0', "
+                         " 'size': %d } }", TEST_IMAGE_SIZE);
+
+    write_read_vq(dev, t_alloc, vq[1], 2, "IO1 AFTER DRAIN");
+    write_read_vq(dev, t_alloc, vq[0], 3, "IO0 AFTER DRAIN");
+
+    for (i = 0; i < 2; i++) {
+        qvirtqueue_cleanup(dev->bus, vq[i], t_alloc);
+    }
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -785,6 +889,15 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_iothreads_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=io0"
+                    " -object iothread,id=io1");
+
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -802,6 +915,13 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.before = virtio_blk_iothreads_setup;
+    opts.edge = (QOSGraphEdgeOptions) {
+        .extra_device_opts = "num-queues=2,len-x-iothreads=2,"
+                             "x-iothreads[0]=io0,x-iothreads[1]=io1",
+    };
+    qos_add_test("iothreads", "virtio-blk-pci", iothreads, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
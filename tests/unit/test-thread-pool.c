@@ -3,6 +3,7 @@
 #include "block/thread-pool.h"
 #include "block/block.h"
 #include "qapi/error.h"
+#include "qapi/qapi-types-misc.h"
 #include "qemu/timer.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
@@ -221,6 +222,83 @@ static void do_test_cancel(bool sync)
     }
 }
 
+static uint64_t histogram_sum(uint64List *list)
+{
+    uint64_t sum = 0;
+    int buckets = 0;
+
+    for (; list; list = list->next) {
+        sum += list->value;
+        buckets++;
+    }
+    g_assert_cmpint(buckets, ==, THREAD_POOL_LATENCY_BUCKETS);
+    return sum;
+}
+
+static void test_stats(void)
+{
+    WorkerTestData data[10];
+    ThreadPoolStats *before, *after;
+    int i;
+
+    before = thread_pool_query_stats(pool);
+
+    for (i = 0; i < 10; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        data[i].aiocb = thread_pool_submit_aio(pool, worker_cb, &data[i],
+                                               done_cb, &data[i]);
+    }
+
+    active = 10;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+
+    after = thread_pool_query_stats(pool);
+    g_assert_cmpint(after->requests - before->requests, ==, 10);
+    g_assert_cmpint(histogram_sum(after->queue_latency) -
+                    histogram_sum(before->queue_latency), ==, 10);
+    g_assert_cmpint(histogram_sum(after->run_latency) -
+                    histogram_sum(before->run_latency), ==, 10);
+    g_assert_cmpint(after->stolen_requests, <=, after->requests);
+
+    qapi_free_ThreadPoolStats(before);
+    qapi_free_ThreadPoolStats(after);
+}
+
+static void test_max_threads(void)
+{
+    WorkerTestData data[10];
+    int i, max;
+
+    /*
+     * Shrinking the pool stops the extra workers; when it grows again the
+     * new workers reuse their deques.
+     */
+    for (max = 1; max <= THREAD_POOL_MAX_THREADS_DEFAULT; max *= 8) {
+        aio_context_set_thread_pool_params(ctx, 0, max, &error_abort);
+
+        for (i = 0; i < 10; i++) {
+            data[i].n = 0;
+            data[i].ret = -EINPROGRESS;
+            data[i].aiocb = thread_pool_submit_aio(pool, worker_cb, &data[i],
+                                                   done_cb, &data[i]);
+        }
+
+        active = 10;
+        while (active > 0) {
+            aio_poll(ctx, true);
+        }
+
+        for (i = 0; i < 10; i++) {
+            g_assert(data[i].aiocb == NULL);
+            g_assert_cmpint(data[i].n, ==, 1);
+            g_assert_cmpint(data[i].ret, ==, 0);
+        }
+    }
+}
+
 static void test_cancel(void)
 {
     do_test_cancel(true);
@@ -242,6 +320,8 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/stats", test_stats);
+    g_test_add_func("/thread-pool/max-threads", test_max_threads);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
@@ -173,6 +173,84 @@ static void test_encode_decode(void)
     }
 }
 
+#define XBZRLE_ACCEL_PAGES 256
+
+static void xbzrle_accel_page(uint8_t *old, uint8_t *new, int n)
+{
+    /* from a few scattered bytes to a page that is mostly rewritten */
+    int changes = 1 << (n % 12);
+    int i, j;
+
+    for (i = 0; i < XBZRLE_PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, XBZRLE_PAGE_SIZE);
+
+    for (i = 0; i < changes; i++) {
+        int start = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+        int len = g_test_rand_int_range(1, 80);
+
+        for (j = start; j < MIN(start + len, XBZRLE_PAGE_SIZE); j++) {
+            new[j] ^= g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(XBZRLE_PAGE_SIZE * XBZRLE_ACCEL_PAGES);
+    uint8_t *new = g_malloc(XBZRLE_PAGE_SIZE * XBZRLE_ACCEL_PAGES);
+    uint8_t *ref = g_malloc(XBZRLE_PAGE_SIZE * XBZRLE_ACCEL_PAGES);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *decoded = g_malloc(XBZRLE_PAGE_SIZE);
+    int ref_len[XBZRLE_ACCEL_PAGES];
+    int dlen[XBZRLE_ACCEL_PAGES];
+    bool first = true;
+    int i, rc;
+
+    for (i = 0; i < XBZRLE_ACCEL_PAGES; i++) {
+        xbzrle_accel_page(old + i * XBZRLE_PAGE_SIZE,
+                          new + i * XBZRLE_PAGE_SIZE, i);
+        /* some pages overflow the destination */
+        dlen[i] = i % 5 ? XBZRLE_PAGE_SIZE
+                        : g_test_rand_int_range(2, XBZRLE_PAGE_SIZE);
+    }
+
+    /* every implementation must produce the same output, byte for byte */
+    do {
+        for (i = 0; i < XBZRLE_ACCEL_PAGES; i++) {
+            uint8_t *o = old + i * XBZRLE_PAGE_SIZE;
+            uint8_t *n = new + i * XBZRLE_PAGE_SIZE;
+            uint8_t *r = ref + i * XBZRLE_PAGE_SIZE;
+
+            rc = xbzrle_encode_buffer(o, n, XBZRLE_PAGE_SIZE, compressed,
+                                      dlen[i]);
+            if (first) {
+                ref_len[i] = rc;
+                if (rc > 0) {
+                    memcpy(r, compressed, rc);
+                    memcpy(decoded, o, XBZRLE_PAGE_SIZE);
+                    g_assert(xbzrle_decode_buffer(compressed, rc, decoded,
+                                                  XBZRLE_PAGE_SIZE) > 0);
+                    g_assert(memcmp(decoded, n, XBZRLE_PAGE_SIZE) == 0);
+                }
+            } else {
+                g_assert_cmpint(rc, ==, ref_len[i]);
+                if (rc > 0) {
+                    g_assert(memcmp(r, compressed, rc) == 0);
+                }
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(decoded);
+    g_free(compressed);
+    g_free(ref);
+    g_free(new);
+    g_free(old);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +263,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
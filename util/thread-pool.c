@@ -16,15 +16,21 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/queue.h"
+#include "qemu/rcu_queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/host-utils.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
+#include "qapi/qapi-types-misc.h"
 
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -35,114 +41,271 @@ enum ThreadState {
 struct ThreadPoolElement {
     BlockAIOCB common;
     ThreadPool *pool;
+    ThreadPoolWorker *worker;
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by worker->lock.
+     * After that, only the worker thread can write to it.  Reads and
+     * writes of state, ret and the timestamps are ordered with memory
+     * barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Timestamps for the latency histograms, start_ns is 0 if cancelled */
+    int64_t submit_ns;
+    int64_t start_ns;
+    int64_t done_ns;
+    bool stolen;
+
+    /* Access to this list is protected by worker->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+/*
+ * Every worker thread owns a deque of requests.  The submitter appends
+ * requests to the deque of one worker, the owner takes them from the head
+ * and workers with an empty deque steal from the other deques before going
+ * to sleep.
+ *
+ * An idle worker sleeps on its own semaphore.  Whoever clears @idle posts
+ * the semaphore, so that submitters wake up a worker without taking the
+ * pool lock; the pool lock is only needed to start and stop threads.
+ *
+ * ThreadPoolWorker structs are reused by new threads and only freed with
+ * the pool, so that requests, the submitter and other workers can walk
+ * pool->workers and dereference them without any reference counting.
+ */
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    QemuSemaphore sem;
+    bool idle;
+
+    QemuMutex lock;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+
+    /* Written with both pool->lock and lock taken.  */
+    bool running;
+
+    /* Written with pool->lock taken.  */
+    QLIST_ENTRY(ThreadPoolWorker) next;
+    QSLIST_ENTRY(ThreadPoolWorker) spawn_next;
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuCond request_cond;
     QEMUBH *new_thread_bh;
 
+    /*
+     * Elements are only added, with pool->lock taken, and removed when the
+     * pool is freed, so the list can be walked from anywhere.
+     */
+    QLIST_HEAD(, ThreadPoolWorker) workers;
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    ThreadPoolWorker *next_worker;
+
+    /*
+     * The following variables are only written from the pool's AioContext,
+     * but may be read from anywhere.
+     */
+    Stat64 requests;
+    Stat64 stolen_requests;
+    Stat64 queue_latency[THREAD_POOL_LATENCY_BUCKETS];
+    Stat64 run_latency[THREAD_POOL_LATENCY_BUCKETS];
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    QSLIST_HEAD(, ThreadPoolWorker) new_workers; /* threads we need to create */
     int cur_threads;
-    int idle_threads;
-    int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     int min_threads;
     int max_threads;
 };
 
+static ThreadPoolElement *take_request_from(ThreadPoolWorker *w, bool steal)
+{
+    ThreadPoolElement *req;
+
+    QEMU_LOCK_GUARD(&w->lock);
+    req = steal ? QTAILQ_LAST(&w->request_list)
+                : QTAILQ_FIRST(&w->request_list);
+    if (req) {
+        QTAILQ_REMOVE(&w->request_list, req, reqs);
+        req->state = THREAD_ACTIVE;
+        req->stolen = steal;
+    }
+    return req;
+}
+
+/*
+ * Takes the oldest request from the worker's own deque, or steals the
+ * newest one from another worker if the own deque is empty.  Returns NULL
+ * if all deques are empty.
+ */
+static ThreadPoolElement *take_request(ThreadPoolWorker *w)
+{
+    ThreadPoolWorker *victim;
+    ThreadPoolElement *req;
+
+    req = take_request_from(w, false);
+    if (req) {
+        return req;
+    }
+
+    QLIST_FOREACH_RCU(victim, &w->pool->workers, next) {
+        if (victim != w) {
+            req = take_request_from(victim, true);
+            if (req) {
+                return req;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void wake_worker(ThreadPoolWorker *w)
+{
+    if (qatomic_xchg(&w->idle, false)) {
+        qemu_sem_post(&w->sem);
+    }
+}
+
+static bool too_many_threads(ThreadPool *pool)
+{
+    return qatomic_read(&pool->cur_threads) > qatomic_read(&pool->max_threads);
+}
+
+/*
+ * Stops the worker if the pool has more than max_threads threads, or more
+ * than min_threads if @timed_out, and nothing was queued for the worker in
+ * the meanwhile.  Returns true if the worker must exit.
+ */
+static bool worker_stop(ThreadPoolWorker *w, bool timed_out)
+{
+    ThreadPool *pool = w->pool;
+    int limit;
+
+    QEMU_LOCK_GUARD(&pool->lock);
+    limit = timed_out ? pool->min_threads : pool->max_threads;
+    if (pool->cur_threads <= limit) {
+        return false;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&w->lock) {
+        if (!QTAILQ_EMPTY(&w->request_list)) {
+            return false;
+        }
+        w->running = false;
+    }
+
+    pool->cur_threads--;
+    qemu_cond_signal(&pool->worker_stopped);
+    return true;
+}
+
+static void run_request(ThreadPool *pool, ThreadPoolElement *req)
+{
+    int ret;
+
+    req->start_ns = get_clock();
+    ret = req->func(req->arg);
+    req->done_ns = get_clock();
+
+    req->ret = ret;
+    /* Write ret and timestamps before state.  */
+    smp_wmb();
+    req->state = THREAD_DONE;
+
+    qemu_bh_schedule(pool->completion_bh);
+}
+
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorker *w = opaque;
+    ThreadPool *pool = w->pool;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
-    while (pool->cur_threads <= pool->max_threads) {
+    for (;;) {
         ThreadPoolElement *req;
         int ret;
 
-        if (QTAILQ_EMPTY(&pool->request_list)) {
-            pool->idle_threads++;
-            ret = qemu_cond_timedwait(&pool->request_cond, &pool->lock, 10000);
-            pool->idle_threads--;
-            if (ret == 0 &&
-                QTAILQ_EMPTY(&pool->request_list) &&
-                pool->cur_threads > pool->min_threads) {
-                /* Timed out + no work to do + no need for warm threads = exit.  */
-                break;
-            }
-            /*
-             * Even if there was some work to do, check if there aren't
-             * too many worker threads before picking it up.
-             */
+        if (too_many_threads(pool) && worker_stop(w, false)) {
+            break;
+        }
+
+        req = take_request(w);
+        if (req) {
+            run_request(pool, req);
             continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        /*
+         * Submitters queue the request before clearing idle, so checking
+         * the deques again after setting idle cannot miss a request.  The
+         * same holds for thread_pool_update_params() and thread_pool_free()
+         * lowering max_threads.
+         */
+        qatomic_set(&w->idle, true);
+        smp_mb();
+        if (too_many_threads(pool) || (req = take_request(w))) {
+            if (!qatomic_xchg(&w->idle, false)) {
+                /* Somebody is posting the semaphore, consume the wakeup */
+                qemu_sem_wait(&w->sem);
+            }
+            if (req) {
+                run_request(pool, req);
+            }
+            continue;
+        }
 
-        ret = req->func(req->arg);
+        ret = qemu_sem_timedwait(&w->sem, 10000);
+        if (ret == 0) {
+            /* Whoever woke us up has cleared idle */
+            continue;
+        }
 
-        req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
-        req->state = THREAD_DONE;
+        if (!qatomic_xchg(&w->idle, false)) {
+            /* Woken up just after the timeout, consume the wakeup */
+            qemu_sem_wait(&w->sem);
+            continue;
+        }
 
-        qemu_bh_schedule(pool->completion_bh);
-        qemu_mutex_lock(&pool->lock);
+        /* Timed out + no work to do + no need for warm threads = exit.  */
+        if (worker_stop(w, true)) {
+            break;
+        }
     }
 
-    pool->cur_threads--;
-    qemu_cond_signal(&pool->worker_stopped);
-    qemu_mutex_unlock(&pool->lock);
-
-    /*
-     * Wake up another thread, in case we got a wakeup but decided
-     * to exit due to pool->cur_threads > pool->max_threads.
-     */
-    qemu_cond_signal(&pool->request_cond);
     return NULL;
 }
 
 static void do_spawn_thread(ThreadPool *pool)
 {
+    ThreadPoolWorker *w;
     QemuThread t;
 
     /* Runs with lock taken.  */
-    if (!pool->new_threads) {
+    w = QSLIST_FIRST(&pool->new_workers);
+    if (!w) {
         return;
     }
 
-    pool->new_threads--;
+    QSLIST_REMOVE_HEAD(&pool->new_workers, spawn_next);
     pool->pending_threads++;
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    qemu_thread_create(&t, "worker", worker_thread, w, QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
@@ -154,10 +317,36 @@ static void spawn_thread_bh_fn(void *opaque)
     qemu_mutex_unlock(&pool->lock);
 }
 
-static void spawn_thread(ThreadPool *pool)
+/*
+ * Returns a worker that accepts requests right away, even though its
+ * thread will only start later.
+ */
+static ThreadPoolWorker *spawn_thread(ThreadPool *pool)
 {
+    ThreadPoolWorker *w;
+
+    /* Runs with lock taken.  Reuse the struct of a thread that exited.  */
+    QLIST_FOREACH(w, &pool->workers, next) {
+        if (!w->running) {
+            break;
+        }
+    }
+
+    if (!w) {
+        w = g_new0(ThreadPoolWorker, 1);
+        w->pool = pool;
+        qemu_sem_init(&w->sem, 0);
+        qemu_mutex_init(&w->lock);
+        QTAILQ_INIT(&w->request_list);
+        QLIST_INSERT_HEAD_RCU(&pool->workers, w, next);
+    }
+
+    WITH_QEMU_LOCK_GUARD(&w->lock) {
+        w->running = true;
+    }
+
     pool->cur_threads++;
-    pool->new_threads++;
+    QSLIST_INSERT_HEAD(&pool->new_workers, w, spawn_next);
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
      * starving the current vcpu.
@@ -168,6 +357,33 @@ static void spawn_thread(ThreadPool *pool)
     if (!pool->pending_threads) {
         qemu_bh_schedule(pool->new_thread_bh);
     }
+    return w;
+}
+
+static int latency_bucket(int64_t ns)
+{
+    uint64_t us = MAX(ns, 0) / SCALE_US;
+
+    return MIN(us ? 64 - clz64(us) : 0, THREAD_POOL_LATENCY_BUCKETS - 1);
+}
+
+static void thread_pool_account(ThreadPool *pool, ThreadPoolElement *elem)
+{
+    /* Read state before timestamps.  */
+    smp_rmb();
+
+    if (!elem->start_ns) {
+        return;
+    }
+
+    stat64_add(&pool->requests, 1);
+    if (elem->stolen) {
+        stat64_add(&pool->stolen_requests, 1);
+    }
+    stat64_add(&pool->queue_latency[latency_bucket(elem->start_ns -
+                                                   elem->submit_ns)], 1);
+    stat64_add(&pool->run_latency[latency_bucket(elem->done_ns -
+                                                 elem->start_ns)], 1);
 }
 
 static void thread_pool_completion_bh(void *opaque)
@@ -185,6 +401,7 @@ restart:
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
+        thread_pool_account(pool, elem);
 
         if (elem->common.cb) {
             /* Read state before ret.  */
@@ -221,9 +438,9 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    QEMU_LOCK_GUARD(&pool->lock);
+    QEMU_LOCK_GUARD(&elem->worker->lock);
     if (elem->state == THREAD_QUEUED) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        QTAILQ_REMOVE(&elem->worker->request_list, elem, reqs);
         qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
@@ -245,6 +462,90 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .get_aio_context    = thread_pool_get_aio_context,
 };
 
+static bool push_request(ThreadPoolWorker *w, ThreadPoolElement *req)
+{
+    QEMU_LOCK_GUARD(&w->lock);
+    if (!w->running) {
+        return false;
+    }
+    req->worker = w;
+    QTAILQ_INSERT_TAIL(&w->request_list, req, reqs);
+    return true;
+}
+
+/*
+ * Queues the request round-robin on a running worker and returns it, or
+ * returns NULL if all threads have exited.
+ */
+static ThreadPoolWorker *push_request_any(ThreadPool *pool,
+                                          ThreadPoolElement *req)
+{
+    ThreadPoolWorker *start, *w;
+
+    start = pool->next_worker ? QLIST_NEXT_RCU(pool->next_worker, next) : NULL;
+    if (!start) {
+        start = QLIST_FIRST_RCU(&pool->workers);
+    }
+
+    w = start;
+    while (w) {
+        if (push_request(w, req)) {
+            pool->next_worker = w;
+            return w;
+        }
+        w = QLIST_NEXT_RCU(w, next);
+        if (!w) {
+            w = QLIST_FIRST_RCU(&pool->workers);
+        }
+        if (w == start) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void queue_request(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolWorker *w;
+
+    /* An idle worker can start the request right away */
+    QLIST_FOREACH_RCU(w, &pool->workers, next) {
+        if (qatomic_read(&w->idle) && push_request(w, req)) {
+            wake_worker(w);
+            return;
+        }
+    }
+
+    /*
+     * All workers are busy; add a thread if allowed, else queue the request
+     * behind those of a busy worker.  Other workers steal it as soon as
+     * they are done with their own deque.  wake_worker() handles the case
+     * where the worker became idle after the loop above.
+     */
+    if (qatomic_read(&pool->cur_threads) >= qatomic_read(&pool->max_threads)) {
+        w = push_request_any(pool, req);
+        if (w) {
+            wake_worker(w);
+            return;
+        }
+    }
+
+    /*
+     * Threads only start and stop with the lock taken, so here there is
+     * either room for a new one or at least one running worker.
+     */
+    qemu_mutex_lock(&pool->lock);
+    if (pool->cur_threads < pool->max_threads) {
+        w = spawn_thread(pool);
+        push_request(w, req);
+    } else {
+        w = push_request_any(pool, req);
+        assert(w);
+    }
+    qemu_mutex_unlock(&pool->lock);
+    wake_worker(w);
+}
+
 BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
         BlockCompletionFunc *cb, void *opaque)
@@ -256,18 +557,14 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
+    req->start_ns = 0;
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
-    }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_cond_signal(&pool->request_cond);
+    queue_request(pool, req);
     return &req->common;
 }
 
@@ -299,8 +596,27 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
 }
 
+ThreadPoolStats *thread_pool_query_stats(ThreadPool *pool)
+{
+    ThreadPoolStats *stats = g_new0(ThreadPoolStats, 1);
+    int i;
+
+    stats->requests = stat64_get(&pool->requests);
+    stats->stolen_requests = stat64_get(&pool->stolen_requests);
+    for (i = THREAD_POOL_LATENCY_BUCKETS - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(stats->queue_latency,
+                          stat64_get(&pool->queue_latency[i]));
+        QAPI_LIST_PREPEND(stats->run_latency,
+                          stat64_get(&pool->run_latency[i]));
+    }
+
+    return stats;
+}
+
 void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
 {
+    ThreadPoolWorker *w;
+
     qemu_mutex_lock(&pool->lock);
 
     pool->min_threads = ctx->thread_pool_min;
@@ -319,8 +635,10 @@ void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
         spawn_thread(pool);
     }
 
-    for (int i = pool->cur_threads; i > pool->max_threads; i--) {
-        qemu_cond_signal(&pool->request_cond);
+    if (pool->cur_threads > pool->max_threads) {
+        QLIST_FOREACH(w, &pool->workers, next) {
+            wake_worker(w);
+        }
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -337,11 +655,11 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
-    qemu_cond_init(&pool->request_cond);
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QLIST_INIT(&pool->workers);
+    QSLIST_INIT(&pool->new_workers);
 
     thread_pool_update_params(pool, ctx);
 }
@@ -355,6 +673,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    ThreadPoolWorker *w, *next;
+
     if (!pool) {
         return;
     }
@@ -365,12 +685,19 @@ void thread_pool_free(ThreadPool *pool)
 
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
-    pool->new_threads = 0;
+    while ((w = QSLIST_FIRST(&pool->new_workers))) {
+        QSLIST_REMOVE_HEAD(&pool->new_workers, spawn_next);
+        WITH_QEMU_LOCK_GUARD(&w->lock) {
+            w->running = false;
+        }
+        pool->cur_threads--;
+    }
 
     /* Wait for worker threads to terminate */
     pool->max_threads = 0;
-    qemu_cond_broadcast(&pool->request_cond);
+    QLIST_FOREACH(w, &pool->workers, next) {
+        wake_worker(w);
+    }
     while (pool->cur_threads > 0) {
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
@@ -378,7 +705,11 @@ void thread_pool_free(ThreadPool *pool)
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
-    qemu_cond_destroy(&pool->request_cond);
+    QLIST_FOREACH_SAFE(w, &pool->workers, next, next) {
+        qemu_mutex_destroy(&w->lock);
+        qemu_sem_destroy(&w->sem);
+        g_free(w);
+    }
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
     g_free(pool);